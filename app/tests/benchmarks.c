@@ -141,6 +141,66 @@ __NO_INLINE static void bench_memcpy(void) {
     free(buf);
 }
 
+#define MALLOC_BENCH_ITER 100000
+#define MALLOC_BENCH_SLOTS 64
+
+static event_t malloc_bench_start;
+
+/* keep a small working set of small objects, replacing one per iteration */
+static int malloc_bench_thread(void *arg) {
+    void *slots[MALLOC_BENCH_SLOTS] = { NULL };
+    uint32_t seed = (uintptr_t)arg * 2654435761u + 1;
+
+    event_wait(&malloc_bench_start);
+
+    for (uint i = 0; i < MALLOC_BENCH_ITER; i++) {
+        seed = seed * 1664525 + 1013904223;
+        uint slot = (seed >> 8) % MALLOC_BENCH_SLOTS;
+
+        free(slots[slot]);
+        slots[slot] = malloc(16 + ((seed >> 16) & 0xf0));
+        if (!slots[slot])
+            return ERR_NO_MEMORY;
+    }
+
+    for (uint i = 0; i < MALLOC_BENCH_SLOTS; i++)
+        free(slots[i]);
+
+    return NO_ERROR;
+}
+
+__NO_INLINE static void bench_malloc_threads(void) {
+    thread_t *threads[SMP_MAX_CPUS];
+
+    for (uint count = 1; count <= SMP_MAX_CPUS; count *= 2) {
+        event_init(&malloc_bench_start, false, 0);
+
+        for (uint i = 0; i < count; i++) {
+            threads[i] = thread_create("malloc bench", &malloc_bench_thread, (void *)(uintptr_t)i,
+                                       DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            thread_resume(threads[i]);
+        }
+
+        lk_bigtime_t start = current_time_hires();
+        event_signal(&malloc_bench_start, true);
+
+        int failed = 0;
+        for (uint i = 0; i < count; i++) {
+            int ret;
+            thread_join(threads[i], &ret, INFINITE_TIME);
+            if (ret < 0)
+                failed++;
+        }
+        lk_bigtime_t elapsed = current_time_hires() - start;
+
+        event_destroy(&malloc_bench_start);
+
+        uint64_t pairs = (uint64_t)count * MALLOC_BENCH_ITER;
+        printf("%u threads: %llu malloc/free pairs in %llu usecs, %llu nsecs per pair%s\n",
+               count, pairs, elapsed, elapsed * 1000 / pairs, failed ? " (allocation failed)" : "");
+    }
+}
+
 #if ARCH_ARM
 __NO_INLINE static void arm_bench_cset_stm(void) {
     uint32_t *buf = malloc(BUFSIZE);
@@ -246,6 +306,8 @@ int benchmarks(int argc, const console_cmd_args *argv) {
     bench_cset_uint64_t();
     bench_cset_wide();
 
+    bench_malloc_threads();
+
 #if ARCH_ARM
     arm_bench_cset_stm();
 
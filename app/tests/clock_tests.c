@@ -13,8 +13,134 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/timer.h>
 #include <platform.h>
 
+struct jitter_stats {
+    lk_time_ns_t min;
+    lk_time_ns_t max;
+    lk_time_ns_t total;
+    uint count;
+};
+
+static void jitter_record(struct jitter_stats *js, lk_time_ns_t late) {
+    if (js->count == 0 || late < js->min)
+        js->min = late;
+    if (late > js->max)
+        js->max = late;
+    js->total += late;
+    js->count++;
+}
+
+static void jitter_print(const char *what, lk_time_ns_t period, const struct jitter_stats *js) {
+    printf("%s, period %llu ns: jitter min %llu avg %llu max %llu ns over %u wakeups\n",
+           what, period, js->min, js->total / js->count, js->max, js->count);
+}
+
+#define JITTER_PERIODIC_COUNT 1000
+
+struct periodic_jitter_args {
+    struct jitter_stats stats;
+    lk_time_ns_t last;
+    lk_time_ns_t period;
+    event_t done;
+};
+
+/* for the periodic timer, jitter is how far each interval strays from the period */
+static enum handler_return periodic_jitter_cb(struct timer *t, lk_time_t now, void *arg) {
+    struct periodic_jitter_args *args = arg;
+
+    lk_time_ns_t ns = current_time_ns();
+    lk_time_ns_t interval = ns - args->last;
+    jitter_record(&args->stats, (interval > args->period) ? interval - args->period : args->period - interval);
+    args->last = ns;
+
+    if (args->stats.count == JITTER_PERIODIC_COUNT) {
+        timer_cancel(t);
+        event_signal(&args->done, false);
+        return INT_RESCHEDULE;
+    }
+    return INT_NO_RESCHEDULE;
+}
+
+/* how late do we wake up, relative to when we asked to */
+static void wakeup_jitter_test(void) {
+    static const lk_time_ns_t periods[] = { 50000, 100000, 1000000 };
+
+    printf("measuring wakeup jitter\n");
+    for (size_t i = 0; i < countof(periods); i++) {
+        struct jitter_stats js = { 0 };
+
+        thread_sleep(10);
+        for (int j = 0; j < 200; j++) {
+            lk_time_ns_t target = current_time_ns() + periods[i];
+            thread_sleep_ns(periods[i]);
+            lk_time_ns_t ns = current_time_ns();
+            jitter_record(&js, (ns > target) ? ns - target : 0);
+        }
+        jitter_print("thread_sleep_ns", periods[i], &js);
+    }
+
+    for (size_t i = 0; i < countof(periods); i++) {
+        struct periodic_jitter_args args = { .period = periods[i] };
+        timer_t timer;
+
+        event_init(&args.done, false, 0);
+        timer_initialize(&timer);
+
+        args.last = current_time_ns();
+        timer_set_periodic_ns(&timer, periods[i], periodic_jitter_cb, &args);
+        event_wait(&args.done);
+        timer_cancel(&timer);
+        event_destroy(&args.done);
+
+        jitter_print("periodic timer", periods[i], &args.stats);
+    }
+}
+
+#define IRQ_LATENCY_COUNT 1000
+
+struct irq_latency_args {
+    struct jitter_stats stats;
+    lk_time_ns_t deadline;
+    event_t done;
+};
+
+/* runs in interrupt context, as close to the timer irq as the kernel gets */
+static enum handler_return irq_latency_cb(struct timer *t, lk_time_t now, void *arg) {
+    struct irq_latency_args *args = arg;
+
+    lk_time_ns_t ns = current_time_ns();
+    jitter_record(&args->stats, (ns > args->deadline) ? ns - args->deadline : 0);
+
+    event_signal(&args->done, false);
+    return INT_RESCHEDULE;
+}
+
+/* how long from a timer deadline passing to its callback running */
+static void irq_latency_test(void) {
+    static const lk_time_ns_t delay = 100000;
+    struct irq_latency_args args = { 0 };
+    timer_t timer;
+
+    printf("measuring timer irq latency\n");
+
+    event_init(&args.done, false, EVENT_FLAG_AUTOUNSIGNAL);
+    timer_initialize(&timer);
+
+    for (int i = 0; i < IRQ_LATENCY_COUNT; i++) {
+        args.deadline = current_time_ns() + delay;
+        timer_set_oneshot_ns(&timer, delay, irq_latency_cb, &args);
+        event_wait(&args.done);
+    }
+    timer_cancel(&timer);
+    event_destroy(&args.done);
+
+    printf("timer irq, delay %llu ns: latency min %llu avg %llu max %llu ns over %u irqs\n",
+           delay, args.stats.min, args.stats.total / args.stats.count, args.stats.max,
+           args.stats.count);
+}
+
 int clock_tests(int argc, const console_cmd_args *argv) {
     ulong c;
     lk_time_t t;
@@ -103,5 +229,8 @@ int clock_tests(int argc, const console_cmd_args *argv) {
         printf("%lu cycles per second\n", cycles);
     }
 
+    wakeup_jitter_test();
+    irq_latency_test();
+
     return NO_ERROR;
 }
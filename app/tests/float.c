@@ -5,7 +5,7 @@
  * license that can be found in the LICENSE file or at
  * https://opensource.org/licenses/MIT
  */
-#if ARM_WITH_VFP || ARCH_ARM64 || X86_WITH_FPU
+#if ARM_WITH_VFP || ARCH_ARM64 || X86_WITH_FPU || RISCV_FPU
 
 #include <stdio.h>
 #include <rand.h>
@@ -55,6 +55,81 @@ static int float_thread(void *arg) {
     return 1;
 }
 
+/*
+ * context switch cost with and without floating point in use.
+ *
+ * a pair of threads pinned to the same cpu yield back and forth. each thread
+ * optionally keeps a floating point accumulator live across the yields, so the
+ * fpu state has to follow it around.
+ */
+#define SWITCH_BENCH_ITERATIONS 10000
+
+static event_t switch_bench_start;
+
+static int switch_bench_thread(void *arg) {
+    bool use_fpu = (uintptr_t)arg;
+    FLOAT acc = 0;
+
+    event_wait(&switch_bench_start);
+
+    for (uint i = 0; i < SWITCH_BENCH_ITERATIONS; i++) {
+        if (use_fpu) {
+            acc += 1.0f;
+        }
+        thread_yield();
+    }
+
+    /* exactly representable, so any lost state shows up here */
+    if (use_fpu && acc != (FLOAT)SWITCH_BENCH_ITERATIONS) {
+        return ERR_GENERIC;
+    }
+    return NO_ERROR;
+}
+
+static void float_context_switch_bench(void) {
+    static const struct {
+        const char *name;
+        bool fpu[2];
+    } cases[] = {
+        { "integer only", { false, false } },
+        { "one fpu thread", { true, false } },
+        { "two fpu threads", { true, true } },
+    };
+
+    printf("context switch benchmark, %u yields per thread:\n", SWITCH_BENCH_ITERATIONS);
+
+    for (uint c = 0; c < countof(cases); c++) {
+        thread_t *t[2];
+
+        event_init(&switch_bench_start, false, 0);
+        for (uint i = 0; i < countof(t); i++) {
+            t[i] = thread_create("switch bench", &switch_bench_thread,
+                                 (void *)(uintptr_t)cases[c].fpu[i], HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+            thread_set_pinned_cpu(t[i], 0);
+            thread_resume(t[i]);
+        }
+
+        lk_bigtime_t start = current_time_hires();
+        event_signal(&switch_bench_start, true);
+
+        status_t err = NO_ERROR;
+        for (uint i = 0; i < countof(t); i++) {
+            int res;
+            thread_join(t[i], &res, INFINITE_TIME);
+            if (res != NO_ERROR) {
+                err = res;
+            }
+        }
+        lk_bigtime_t elapsed = current_time_hires() - start;
+
+        printf("\t%-16s: %llu usecs, %llu nsecs per switch%s\n", cases[c].name,
+               elapsed, elapsed * 1000 / (SWITCH_BENCH_ITERATIONS * countof(t)),
+               (err == NO_ERROR) ? "" : " (fpu state corrupted!)");
+    }
+
+    event_destroy(&switch_bench_start);
+}
+
 #if ARCH_ARM && !ARM_ISA_ARMV7M
 static void arm_float_instruction_trap_test(void) {
     printf("testing fpu trap\n");
@@ -93,6 +168,8 @@ static int float_tests(int argc, const console_cmd_args *argv) {
     }
     printf("the above values should be close\n");
 
+    float_context_switch_bench();
+
 #if ARCH_ARM && !ARM_ISA_ARMV7M
     /* test all the instruction traps */
     arm_float_instruction_trap_test();
@@ -105,4 +182,4 @@ STATIC_COMMAND_START
 STATIC_COMMAND("float_tests", "floating point test", &float_tests)
 STATIC_COMMAND_END(float_tests);
 
-#endif // ARM_WITH_VFP || ARCH_ARM64
+#endif // ARM_WITH_VFP || ARCH_ARM64 || X86_WITH_FPU || RISCV_FPU
@@ -10,12 +10,16 @@
 #include <rand.h>
 #include <lk/err.h>
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <app/tests.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <kernel/rwlock.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
 #include <platform.h>
 #include <arch/atomic.h>
 
@@ -165,7 +169,54 @@ static int mutex_zerotimeout_thread(void *arg) {
     return err;
 }
 
+static volatile int mutex_bench_shared;
+
+static int mutex_bench_thread(void *arg) {
+    mutex_t *m = (mutex_t *)arg;
+
+    for (int i = 0; i < 100000; i++) {
+        mutex_acquire(m);
+        /* short critical section, the case adaptive mutexes are for */
+        for (int j = 0; j < 16; j++)
+            mutex_bench_shared++;
+        mutex_release(m);
+    }
+
+    return 0;
+}
+
+/* hammer one mutex from several threads, timing it in usecs */
+static int mutex_contention_bench(uint flags, lk_bigtime_t *elapsed) {
+    thread_t *threads[4];
+    mutex_t m;
+
+    mutex_init_etc(&m, flags);
+    mutex_bench_shared = 0;
+
+    lk_bigtime_t t = current_time_hires();
+    for (uint i = 0; i < countof(threads); i++) {
+        threads[i] = thread_create("mutex bench", &mutex_bench_thread, &m, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+    for (uint i = 0; i < countof(threads); i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+    }
+    t = current_time_hires() - t;
+
+    mutex_destroy(&m);
+
+    *elapsed = t;
+    if (mutex_bench_shared != (int)countof(threads) * 100000 * 16) {
+        printf("mutex contention test failed: lost updates, %d\n", mutex_bench_shared);
+        return ERR_GENERIC;
+    }
+
+    return 0;
+}
+
 int mutex_test(void) {
+    int ret = 0;
+
     static mutex_t imutex = MUTEX_INITIAL_VALUE(imutex);
     printf("preinitialized mutex:\n");
     hexdump(&imutex, sizeof(imutex));
@@ -186,6 +237,16 @@ int mutex_test(void) {
 
     printf("done with simple mutex tests\n");
 
+    printf("testing mutex contention\n");
+    lk_bigtime_t blocking, adaptive;
+    if (mutex_contention_bench(0, &blocking) == 0 &&
+            mutex_contention_bench(MUTEX_FLAG_ADAPTIVE, &adaptive) == 0) {
+        printf("mutex contention: blocking %llu usecs, adaptive %llu usecs (%llu%% of blocking)\n",
+               blocking, adaptive, blocking ? (adaptive * 100) / blocking : 0);
+    } else {
+        ret = ERR_GENERIC;
+    }
+
     printf("testing mutex timeout\n");
 
     mutex_t timeout_mutex;
@@ -214,6 +275,214 @@ int mutex_test(void) {
 
     mutex_destroy(&timeout_mutex);
 
+    return ret;
+}
+
+/*
+ * Priority inversion: a low priority thread holds a mutex, a high priority
+ * thread wants it, and a medium priority thread hogs the cpu they share. With
+ * priority inheritance the holder runs at the waiter's priority, so the waiter's
+ * latency is bounded by the rest of the critical section instead of the hog.
+ */
+static mutex_t pi_mutex;
+static event_t pi_take_event;
+static event_t pi_held_event;
+static event_t pi_hog_event;
+static volatile bool pi_test_done;
+
+#define PI_HOLD_USECS 2000
+#define PI_HOG_USECS 50000
+
+static void spin_usecs(lk_bigtime_t usecs) {
+    lk_bigtime_t start = current_time_hires();
+    while (current_time_hires() - start < usecs)
+        ;
+}
+
+static int pi_low_thread(void *arg) {
+    for (;;) {
+        event_wait(&pi_take_event);
+        if (pi_test_done)
+            break;
+
+        mutex_acquire(&pi_mutex);
+        event_signal(&pi_held_event, true);
+        spin_usecs(PI_HOLD_USECS);
+        mutex_release(&pi_mutex);
+    }
+
+    return 0;
+}
+
+static int pi_hog_thread(void *arg) {
+    for (;;) {
+        event_wait(&pi_hog_event);
+        if (pi_test_done)
+            break;
+
+        spin_usecs(PI_HOG_USECS);
+    }
+
+    return 0;
+}
+
+static int pi_high_thread(void *arg) {
+    int iterations = (intptr_t)arg;
+    lk_bigtime_t worst = 0;
+    lk_bigtime_t total = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        /* get the low priority thread into its critical section */
+        event_signal(&pi_take_event, false);
+        event_wait(&pi_held_event);
+
+        /* start the hog, then queue up behind the holder */
+        event_signal(&pi_hog_event, false);
+        lk_bigtime_t t = current_time_hires();
+        mutex_acquire(&pi_mutex);
+        t = current_time_hires() - t;
+        mutex_release(&pi_mutex);
+
+        if (t > worst)
+            worst = t;
+        total += t;
+
+        /* let the hog finish its burst */
+        thread_sleep(PI_HOG_USECS / 1000 + 10);
+    }
+
+    printf("high priority waiter latency over %d runs: worst %llu usecs, average %llu usecs "
+           "(%u usec critical section, %u usec hog)\n",
+           iterations, worst, total / iterations, PI_HOLD_USECS, PI_HOG_USECS);
+    if (worst >= PI_HOG_USECS) {
+        printf("priority inheritance test failed: waiter was held up by the hog\n");
+        return ERR_GENERIC;
+    }
+
+    return 0;
+}
+
+static int priority_inheritance_test(void) {
+    const int iterations = 20;
+    thread_t *threads[3];
+
+    printf("testing mutex priority inheritance\n");
+
+    mutex_init(&pi_mutex);
+    event_init(&pi_take_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&pi_held_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&pi_hog_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    pi_test_done = false;
+
+    /* all three need to compete for the same cpu */
+    threads[0] = thread_create("pi low", &pi_low_thread, NULL, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    threads[1] = thread_create("pi hog", &pi_hog_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    threads[2] = thread_create("pi high", &pi_high_thread, (void *)(intptr_t)iterations, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    for (uint i = 0; i < countof(threads); i++) {
+        thread_set_pinned_cpu(threads[i], 0);
+        thread_resume(threads[i]);
+    }
+
+    int ret;
+    thread_join(threads[2], &ret, INFINITE_TIME);
+
+    pi_test_done = true;
+    event_signal(&pi_take_event, false);
+    event_signal(&pi_hog_event, false);
+    thread_join(threads[0], NULL, INFINITE_TIME);
+    thread_join(threads[1], NULL, INFINITE_TIME);
+
+    event_destroy(&pi_take_event);
+    event_destroy(&pi_held_event);
+    event_destroy(&pi_hog_event);
+    mutex_destroy(&pi_mutex);
+
+    if (ret == 0)
+        printf("done with priority inheritance test\n");
+
+    return ret;
+}
+
+static rwlock_t rw_test_lock;
+static volatile int rw_readers;
+static volatile int rw_max_readers;
+static volatile int rw_writers;
+static volatile int rw_errors;
+
+static int rwlock_reader_thread(void *arg) {
+    for (int i = 0; i < 10000; i++) {
+        rwlock_acquire_read(&rw_test_lock);
+        int readers = atomic_add(&rw_readers, 1) + 1;
+        if (rw_writers != 0) {
+            printf("rwlock reader got in alongside a writer\n");
+            atomic_add(&rw_errors, 1);
+        }
+        if (readers > rw_max_readers)
+            rw_max_readers = readers;
+        thread_yield();
+        atomic_add(&rw_readers, -1);
+        rwlock_release_read(&rw_test_lock);
+    }
+
+    return 0;
+}
+
+static int rwlock_writer_thread(void *arg) {
+    for (int i = 0; i < 1000; i++) {
+        rwlock_acquire_write(&rw_test_lock);
+        if (atomic_add(&rw_writers, 1) != 0 || rw_readers != 0) {
+            printf("rwlock writer got in alongside someone else\n");
+            atomic_add(&rw_errors, 1);
+        }
+        thread_yield();
+        atomic_add(&rw_writers, -1);
+        rwlock_release_write(&rw_test_lock);
+        thread_yield();
+    }
+
+    return 0;
+}
+
+static int rwlock_test(void) {
+    thread_t *threads[6];
+
+    printf("testing rwlock\n");
+
+    rwlock_init(&rw_test_lock);
+    rw_readers = rw_max_readers = rw_writers = rw_errors = 0;
+
+    for (uint i = 0; i < countof(threads); i++) {
+        bool writer = (i % 3) == 0;
+        threads[i] = thread_create(writer ? "rwlock writer" : "rwlock reader",
+                                   writer ? &rwlock_writer_thread : &rwlock_reader_thread,
+                                   NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(threads[i]);
+    }
+    for (uint i = 0; i < countof(threads); i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+    }
+    rwlock_destroy(&rw_test_lock);
+
+    printf("up to %d concurrent readers\n", rw_max_readers);
+
+    spin_rwlock_t spin_rw = SPIN_RWLOCK_INITIAL_VALUE;
+    spin_lock_saved_state_t state;
+    spin_rwlock_read_lock_irqsave(&spin_rw, state);
+    spin_rwlock_read_lock(&spin_rw);
+    ASSERT(!spin_rwlock_write_held(&spin_rw));
+    spin_rwlock_read_unlock(&spin_rw);
+    spin_rwlock_read_unlock_irqrestore(&spin_rw, state);
+    spin_rwlock_write_lock_irqsave(&spin_rw, state);
+    ASSERT(spin_rwlock_write_held(&spin_rw));
+    spin_rwlock_write_unlock_irqrestore(&spin_rw, state);
+    ASSERT(spin_rw.state == 0);
+
+    if (rw_errors != 0) {
+        printf("rwlock test failed: %d exclusion violations\n", rw_errors);
+        return ERR_GENERIC;
+    }
+
+    printf("done with rwlock tests\n");
     return 0;
 }
 
@@ -369,6 +638,64 @@ void context_switch_test(void) {
     thread_sleep(100);
 }
 
+static event_t sched_bench_start_event;
+
+static int sched_bench_tester(void *arg) {
+    int iter = (intptr_t)arg;
+
+    event_wait(&sched_bench_start_event);
+
+    for (int i = 0; i < iter; i++) {
+        thread_yield();
+    }
+
+    return 0;
+}
+
+/* measure aggregate scheduler throughput as the number of busy cpus goes up.
+ * two yielding threads are pinned to each cpu in use so every run queue
+ * always has something to switch to. */
+static void sched_throughput_test(void) {
+    const int iter = 100000;
+    thread_t *threads[SMP_MAX_CPUS * 2];
+    uint active[SMP_MAX_CPUS];
+    uint active_count = 0;
+
+    printf("testing scheduler throughput\n");
+
+    /* only pin to cpus that are up, threads pinned to the others never run */
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (mp_is_cpu_active(i))
+            active[active_count++] = i;
+    }
+
+    for (uint cpus = 1; cpus <= active_count; cpus++) {
+        uint thread_count = cpus * 2;
+
+        event_init(&sched_bench_start_event, false, 0);
+
+        for (uint i = 0; i < thread_count; i++) {
+            threads[i] = thread_create("sched bench", &sched_bench_tester, (void *)(intptr_t)iter, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            thread_set_pinned_cpu(threads[i], active[i % cpus]);
+            thread_resume(threads[i]);
+        }
+        thread_sleep(100);
+
+        lk_bigtime_t t = current_time_hires();
+        event_signal(&sched_bench_start_event, true);
+        for (uint i = 0; i < thread_count; i++) {
+            thread_join(threads[i], NULL, INFINITE_TIME);
+        }
+        t = current_time_hires() - t;
+
+        uint64_t yields = (uint64_t)iter * thread_count;
+        printf("%u cpus: %llu yields in %llu usecs, %llu yields per msec\n",
+               cpus, yields, t, t ? (yields * 1000) / t : 0);
+
+        event_destroy(&sched_bench_start_event);
+    }
+}
+
 static volatile int atomic;
 static volatile int atomic_count;
 
@@ -539,7 +866,85 @@ static void join_test(void) {
     printf("thread_join returns err %d, retval %d (should be 0 and 55)\n", err, ret);
 }
 
-static void spinlock_test(void) {
+#if WITH_SMP
+static spin_lock_t contention_lock;
+static volatile bool contention_stop;
+static volatile int contention_shared;
+static event_t contention_start_event;
+
+static int spinlock_contention_thread(void *arg) {
+    ulong *count = (ulong *)arg;
+    spin_lock_saved_state_t state;
+
+    event_wait(&contention_start_event);
+
+    while (!contention_stop) {
+        spin_lock_irqsave(&contention_lock, state);
+        contention_shared++;
+        spin_unlock_irqrestore(&contention_lock, state);
+        (*count)++;
+    }
+
+    return 0;
+}
+
+/* one thread per cpu hammering a single lock for a second. a fair lock
+ * should give every cpu about the same share of the acquisitions. */
+static int spinlock_contention_test(void) {
+    thread_t *threads[SMP_MAX_CPUS];
+    ulong counts[SMP_MAX_CPUS];
+    uint cpus = 0;
+
+    spin_lock_init(&contention_lock);
+    event_init(&contention_start_event, false, 0);
+    contention_stop = false;
+    contention_shared = 0;
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!mp_is_cpu_active(i))
+            continue;
+        counts[cpus] = 0;
+        threads[cpus] = thread_create("spinlock contention", &spinlock_contention_thread, &counts[cpus],
+                                      DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(threads[cpus], i);
+        thread_resume(threads[cpus]);
+        cpus++;
+    }
+    if (cpus < 2) {
+        printf("spinlock contention test needs at least 2 cpus\n");
+        contention_stop = true;
+    }
+
+    event_signal(&contention_start_event, true);
+    if (!contention_stop) {
+        thread_sleep(1000);
+        contention_stop = true;
+    }
+
+    ulong total = 0, min = ULONG_MAX, max = 0;
+    for (uint i = 0; i < cpus; i++) {
+        thread_join(threads[i], NULL, INFINITE_TIME);
+        total += counts[i];
+        min = MIN(min, counts[i]);
+        max = MAX(max, counts[i]);
+    }
+    event_destroy(&contention_start_event);
+
+    if (total != (ulong)contention_shared) {
+        printf("spinlock contention test failed: lost updates, %d != %lu\n", contention_shared, total);
+        return ERR_GENERIC;
+    }
+
+    if (cpus >= 2) {
+        printf("%u cpus contending: %lu acquisitions in 1 second, per cpu min %lu max %lu (min is %lu%% of max)\n",
+               cpus, total, min, max, max ? (min * 100) / max : 0);
+    }
+
+    return 0;
+}
+#endif
+
+static int spinlock_test(void) {
     spin_lock_saved_state_t state;
     spin_lock_t lock;
 
@@ -576,24 +981,39 @@ static void spinlock_test(void) {
 
     printf("%u cycles to acquire/release lock w/irqsave %u times (%u cycles per)\n", c, COUNT, c / COUNT);
 #undef COUNT
+
+#if WITH_SMP
+    return spinlock_contention_test();
+#else
+    return 0;
+#endif
 }
 
 int thread_tests(int argc, const console_cmd_args *argv) {
-    mutex_test();
+    int ret = 0;
+
+    if (mutex_test() != 0)
+        ret = ERR_GENERIC;
+    if (priority_inheritance_test() != 0)
+        ret = ERR_GENERIC;
+    if (rwlock_test() != 0)
+        ret = ERR_GENERIC;
     semaphore_test();
     event_test();
 
-    spinlock_test();
+    if (spinlock_test() != 0)
+        ret = ERR_GENERIC;
     atomic_test();
 
     thread_sleep(200);
     context_switch_test();
+    sched_throughput_test();
 
     preempt_test();
 
     join_test();
 
-    return 0;
+    return ret;
 }
 
 static int spinner_thread(void *arg) {
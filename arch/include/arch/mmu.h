@@ -46,6 +46,28 @@ vaddr_t arch_mmu_pick_spot(arch_aspace_t *aspace,
                            vaddr_t end,  uint next_region_arch_mmu_flags,
                            vaddr_t align, size_t size, uint arch_mmu_flags) __NONNULL((1));
 
+#if ARCH_MMU_NEEDS_TLB_SHOOTDOWN
+/* invalidate any cached translations for a range on the current cpu only.
+ * set by architectures whose tlb maintenance is not broadcast in hardware,
+ * the vm layer uses it to service remote shootdowns.
+ */
+void arch_mmu_invalidate_tlb_local(arch_aspace_t *aspace, vaddr_t vaddr, uint count) __NONNULL((1));
+
+/* invalidate every cached translation for the aspace, including the walks
+ * through its page tables, on the current cpu only.
+ */
+void arch_mmu_invalidate_tlb_all_local(arch_aspace_t *aspace) __NONNULL((1));
+
+/* page tables emptied by arch_mmu_unmap() may still be cached by other cpus'
+ * table walkers, which a per page invalidate doesn't reach, so they aren't
+ * freed right away. move them to list, as vm_page_ts, for the vm layer to free
+ * once the whole aspace has been invalidated everywhere it may be cached.
+ * returns the number of pages moved.
+ */
+struct list_node;
+size_t arch_mmu_take_free_ptables(arch_aspace_t *aspace, struct list_node *list) __NONNULL((1, 2));
+#endif
+
 /* load a new user address space context.
  * aspace argument NULL should unload user space.
  */
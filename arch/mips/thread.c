@@ -27,7 +27,7 @@ static void initial_thread_func(void) {
 #endif
 
     /* release the thread lock that was implicitly held across the reschedule */
-    spin_unlock(&thread_lock);
+    spin_unlock(thread_curr_cpu_lock());
     arch_enable_ints();
 
     int ret = ct->entry(ct->arg);
@@ -36,12 +36,22 @@ void riscv_configure_percpu_early(uint hart_id) {
 // first C level code to initialize each cpu
 void riscv_early_init_percpu(void) {
     // set the top level exception handler
+#if RISCV_VECTORED_TRAPS
+    // vectored mode, interrupts go directly to their own entry point
+    riscv_csr_write(RISCV_CSR_XTVEC, (uintptr_t)&riscv_vector_table | 1);
+#else
     riscv_csr_write(RISCV_CSR_XTVEC, (uintptr_t)&riscv_exception_entry);
+#endif
 
     // mask all exceptions, just in case
     riscv_csr_clear(RISCV_CSR_XSTATUS, RISCV_CSR_XSTATUS_IE);
     riscv_csr_clear(RISCV_CSR_XIE, RISCV_CSR_XIE_SIE | RISCV_CSR_XIE_TIE | RISCV_CSR_XIE_EIE);
 
+#if RISCV_FPU
+    // leave the fpu off until a thread uses it
+    riscv_csr_clear(RISCV_CSR_XSTATUS, RISCV_CSR_XSTATUS_FS_MASK);
+#endif
+
     // enable cycle counter (disabled for now, unimplemented on sifive-e)
     //riscv_csr_set(mcounteren, 1);
 }
@@ -66,6 +76,10 @@ void riscv_init_percpu(void) {
 void arch_init(void) {
     riscv_init_percpu();
 
+#if RISCV_MMU
+    riscv_mmu_init();
+#endif
+
     // print some arch info
 #if RISCV_M_MODE
     dprintf(INFO, "RISCV: Machine mode\n");
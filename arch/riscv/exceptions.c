@@ -10,6 +10,9 @@
 #include <lk/trace.h>
 #include <arch/riscv.h>
 #include <kernel/thread.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -83,6 +86,42 @@ static void fatal_exception(long cause, ulong epc, struct riscv_short_iframe *fr
     }
 }
 
+#if WITH_KERNEL_VM
+static void riscv_page_fault(long cause, ulong epc, struct riscv_short_iframe *frame) {
+    vaddr_t addr = riscv_csr_read(RISCV_CSR_XTVAL);
+
+    uint pf_flags = 0;
+    if (cause == RISCV_EXCEPTION_STORE_PAGE_FAULT) {
+        pf_flags |= VMM_PF_FLAG_WRITE;
+    } else if (cause == RISCV_EXCEPTION_INS_PAGE_FAULT) {
+        pf_flags |= VMM_PF_FLAG_INSTRUCTION;
+    }
+    if ((frame->status & RISCV_CSR_XSTATUS_PP_MASK) == 0) {
+        pf_flags |= VMM_PF_FLAG_USER;
+    }
+
+    LTRACEF("addr %#lx, pf_flags %#x, epc %#lx\n", addr, pf_flags, epc);
+
+    // resolving the fault may block, which is only ok if the faulting code could have
+    if (!(frame->status & RISCV_CSR_XSTATUS_PIE)) {
+        printf("page fault at %#lx with interrupts disabled\n", addr);
+        fatal_exception(cause, epc, frame);
+    }
+
+    arch_enable_ints();
+    status_t err = vmm_page_fault_handler(addr, pf_flags);
+    arch_disable_ints();
+
+    if (err < 0) {
+        printf("unhandled page fault at %#lx, pf_flags %#x, err %d\n", addr, pf_flags, err);
+        fatal_exception(cause, epc, frame);
+    }
+
+    // the new entry is only guaranteed to be seen by the table walker after a fence
+    __asm__ volatile("sfence.vma %0, zero" :: "r"(addr) : "memory");
+}
+#endif
+
 void riscv_exception_handler(long cause, ulong epc, struct riscv_short_iframe *frame) {
     LTRACEF("hart %u cause %#lx epc %#lx status %#lx\n",
             riscv_current_hart(), cause, epc, frame->status);
@@ -109,6 +148,23 @@ void riscv_exception_handler(long cause, ulong epc, struct riscv_short_iframe *f
     } else {
         // all synchronous traps go here
         switch (cause) {
+#if RISCV_FPU
+            case RISCV_EXCEPTION_ILLEGAL_INS:
+                // first floating point instruction since the fpu was turned off
+                // at a context switch. anything else is a real illegal instruction.
+                if ((frame->status & RISCV_CSR_XSTATUS_FS_MASK) == RISCV_CSR_XSTATUS_FS_OFF) {
+                    riscv_fpu_exception();
+                    break;
+                }
+                fatal_exception(cause, epc, frame);
+#endif
+#if WITH_KERNEL_VM
+            case RISCV_EXCEPTION_INS_PAGE_FAULT:
+            case RISCV_EXCEPTION_LOAD_PAGE_FAULT:
+            case RISCV_EXCEPTION_STORE_PAGE_FAULT:
+                riscv_page_fault(cause, epc, frame);
+                break;
+#endif
             default:
                 fatal_exception(cause, epc, frame);
         }
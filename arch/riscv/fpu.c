@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2026 The LK Contributors
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <assert.h>
+#include <lk/compiler.h>
+#include <lk/trace.h>
+#include <kernel/thread.h>
+#include <arch/riscv.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * Lazy F/D register switching.
+ *
+ * The fpu is turned off (xstatus.FS = Off) on every context switch, after saving
+ * the outgoing thread's registers if the hardware marked them Dirty. The first
+ * floating point instruction a thread executes afterwards traps as an illegal
+ * instruction and riscv_fpu_exception() turns the fpu back on, reloading the
+ * thread's registers only if something else has used this cpu's fpu since.
+ * Threads that never touch floating point never save or load anything.
+ */
+
+// which thread's state is currently in each cpu's fpu registers
+static struct fpstate *current_fpstate[SMP_MAX_CPUS];
+
+static void riscv_fpu_load_state(struct thread *t) {
+    uint cpu = arch_curr_cpu_num();
+    struct fpstate *fpstate = &t->arch.fpstate;
+
+    if (fpstate == current_fpstate[cpu] && fpstate->current_cpu == cpu) {
+        LTRACEF("cpu %u, thread %s, fpstate already valid\n", cpu, t->name);
+        return;
+    }
+    LTRACEF("cpu %u, thread %s, load fpstate %p, last cpu %u, last fpstate %p\n",
+            cpu, t->name, fpstate, fpstate->current_cpu, current_fpstate[cpu]);
+    fpstate->current_cpu = cpu;
+    current_fpstate[cpu] = fpstate;
+
+    STATIC_ASSERT(sizeof(fpstate->regs) == 8 * 32);
+    __asm__ volatile(
+                     "fld     f0, (0 * 8)(%0)\n"
+                     "fld     f1, (1 * 8)(%0)\n"
+                     "fld     f2, (2 * 8)(%0)\n"
+                     "fld     f3, (3 * 8)(%0)\n"
+                     "fld     f4, (4 * 8)(%0)\n"
+                     "fld     f5, (5 * 8)(%0)\n"
+                     "fld     f6, (6 * 8)(%0)\n"
+                     "fld     f7, (7 * 8)(%0)\n"
+                     "fld     f8, (8 * 8)(%0)\n"
+                     "fld     f9, (9 * 8)(%0)\n"
+                     "fld     f10, (10 * 8)(%0)\n"
+                     "fld     f11, (11 * 8)(%0)\n"
+                     "fld     f12, (12 * 8)(%0)\n"
+                     "fld     f13, (13 * 8)(%0)\n"
+                     "fld     f14, (14 * 8)(%0)\n"
+                     "fld     f15, (15 * 8)(%0)\n"
+                     "fld     f16, (16 * 8)(%0)\n"
+                     "fld     f17, (17 * 8)(%0)\n"
+                     "fld     f18, (18 * 8)(%0)\n"
+                     "fld     f19, (19 * 8)(%0)\n"
+                     "fld     f20, (20 * 8)(%0)\n"
+                     "fld     f21, (21 * 8)(%0)\n"
+                     "fld     f22, (22 * 8)(%0)\n"
+                     "fld     f23, (23 * 8)(%0)\n"
+                     "fld     f24, (24 * 8)(%0)\n"
+                     "fld     f25, (25 * 8)(%0)\n"
+                     "fld     f26, (26 * 8)(%0)\n"
+                     "fld     f27, (27 * 8)(%0)\n"
+                     "fld     f28, (28 * 8)(%0)\n"
+                     "fld     f29, (29 * 8)(%0)\n"
+                     "fld     f30, (30 * 8)(%0)\n"
+                     "fld     f31, (31 * 8)(%0)\n"
+                     "fscsr   %1\n"
+                     :: "r"(fpstate->regs), "r"(fpstate->fcsr)
+                     : "memory");
+}
+
+void riscv_fpu_save_state(struct thread *t) {
+    struct fpstate *fpstate = &t->arch.fpstate;
+
+    __asm__ volatile(
+                     "fsd     f0, (0 * 8)(%0)\n"
+                     "fsd     f1, (1 * 8)(%0)\n"
+                     "fsd     f2, (2 * 8)(%0)\n"
+                     "fsd     f3, (3 * 8)(%0)\n"
+                     "fsd     f4, (4 * 8)(%0)\n"
+                     "fsd     f5, (5 * 8)(%0)\n"
+                     "fsd     f6, (6 * 8)(%0)\n"
+                     "fsd     f7, (7 * 8)(%0)\n"
+                     "fsd     f8, (8 * 8)(%0)\n"
+                     "fsd     f9, (9 * 8)(%0)\n"
+                     "fsd     f10, (10 * 8)(%0)\n"
+                     "fsd     f11, (11 * 8)(%0)\n"
+                     "fsd     f12, (12 * 8)(%0)\n"
+                     "fsd     f13, (13 * 8)(%0)\n"
+                     "fsd     f14, (14 * 8)(%0)\n"
+                     "fsd     f15, (15 * 8)(%0)\n"
+                     "fsd     f16, (16 * 8)(%0)\n"
+                     "fsd     f17, (17 * 8)(%0)\n"
+                     "fsd     f18, (18 * 8)(%0)\n"
+                     "fsd     f19, (19 * 8)(%0)\n"
+                     "fsd     f20, (20 * 8)(%0)\n"
+                     "fsd     f21, (21 * 8)(%0)\n"
+                     "fsd     f22, (22 * 8)(%0)\n"
+                     "fsd     f23, (23 * 8)(%0)\n"
+                     "fsd     f24, (24 * 8)(%0)\n"
+                     "fsd     f25, (25 * 8)(%0)\n"
+                     "fsd     f26, (26 * 8)(%0)\n"
+                     "fsd     f27, (27 * 8)(%0)\n"
+                     "fsd     f28, (28 * 8)(%0)\n"
+                     "fsd     f29, (29 * 8)(%0)\n"
+                     "fsd     f30, (30 * 8)(%0)\n"
+                     "fsd     f31, (31 * 8)(%0)\n"
+                     :: "r"(fpstate->regs)
+                     : "memory");
+    __asm__ volatile("frcsr   %0" : "=r"(fpstate->fcsr));
+
+    LTRACEF("thread %s, fcsr %#x\n", t->name, fpstate->fcsr);
+}
+
+void riscv_fpu_exception(void) {
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    // turn it on, load the thread's state, and mark the registers as matching
+    // the saved copy so an unmodified state is not saved again on the way out
+    riscv_csr_set(RISCV_CSR_XSTATUS, RISCV_CSR_XSTATUS_FS_INITIAL);
+    riscv_fpu_load_state(get_current_thread());
+    riscv_csr_clear(RISCV_CSR_XSTATUS, RISCV_CSR_XSTATUS_FS_MASK);
+    riscv_csr_set(RISCV_CSR_XSTATUS, RISCV_CSR_XSTATUS_FS_CLEAN);
+}
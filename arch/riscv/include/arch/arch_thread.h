@@ -28,8 +28,19 @@ struct riscv_context_switch_frame {
     unsigned long s11;
 };
 
+#if RISCV_FPU
+struct fpstate {
+    uint64_t    regs[32]; // f0-f31
+    uint32_t    fcsr;
+    uint        current_cpu; // cpu whose registers were last loaded from here
+};
+#endif
+
 struct arch_thread {
     struct riscv_context_switch_frame cs_frame;
+#if RISCV_FPU
+    struct fpstate fpstate;
+#endif
 };
 
 void riscv_context_switch(struct riscv_context_switch_frame *oldcs,
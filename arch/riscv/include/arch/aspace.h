@@ -8,6 +8,7 @@
 #pragma once
 
 #include <lk/compiler.h>
+#include <lk/list.h>
 #include <arch/riscv/mmu.h>
 
 __BEGIN_CDECLS
@@ -22,6 +23,13 @@ struct arch_aspace {
     /* range of address space */
     vaddr_t base;
     size_t size;
+
+    /* emptied page tables waiting for a shootdown before they're freed */
+    struct list_node free_ptables;
+
+    /* user address spaces only */
+    uint asid;
+    int kernel_pgtable_gen; /* kernel half of the top level table last copied at this generation */
 };
 
 __END_CDECLS
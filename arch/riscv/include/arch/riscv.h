@@ -53,9 +53,28 @@
 #define RISCV_CSR_MISA      (0x301)
 #endif // RISCV_M_MODE
 
+#if RISCV_S_MODE // Supervisor-mode only CSRs
+#define RISCV_CSR_SATP      (0x180)
+#endif // RISCV_S_MODE
+
 #define RISCV_CSR_XSTATUS_IE    (1u << (RISCV_XMODE_OFFSET + 0))
 #define RISCV_CSR_XSTATUS_PIE   (1u << (RISCV_XMODE_OFFSET + 4))
 
+// privilege level the trap came from, all zero for user mode (SPP or MPP)
+#if RISCV_M_MODE
+#define RISCV_CSR_XSTATUS_PP_MASK   (3u << 11)
+#else
+#define RISCV_CSR_XSTATUS_PP_MASK   (1u << 8)
+#endif
+
+// floating point unit state, same place in mstatus and sstatus
+#define RISCV_CSR_XSTATUS_FS_SHIFT      (13)
+#define RISCV_CSR_XSTATUS_FS_MASK       (3u << RISCV_CSR_XSTATUS_FS_SHIFT)
+#define RISCV_CSR_XSTATUS_FS_OFF        (0u << RISCV_CSR_XSTATUS_FS_SHIFT)
+#define RISCV_CSR_XSTATUS_FS_INITIAL    (1u << RISCV_CSR_XSTATUS_FS_SHIFT)
+#define RISCV_CSR_XSTATUS_FS_CLEAN      (2u << RISCV_CSR_XSTATUS_FS_SHIFT)
+#define RISCV_CSR_XSTATUS_FS_DIRTY      (3u << RISCV_CSR_XSTATUS_FS_SHIFT)
+
 #define RISCV_CSR_XIE_SIE       (1u << (RISCV_XMODE_OFFSET + 0))
 #define RISCV_CSR_XIE_TIE       (1u << (RISCV_XMODE_OFFSET + 4))
 #define RISCV_CSR_XIE_EIE       (1u << (RISCV_XMODE_OFFSET + 8))
@@ -171,6 +190,24 @@ static inline uint riscv_current_hart(void) {
 void riscv_set_secondary_count(int count);
 
 void riscv_exception_entry(void);
+void riscv_vector_table(void);
 enum handler_return riscv_timer_exception(void);
 
+#if RISCV_FPU
+struct thread;
+void riscv_fpu_exception(void);
+void riscv_fpu_save_state(struct thread *thread);
+
+// save the outgoing thread's fpu state if it changed, and turn the fpu off so the
+// next thread to use it traps into riscv_fpu_exception() and gets its own state back
+static inline void riscv_fpu_pre_context_switch(struct thread *thread) {
+    ulong status = riscv_csr_read(RISCV_CSR_XSTATUS);
+    if ((status & RISCV_CSR_XSTATUS_FS_MASK) == RISCV_CSR_XSTATUS_FS_OFF)
+        return;
+    if ((status & RISCV_CSR_XSTATUS_FS_MASK) == RISCV_CSR_XSTATUS_FS_DIRTY)
+        riscv_fpu_save_state(thread);
+    riscv_csr_clear(RISCV_CSR_XSTATUS, RISCV_CSR_XSTATUS_FS_MASK);
+}
+#endif
+
 #endif /* ASSEMBLY */
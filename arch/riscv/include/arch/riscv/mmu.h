@@ -42,6 +42,14 @@ typedef uintptr_t riscv_pte_t;
 #error implement
 #endif
 
+// highest level at which arch_mmu_map() will use a terminal large page entry:
+// 2MB megapages and 1GB gigapages on sv39/sv48, 4MB megapages on sv32
+#if RISCV_MMU == 32
+#define RISCV_MMU_LARGE_PAGE_MAX_LEVEL 1
+#else
+#define RISCV_MMU_LARGE_PAGE_MAX_LEVEL 2
+#endif
+
 // page table bits
 #define RISCV_PTE_V         (1 << 0) // valid
 #define RISCV_PTE_R         (1 << 1) // read
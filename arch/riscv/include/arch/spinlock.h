@@ -10,36 +10,81 @@
 #include <arch/ops.h>
 #include <stdbool.h>
 
+/*
+ * Ticket lock. The low half of the word is the ticket currently being served,
+ * the high half is the next ticket to hand out. Taking a ticket is a single
+ * amoadd, so harts get the lock in the order they asked for it, and waiters
+ * only read the word until it's their turn.
+ */
 #define SPIN_LOCK_INITIAL_VALUE (0)
 
+/* a lock that starts out held, to be released once with spin_unlock() */
+#define RISCV_SPIN_LOCK_HELD_VALUE (1u << 16)
+
 typedef volatile unsigned int spin_lock_t;
 
 typedef unsigned long spin_lock_saved_state_t;
 typedef unsigned int spin_lock_save_flags_t;
 
+#define SPIN_LOCK_TICKET_SHIFT 16
+#define SPIN_LOCK_OWNER_MASK 0xffffu
+
+static inline bool arch_spin_lock_value_free(unsigned int val) {
+    return (val >> SPIN_LOCK_TICKET_SHIFT) == (val & SPIN_LOCK_OWNER_MASK);
+}
+
 static inline int arch_spin_trylock(spin_lock_t *lock) {
-    int tmp = 1, busy;
+    unsigned int val = *lock;
+    unsigned int old;
+    int fail;
+
+    if (!arch_spin_lock_value_free(val))
+        return 1;
 
+    /* take the next ticket only if nobody else is queued for the lock */
     __asm__ __volatile__(
-        "   amoswap.w %0, %2, %1\n"
-        "   fence r , rw\n"
-        : "=r"(busy), "+A"(*lock)
-        : "r" (tmp)
+        "1: lr.w.aq %0, %2\n"
+        "   bne %0, %3, 2f\n"
+        "   sc.w %1, %4, %2\n"
+        "   bnez %1, 1b\n"
+        "2:\n"
+        : "=&r"(old), "=&r"(fail), "+A"(*lock)
+        : "r"(val), "r"(val + (1u << SPIN_LOCK_TICKET_SHIFT))
         : "memory"
     );
 
-    return !busy;
+    /* 0 on success, like the other architectures */
+    return old != val;
 }
 
 static inline void arch_spin_lock(spin_lock_t *lock) {
-    while (1) {
-        if (*lock) continue;
-        if (arch_spin_trylock(lock)) break;
-    }
+    unsigned int old;
+
+    __asm__ __volatile__(
+        "   amoadd.w.aq %0, %2, %1\n"
+        : "=r"(old), "+A"(*lock)
+        : "r"(1u << SPIN_LOCK_TICKET_SHIFT)
+        : "memory"
+    );
+
+    unsigned int ticket = old >> SPIN_LOCK_TICKET_SHIFT;
+    while ((*lock & SPIN_LOCK_OWNER_MASK) != ticket)
+        ;
+
+    __asm__ __volatile__("fence r, rw" ::: "memory");
 }
 
 static inline void arch_spin_unlock(spin_lock_t *lock) {
-    *lock = 0;
+    /* only the holder writes the owner half, so a plain store of it is enough */
+    unsigned int next = (*lock + 1) & SPIN_LOCK_OWNER_MASK;
+
+    __asm__ __volatile__(
+        "   fence rw, w\n"
+        "   sh %1, 0(%0)\n"
+        :
+        : "r"(lock), "r"(next)
+        : "memory"
+    );
 }
 
 static inline void arch_spin_lock_init(spin_lock_t *lock) {
@@ -47,7 +92,7 @@ static inline void arch_spin_lock_init(spin_lock_t *lock) {
 }
 
 static inline bool arch_spin_lock_held(spin_lock_t *lock) {
-    return *lock != 0;
+    return !arch_spin_lock_value_free(*lock);
 }
 
 /* default arm flag is to just disable plain irqs */
@@ -10,19 +10,23 @@
 #include "arch/riscv/mmu.h"
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <lk/debug.h>
 #include <lk/err.h>
 #include <lk/trace.h>
+#include <arch/atomic.h>
 #include <arch/ops.h>
 #include <arch/mmu.h>
 #include <arch/riscv.h>
 #include <arch/riscv/csr.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 
-#define LOCAL_TRACE 0
+#include "riscv_priv.h"
 
-#include <kernel/vm.h>
+#define LOCAL_TRACE 0
+#define TRACE_CONTEXT_SWITCH 0
 
 #if __riscv_xlen == 32
 #error "32 bit mmu not supported yet"
@@ -56,23 +60,122 @@ static inline void riscv_set_satp(uint asid, paddr_t pt) {
     ulong satp;
 
 #if RISCV_MMU == 48
-    satp = RISCV_SATP_MODE_SV48;
+    satp = (ulong)RISCV_SATP_MODE_SV48 << RISCV_SATP_MODE_SHIFT;
 #elif RISCV_MMU == 39
-    satp = RISCV_SATP_MODE_SV39;
+    satp = (ulong)RISCV_SATP_MODE_SV39 << RISCV_SATP_MODE_SHIFT;
 #endif
 
     // make sure the asid is in range
-    DEBUG_ASSERT((asid & RISCV_SATP_ASID_MASK) == 0);
+    DEBUG_ASSERT((asid & ~RISCV_SATP_ASID_MASK) == 0);
     satp |= (ulong)asid << RISCV_SATP_ASID_SHIFT;
 
     // make sure the page table is aligned
     DEBUG_ASSERT(IS_PAGE_ALIGNED(pt));
-    satp |= pt;
+    satp |= pt >> PAGE_SIZE_SHIFT;
 
+    // entries are tagged with the asid, so no tlb flush is needed here
     riscv_csr_write(RISCV_CSR_SATP, satp);
+}
+
+// local tlb maintenance. kernel mappings are global, so they are flushed
+// across all asids; user mappings only within their own asid.
+static inline void riscv_tlb_flush_page(const arch_aspace_t *aspace, vaddr_t va) {
+    if (aspace->flags & ARCH_ASPACE_FLAG_KERNEL) {
+        __asm__ volatile("sfence.vma %0, zero" :: "r"(va) : "memory");
+    } else {
+        __asm__ volatile("sfence.vma %0, %1" :: "r"(va), "r"(aspace->asid) : "memory");
+    }
+}
+
+static inline void riscv_tlb_flush_aspace(const arch_aspace_t *aspace) {
+    if (aspace->flags & ARCH_ASPACE_FLAG_KERNEL) {
+        __asm__ volatile("sfence.vma zero, zero" ::: "memory");
+    } else {
+        __asm__ volatile("sfence.vma zero, %0" :: "r"(aspace->asid) : "memory");
+    }
+}
 
-    // TODO: TLB flush here or use asid properly
-    // sfence.vma zero, zero
+/*
+ * ASID allocation.
+ *
+ * Each user address space gets its own asid for its lifetime, so switching
+ * between them never needs a tlb flush. Asid 0 is the kernel's. Asids are
+ * handed out next-fit. Each wrap of the allocator bumps asid_generation, and
+ * every cpu flushes its tlb the next time it loads a user address space after
+ * a wrap. A freed asid may still have entries cached on any cpu the address
+ * space ran on, so it sits in quarantine until the next wrap and is only
+ * handed out again once every cpu is bound to flush before using it.
+ *
+ * If the hardware has no asid bits, or they are all in use, the address
+ * space shares asid 0 and is flushed every time it is switched to.
+ */
+static spin_lock_t asid_lock = SPIN_LOCK_INITIAL_VALUE;
+static uint32_t asid_bitmap[(RISCV_SATP_ASID_MASK + 1) / 32];
+static uint32_t asid_quarantine[(RISCV_SATP_ASID_MASK + 1) / 32];
+static uint asid_max; // highest asid the hardware implements
+static uint asid_next = 1;
+static volatile uint asid_generation;
+static uint asid_generation_seen[SMP_MAX_CPUS];
+
+// bumped whenever an entry in the kernel's top level table changes, user
+// address spaces recopy the kernel half when this changes
+static volatile int kernel_pgtable_gen;
+
+static inline void kernel_top_level_changed(const arch_aspace_t *aspace, uint level) {
+    if (level == RISCV_MMU_PT_LEVELS - 1 && (aspace->flags & ARCH_ASPACE_FLAG_KERNEL)) {
+        smp_wmb();
+        atomic_add(&kernel_pgtable_gen, 1);
+    }
+}
+
+static uint riscv_asid_alloc(void) {
+    uint asid = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&asid_lock, state);
+
+    for (uint i = 0; i < asid_max; i++) {
+        uint candidate = asid_next;
+        if (++asid_next > asid_max) {
+            asid_next = 1;
+            asid_generation++;
+
+            // every cpu flushes before it next loads a user asid, so the
+            // quarantined ones are safe to hand out again
+            for (uint j = 0; j < countof(asid_bitmap); j++) {
+                asid_bitmap[j] &= ~asid_quarantine[j];
+                asid_quarantine[j] = 0;
+            }
+        }
+        if (!(asid_bitmap[candidate / 32] & (1u << (candidate % 32)))) {
+            asid_bitmap[candidate / 32] |= 1u << (candidate % 32);
+            asid = candidate;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&asid_lock, state);
+
+    LTRACEF("asid %u\n", asid);
+    return asid;
+}
+
+static void riscv_asid_free(uint asid) {
+    LTRACEF("asid %u\n", asid);
+
+    if (asid == 0)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&asid_lock, state);
+
+    DEBUG_ASSERT(asid_bitmap[asid / 32] & (1u << (asid % 32)));
+    DEBUG_ASSERT(!(asid_quarantine[asid / 32] & (1u << (asid % 32))));
+
+    // stays allocated until the next wrap, see above
+    asid_quarantine[asid / 32] |= 1u << (asid % 32);
+
+    spin_unlock_irqrestore(&asid_lock, state);
 }
 
 // given a va address and the level, compute the index in the current PT
@@ -153,6 +256,7 @@ status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size,
     DEBUG_ASSERT(base + size - 1 > base);
 
     aspace->flags = flags;
+    list_initialize(&aspace->free_ptables);
     if (flags & ARCH_ASPACE_FLAG_KERNEL) {
         // at the moment we can only deal with address spaces as globally defined
         DEBUG_ASSERT(base == KERNEL_ASPACE_BASE);
@@ -163,17 +267,145 @@ status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size,
         aspace->pt_virt = kernel_pgtable;
         aspace->pt_phys = kernel_pgtable_phys;
     } else {
-        PANIC_UNIMPLEMENTED;
+        // user address spaces live entirely in the bottom half
+        DEBUG_ASSERT(base + size - 1 < KERNEL_ASPACE_BASE);
+
+        aspace->base = base;
+        aspace->size = size;
+
+        paddr_t pa;
+        aspace->pt_virt = alloc_ptable(&pa);
+        if (!aspace->pt_virt) {
+            return ERR_NO_MEMORY;
+        }
+        aspace->pt_phys = pa;
+
+        // the kernel half is filled in from kernel_pgtable at context switch time
+        aspace->kernel_pgtable_gen = kernel_pgtable_gen - 1;
+        aspace->asid = riscv_asid_alloc();
     }
 
     LTRACEF("pt phys %#lx, pt virt %p\n", aspace->pt_phys, aspace->pt_virt);
 
     return NO_ERROR;
 }
+// protects every aspace's free_ptables list
+static spin_lock_t free_ptables_lock = SPIN_LOCK_INITIAL_VALUE;
+
+// free every page table below the given one, for tearing down an address space
+static void free_ptables(volatile riscv_pte_t *ptable, uint level, uint start, uint end) {
+    for (uint i = start; i < end; i++) {
+        riscv_pte_t pte = ptable[i];
+        if ((pte & RISCV_PTE_V) && !(pte & RISCV_PTE_PERM_MASK)) {
+            paddr_t ptp = RISCV_PTE_PPN(pte);
+            if (level > 1) {
+                free_ptables(paddr_to_kvaddr(ptp), level - 1, 0, RISCV_MMU_PT_ENTRIES);
+            }
+            pmm_free_page(paddr_to_vm_page(ptp));
+        }
+    }
+}
+
 status_t arch_mmu_destroy_aspace(arch_aspace_t *aspace) {
     LTRACEF("aspace %p\n", aspace);
 
-    PANIC_UNIMPLEMENTED;
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
+
+    // anything still mapped is torn down here; the kernel half is shared and left alone
+    free_ptables(aspace->pt_virt, RISCV_MMU_PT_LEVELS - 1, 0,
+                 vaddr_to_index(KERNEL_ASPACE_BASE, RISCV_MMU_PT_LEVELS - 1));
+
+    // other cpus were already flushed by the vmm as the regions were unmapped
+    riscv_tlb_flush_aspace(aspace);
+    riscv_asid_free(aspace->asid);
+
+    // so any emptied tables it didn't get to can go now
+    struct list_node tables = LIST_INITIAL_VALUE(tables);
+    arch_mmu_take_free_ptables(aspace, &tables);
+    pmm_free(&tables);
+
+    pmm_free_page(paddr_to_vm_page(aspace->pt_phys));
+    aspace->pt_virt = NULL;
+
+    return NO_ERROR;
+}
+
+// map a physically contiguous range into the page table at the given level,
+// using the largest terminal entries that the alignment and length allow.
+// each table is visited once per run, recursing only where a range doesn't
+// cover a whole entry at this level.
+static status_t riscv_mmu_map_range(arch_aspace_t *aspace, volatile riscv_pte_t *ptable, uint level,
+                                    vaddr_t vaddr, paddr_t paddr, size_t size, riscv_pte_t attrs) {
+    const uintptr_t block_size = page_size_per_level(level);
+    const uintptr_t block_mask = page_mask_per_level(level);
+
+    LTRACEF_LEVEL(2, "level %u, ptable %p, va %#lx pa %#lx size %#zx\n", level, ptable, vaddr, paddr, size);
+
+    while (size > 0) {
+        uint index = vaddr_to_index(vaddr, level);
+        volatile riscv_pte_t *ptep = ptable + index;
+        riscv_pte_t pte = *ptep;
+
+        // how much of the range falls within this entry
+        size_t chunk = MIN(size, block_size - (vaddr & block_mask));
+
+        if (level == 0 ||
+                (level <= RISCV_MMU_LARGE_PAGE_MAX_LEVEL && chunk == block_size &&
+                 (paddr & block_mask) == 0 && !(pte & RISCV_PTE_V))) {
+            // terminal entry, either a page or a whole aligned large page
+            if (pte & RISCV_PTE_V) {
+                LTRACEF("terminal entry already exists at va %#lx, pte %#lx\n", vaddr, pte);
+                return ERR_ALREADY_EXISTS;
+            }
+
+            pte = RISCV_PTE_PPN_TO_PTE(paddr) | attrs;
+
+            LTRACEF_LEVEL(2, "added new terminal entry at level %u: pte %#lx\n", level, pte);
+
+            *ptep = pte;
+            kernel_top_level_changed(aspace, level);
+        } else {
+            volatile riscv_pte_t *ptv;
+
+            if (!(pte & RISCV_PTE_V)) {
+                // invalid entry, will have to add a page table
+                paddr_t ptp;
+                ptv = alloc_ptable(&ptp);
+                if (!ptv) {
+                    return ERR_NO_MEMORY;
+                }
+
+                LTRACEF_LEVEL(2, "new ptable table %p, pa %#lx\n", ptv, ptp);
+
+                // link it in. RMW == 0 is a page table link
+                *ptep = RISCV_PTE_PPN_TO_PTE(ptp) | RISCV_PTE_V;
+                kernel_top_level_changed(aspace, level);
+            } else if (!(pte & RISCV_PTE_PERM_MASK)) {
+                // next level page table pointer (RWX = 0)
+                paddr_t ptp = RISCV_PTE_PPN(pte);
+                ptv = paddr_to_kvaddr(ptp);
+
+                LTRACEF_LEVEL(2, "next level page table at %p, pa %#lx\n", ptv, ptp);
+            } else {
+                // a large page already covers this range
+                LTRACEF("terminal large page at level %u already exists at va %#lx, pte %#lx\n",
+                        level, vaddr, pte);
+                return ERR_ALREADY_EXISTS;
+            }
+
+            status_t err = riscv_mmu_map_range(aspace, ptv, level - 1, vaddr, paddr, chunk, attrs);
+            if (err < 0) {
+                return err;
+            }
+        }
+
+        vaddr += chunk;
+        paddr += chunk;
+        size -= chunk;
+    }
+
+    return NO_ERROR;
 }
 
 // routines to map/unmap/query mappings per address space
@@ -181,89 +413,197 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
     LTRACEF("vaddr %#lx paddr %#lx count %u flags %#x\n", vaddr, paddr, count, flags);
 
     DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT(IS_PAGE_ALIGNED(vaddr));
+    DEBUG_ASSERT(IS_PAGE_ALIGNED(paddr));
 
-restart:
     if (count == 0)
         return NO_ERROR;
 
-    // bootstrap the top level walk
-    uint level = RISCV_MMU_PT_LEVELS - 1;
-    uint index = vaddr_to_index(vaddr, level);
-    volatile riscv_pte_t *ptep = aspace->pt_virt + index;
+    // the bits common to every terminal entry in this run
+    riscv_pte_t attrs = mmu_flags_to_pte(flags);
+    attrs |= RISCV_PTE_A | RISCV_PTE_D | RISCV_PTE_V;
+    attrs |= (aspace->flags & ARCH_ASPACE_FLAG_KERNEL) ? RISCV_PTE_G : 0;
 
-    for (;;) {
-        LTRACEF_LEVEL(2, "level %u, index %u, pte %p (%#lx) va %#lx pa %#lx\n",
-                      level, index, ptep, *ptep, vaddr, paddr);
+    return riscv_mmu_map_range(aspace, aspace->pt_virt, RISCV_MMU_PT_LEVELS - 1,
+                               vaddr, paddr, (size_t)count * PAGE_SIZE, attrs);
+}
 
-        // look at our page table entry
-        riscv_pte_t pte = *ptep;
-        if (level > 0 && !(pte & RISCV_PTE_V)) {
-            // invalid entry, will have to add a page table
-            paddr_t ptp;
-            volatile riscv_pte_t *ptv = alloc_ptable(&ptp);
-            if (!ptv) {
-                return ERR_NO_MEMORY;
-            }
+// past this many pages, unmap flushes the whole address space once instead of page by page
+#define UNMAP_FLUSH_ALL_THRESHOLD 64
+
+struct unmap_state {
+    bool flush_all;     // flush the whole aspace at the end rather than per page
+};
 
-            LTRACEF_LEVEL(2, "new ptable table %p, pa %#lx\n", ptv, ptp);
+static bool ptable_is_empty(volatile const riscv_pte_t *ptable) {
+    for (uint i = 0; i < RISCV_MMU_PT_ENTRIES; i++) {
+        if (ptable[i] & RISCV_PTE_V)
+            return false;
+    }
+    return true;
+}
 
-            // link it in. RMW == 0 is a page table link
-            pte = RISCV_PTE_PPN_TO_PTE(ptp) | RISCV_PTE_V;
-            *ptep = pte;
+// replace a terminal large page with a table of next level entries mapping the
+// same range, so part of it can be unmapped
+static volatile riscv_pte_t *split_large_page(arch_aspace_t *aspace, volatile riscv_pte_t *ptep,
+                                              uint level, vaddr_t vaddr) {
+    riscv_pte_t pte = *ptep;
+    paddr_t pa = RISCV_PTE_PPN(pte);
+    riscv_pte_t attrs = pte & ~RISCV_PTE_PPN_MASK;
+    const uintptr_t sub_size = page_size_per_level(level - 1);
 
-            // go one level deeper
-            level--;
-            index = vaddr_to_index(vaddr, level);
-            ptep = ptv + index;
-        } else if ((pte & RISCV_PTE_V) && !(pte & RISCV_PTE_PERM_MASK)) {
-            // next level page table pointer (RWX = 0)
-            paddr_t ptp = RISCV_PTE_PPN(pte);
-            volatile riscv_pte_t *ptv = paddr_to_kvaddr(ptp);
+    LTRACEF_LEVEL(2, "splitting level %u page at va %#lx, pte %#lx\n", level, vaddr, pte);
 
-            LTRACEF_LEVEL(2, "next level page table at %p, pa %#lx\n", ptv, ptp);
+    paddr_t ptp;
+    volatile riscv_pte_t *ptv = alloc_ptable(&ptp);
+    if (!ptv) {
+        return NULL;
+    }
 
-            // go one level deeper
-            level--;
-            index = vaddr_to_index(vaddr, level);
-            ptep = ptv + index;
-        } else if (pte & RISCV_PTE_V) {
-            // terminal entry already exists
-            if (level > 0) {
-                PANIC_UNIMPLEMENTED_MSG("terminal large page entry");
-            } else {
-                PANIC_UNIMPLEMENTED_MSG("terminal page entry");
+    for (uint i = 0; i < RISCV_MMU_PT_ENTRIES; i++) {
+        ptv[i] = RISCV_PTE_PPN_TO_PTE(pa + i * sub_size) | attrs;
+    }
+    smp_wmb();
+
+    *ptep = RISCV_PTE_PPN_TO_PTE(ptp) | RISCV_PTE_V;
+    kernel_top_level_changed(aspace, level);
+    riscv_tlb_flush_page(aspace, vaddr & ~page_mask_per_level(level));
+
+    return ptv;
+}
+
+static status_t riscv_mmu_unmap_range(arch_aspace_t *aspace, volatile riscv_pte_t *ptable, uint level,
+                                      vaddr_t vaddr, size_t size, struct unmap_state *us) {
+    const uintptr_t block_size = page_size_per_level(level);
+    const uintptr_t block_mask = page_mask_per_level(level);
+
+    LTRACEF_LEVEL(2, "level %u, ptable %p, va %#lx size %#zx\n", level, ptable, vaddr, size);
+
+    while (size > 0) {
+        uint index = vaddr_to_index(vaddr, level);
+        volatile riscv_pte_t *ptep = ptable + index;
+        riscv_pte_t pte = *ptep;
+
+        // how much of the range falls within this entry
+        size_t chunk = MIN(size, block_size - (vaddr & block_mask));
+
+        if (!(pte & RISCV_PTE_V)) {
+            // nothing mapped here
+        } else if ((pte & RISCV_PTE_PERM_MASK) && chunk == block_size) {
+            // terminal entry entirely inside the range
+            LTRACEF_LEVEL(2, "removing terminal entry at level %u, va %#lx, pte %#lx\n", level, vaddr, pte);
+
+            *ptep = 0;
+            kernel_top_level_changed(aspace, level);
+            if (!us->flush_all) {
+                riscv_tlb_flush_page(aspace, vaddr);
             }
         } else {
-            DEBUG_ASSERT(level == 0 && !(pte & RISCV_PTE_V));
+            volatile riscv_pte_t *ptv;
+            if (pte & RISCV_PTE_PERM_MASK) {
+                // large page only partially inside the range
+                ptv = split_large_page(aspace, ptep, level, vaddr);
+                if (!ptv) {
+                    return ERR_NO_MEMORY;
+                }
+            } else {
+                ptv = paddr_to_kvaddr(RISCV_PTE_PPN(pte));
+            }
 
-            // hit a open terminal page table entry, lets add ours
-            pte = RISCV_PTE_PPN_TO_PTE(paddr);
-            pte |= mmu_flags_to_pte(flags);
-            pte |= RISCV_PTE_A | RISCV_PTE_D | RISCV_PTE_V;
-            pte |= (aspace->flags & ARCH_ASPACE_FLAG_KERNEL) ? RISCV_PTE_G : 0;
+            status_t err = riscv_mmu_unmap_range(aspace, ptv, level - 1, vaddr, chunk, us);
+            if (err < 0) {
+                return err;
+            }
 
-            LTRACEF_LEVEL(2, "added new terminal entry: pte %#lx\n", pte);
+            // free the table if it's now empty. the kernel's top level entries are
+            // shared with every user address space and stay put.
+            bool shared = (aspace->flags & ARCH_ASPACE_FLAG_KERNEL) && level == RISCV_MMU_PT_LEVELS - 1;
+            if (!shared && ptable_is_empty(ptv)) {
+                paddr_t ptp = RISCV_PTE_PPN(*ptep);
 
-            *ptep = pte;
+                LTRACEF_LEVEL(2, "freeing page table %p, pa %#lx\n", ptv, ptp);
+
+                *ptep = 0;
 
-            // simple algorithm: restart walk from top, one page at a time
-            // TODO: more efficiently deal with runs and large pages
-            count--;
-            paddr += PAGE_SIZE;
-            vaddr += PAGE_SIZE;
-            goto restart;
+                // cached non-leaf entries are only dropped by a fence without an address
+                us->flush_all = true;
+
+                // other cpus may still walk through it until the vmm's shootdown,
+                // see arch_mmu_take_free_ptables()
+                spin_lock_saved_state_t state;
+                spin_lock_irqsave(&free_ptables_lock, state);
+                list_add_tail(&aspace->free_ptables, &paddr_to_vm_page(ptp)->node);
+                spin_unlock_irqrestore(&free_ptables_lock, state);
+            }
         }
 
-        // make sure we didn't decrement level one too many
-        DEBUG_ASSERT(level < RISCV_MMU_PT_LEVELS);
+        vaddr += chunk;
+        size -= chunk;
     }
-    // unreachable
+
+    return NO_ERROR;
+}
+
+void arch_mmu_invalidate_tlb_local(arch_aspace_t *aspace, vaddr_t vaddr, uint count) {
+    LTRACEF_LEVEL(2, "aspace %p, vaddr %#lx count %u\n", aspace, vaddr, count);
+
+    if (count > UNMAP_FLUSH_ALL_THRESHOLD) {
+        riscv_tlb_flush_aspace(aspace);
+        return;
+    }
+
+    for (uint i = 0; i < count; i++) {
+        riscv_tlb_flush_page(aspace, vaddr + i * PAGE_SIZE);
+    }
+}
+
+void arch_mmu_invalidate_tlb_all_local(arch_aspace_t *aspace) {
+    LTRACEF_LEVEL(2, "aspace %p\n", aspace);
+
+    riscv_tlb_flush_aspace(aspace);
+}
+
+size_t arch_mmu_take_free_ptables(arch_aspace_t *aspace, struct list_node *list) {
+    size_t count = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&free_ptables_lock, state);
+    vm_page_t *p;
+    while ((p = list_remove_head_type(&aspace->free_ptables, vm_page_t, node))) {
+        list_add_tail(list, &p->node);
+        count++;
+    }
+    spin_unlock_irqrestore(&free_ptables_lock, state);
+
+    return count;
 }
 
 int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count) {
     LTRACEF("vaddr %#lx count %u\n", vaddr, count);
 
-    PANIC_UNIMPLEMENTED;
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT(IS_PAGE_ALIGNED(vaddr));
+
+    if (!IS_PAGE_ALIGNED(vaddr))
+        return ERR_INVALID_ARGS;
+
+    if (count == 0)
+        return NO_ERROR;
+
+    struct unmap_state us = {
+        .flush_all = count > UNMAP_FLUSH_ALL_THRESHOLD,
+    };
+
+    status_t err = riscv_mmu_unmap_range(aspace, aspace->pt_virt, RISCV_MMU_PT_LEVELS - 1,
+                                         vaddr, (size_t)count * PAGE_SIZE, &us);
+
+    // make the cleared entries visible to the table walker before flushing
+    smp_wmb();
+    if (us.flush_all) {
+        riscv_tlb_flush_aspace(aspace);
+    }
+
+    return err;
 }
 
 status_t arch_mmu_query(arch_aspace_t *aspace, const vaddr_t vaddr, paddr_t *paddr, uint *flags) {
@@ -333,9 +673,57 @@ status_t arch_mmu_query(arch_aspace_t *aspace, const vaddr_t vaddr, paddr_t *pad
 // load a new user address space context.
 // aspace argument NULL should load kernel-only context
 void arch_mmu_context_switch(arch_aspace_t *aspace) {
-    LTRACEF("aspace %p\n", aspace);
+    if (TRACE_CONTEXT_SWITCH)
+        TRACEF("aspace %p\n", aspace);
+
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    if (!aspace) {
+        // kernel only context
+        riscv_set_satp(0, kernel_pgtable_phys);
+        return;
+    }
+
+    DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
+
+    // the asid allocator wrapped since this cpu last flushed, so one of the
+    // asids it hands out may have stale entries here from a previous owner
+    uint cpu = arch_curr_cpu_num();
+    uint gen = asid_generation;
+    if (asid_generation_seen[cpu] != gen) {
+        asid_generation_seen[cpu] = gen;
+        __asm__ volatile("sfence.vma zero, zero" ::: "memory");
+    }
+
+    // pick up any top level kernel page tables added since we last ran
+    int kgen = kernel_pgtable_gen;
+    if (aspace->kernel_pgtable_gen != kgen) {
+        uint start = vaddr_to_index(KERNEL_ASPACE_BASE, RISCV_MMU_PT_LEVELS - 1);
+        for (uint i = start; i < RISCV_MMU_PT_ENTRIES; i++) {
+            aspace->pt_virt[i] = kernel_pgtable[i];
+        }
+        aspace->kernel_pgtable_gen = kgen;
+        smp_wmb();
+    }
+
+    riscv_set_satp(aspace->asid, aspace->pt_phys);
+
+    // sharing asid 0, so whatever the last user of it left behind has to go
+    if (aspace->asid == 0) {
+        riscv_tlb_flush_aspace(aspace);
+    }
+}
+
+// probe the number of implemented asid bits, satp.ASID is WARL
+void riscv_mmu_init(void) {
+    ulong satp = riscv_csr_read(RISCV_CSR_SATP);
+    riscv_csr_write(RISCV_CSR_SATP, satp | (RISCV_SATP_ASID_MASK << RISCV_SATP_ASID_SHIFT));
+    ulong probe = riscv_csr_read(RISCV_CSR_SATP);
+    riscv_csr_write(RISCV_CSR_SATP, satp);
+
+    asid_max = (probe >> RISCV_SATP_ASID_SHIFT) & RISCV_SATP_ASID_MASK;
 
-    PANIC_UNIMPLEMENTED;
+    dprintf(INFO, "RISCV: MMU %u asids\n", asid_max + 1);
 }
 
 #endif
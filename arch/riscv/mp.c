@@ -19,6 +19,10 @@
 #include <arch/ops.h>
 #include <arch/mp.h>
 #include <arch/riscv/clint.h>
+#include <kernel/mp.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 #include "riscv_priv.h"
 
@@ -43,7 +47,7 @@ static int cpu_to_hart_map[SMP_MAX_CPUS] = {
 // list of IPIs queued per cpu
 static volatile int ipi_data[RISCV_MAX_HARTS];
 
-static spin_lock_t boot_cpu_lock = 1;
+static spin_lock_t boot_cpu_lock = RISCV_SPIN_LOCK_HELD_VALUE;
 volatile int secondaries_to_init = SMP_MAX_CPUS - 1;
 
 status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi) {
@@ -93,6 +97,12 @@ enum handler_return riscv_software_exception(void) {
         ret = mp_mbx_reschedule_irq();
         reason &= ~(1u << MP_IPI_RESCHEDULE);
     }
+#if WITH_KERNEL_VM
+    if (reason & (1u << MP_IPI_TLB_SHOOTDOWN)) {
+        vmm_tlb_shootdown_irq();
+        reason &= ~(1u << MP_IPI_TLB_SHOOTDOWN);
+    }
+#endif
     if (reason & (1u << MP_IPI_GENERIC)) {
         panic("unimplemented MP_IPI_GENERIC\n");
         reason &= ~(1u << MP_IPI_GENERIC);
@@ -10,4 +10,5 @@
 void riscv_early_init_percpu(void);
 void riscv_init_percpu(void);
 void riscv_boot_secondaries(void);
+void riscv_mmu_init(void);
 
@@ -23,11 +23,30 @@ GLOBAL_DEFINES += SMP_MAX_CPUS=$(SMP_MAX_CPUS)
 GLOBAL_DEFINES += RISCV_MAX_HARTS=$(RISCV_MAX_HARTS)
 GLOBAL_DEFINES += RISCV_BOOT_HART=$(RISCV_BOOT_HART)
 GLOBAL_DEFINES += PLATFORM_HAS_DYNAMIC_TIMER=1
+GLOBAL_DEFINES += PLATFORM_HAS_HRTIMER=1
 
 ifeq ($(WITH_SMP),1)
 GLOBAL_DEFINES += WITH_SMP=1
 endif
 
+# in vectored mode the timer, software and external interrupts each get a
+# dedicated entry point instead of decoding xcause in the common trap handler
+RISCV_VECTORED_TRAPS ?= false
+ifeq ($(call TOBOOL,$(RISCV_VECTORED_TRAPS)),true)
+GLOBAL_DEFINES += RISCV_VECTORED_TRAPS=1
+endif
+
+# hardware floating point for threads. the kernel keeps the soft float abi,
+# the F/D registers are switched lazily per thread.
+RISCV_FPU ?= false
+ifeq ($(call TOBOOL,$(RISCV_FPU)),true)
+GLOBAL_DEFINES += RISCV_FPU=1
+MODULE_SRCS += $(LOCAL_DIR)/fpu.c
+RISCV_MARCH_EXT := imafdc
+else
+RISCV_MARCH_EXT := imac
+endif
+
 SUBARCH ?= 32
 
 RISCV_MODE ?= machine
@@ -51,6 +70,7 @@ $(error RISCV: sv48 mmu not supported for 32 bit riscv)
 endif
 $(info RISCV: MMU sv48)
 GLOBAL_DEFINES += RISCV_MMU=48
+GLOBAL_DEFINES += ARCH_MMU_NEEDS_TLB_SHOOTDOWN=1
 WITH_KERNEL_VM ?= 1
 
 # 48 bits split between two 47 bit halves
@@ -65,6 +85,7 @@ $(error RISCV: sv39 mmu not supported for 32 bit riscv)
 endif
 $(info RISCV: MMU sv39)
 GLOBAL_DEFINES += RISCV_MMU=39
+GLOBAL_DEFINES += ARCH_MMU_NEEDS_TLB_SHOOTDOWN=1
 WITH_KERNEL_VM ?= 1
 
 # 39 bits split between two 38 bit halves
@@ -76,6 +97,7 @@ USER_ASPACE_SIZE   := 0x0000003ffe000000
 else ifeq ($(RISCV_MMU),sv32)
 $(info RISCV: MMU sv32)
 GLOBAL_DEFINES += RISCV_MMU=32
+GLOBAL_DEFINES += ARCH_MMU_NEEDS_TLB_SHOOTDOWN=1
 WITH_KERNEL_VM ?= 1
 
 # 32 bits split between two 31 bit halves
@@ -130,12 +152,12 @@ endif
 # based on 32 or 64 bitness, select the right toolchain and some
 # compiler codegen flags
 ifeq ($(SUBARCH),32)
-ARCH_COMPILEFLAGS := -march=rv32imac -mabi=ilp32
+ARCH_COMPILEFLAGS := -march=rv32$(RISCV_MARCH_EXT) -mabi=ilp32
 # override machine for ld -r
 GLOBAL_MODULE_LDFLAGS += -m elf32lriscv
 else ifeq ($(SUBARCH),64)
 GLOBAL_DEFINES += IS_64BIT=1
-ARCH_COMPILEFLAGS := -march=rv64imac -mabi=lp64 -mcmodel=medany
+ARCH_COMPILEFLAGS := -march=rv64$(RISCV_MARCH_EXT) -mabi=lp64 -mcmodel=medany
 # override machine for ld -r
 GLOBAL_MODULE_LDFLAGS += -m elf64lriscv
 else
@@ -10,6 +10,7 @@
 #include <lk/trace.h>
 #include <sys/types.h>
 #include <string.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <kernel/thread.h>
 #include <arch/riscv.h>
@@ -30,7 +31,7 @@ static void initial_thread_func(void) {
 #endif
 
     /* release the thread lock that was implicitly held across the reschedule */
-    spin_unlock(&thread_lock);
+    spin_unlock(thread_curr_cpu_lock());
     arch_enable_ints();
 
     int ret = ct->entry(ct->arg);
@@ -50,6 +51,12 @@ void arch_thread_initialize(thread_t *t) {
     t->arch.cs_frame.sp = stack_top;
     t->arch.cs_frame.ra = (vaddr_t)&initial_thread_func;
 
+#if RISCV_FPU
+    /* start with zeroed fpu state, never anything left behind in the registers */
+    memset(&t->arch.fpstate, 0, sizeof(t->arch.fpstate));
+    t->arch.fpstate.current_cpu = UINT_MAX;
+#endif
+
     LTRACEF("t %p (%s) stack top %#lx entry %p arg %p\n", t, t->name, stack_top, t->entry, t->arg);
 }
 
@@ -58,6 +65,10 @@ void arch_context_switch(thread_t *oldthread, thread_t *newthread) {
 
     LTRACEF("old %p (%s), new %p (%s)\n", oldthread, oldthread->name, newthread, newthread->name);
 
+#if RISCV_FPU
+    riscv_fpu_pre_context_switch(oldthread);
+#endif
+
     riscv_context_switch(&oldthread->arch.cs_frame, &newthread->arch.cs_frame);
 }
 
@@ -9,33 +9,60 @@
 #include <lk/debug.h>
 #include <lk/trace.h>
 #include <lk/err.h>
-#include <lk/trace.h>
 
 #include <arch/riscv.h>
 #include <arch/ops.h>
+#include <kernel/spinlock.h>
+#include <stdlib.h>
 
 #include <platform.h>
 #include <platform/timer.h>
 
 #define LOCAL_TRACE 0
 
+/*
+ * The millisecond kernel timer and the nanosecond hrtimer share the hart's
+ * single compare register, which is always set to the earlier of the two.
+ */
+struct riscv_timer_state {
+    bool armed;
+    bool hr_armed;
+    uint64_t deadline;      /* in mtime ticks */
+    uint64_t hr_deadline;   /* in mtime ticks */
+};
+
+static struct riscv_timer_state timer_state[SMP_MAX_CPUS];
+
 static platform_timer_callback timer_cb;
 static void *timer_arg;
+static platform_timer_callback hr_timer_cb;
+static void *hr_timer_arg;
 
-status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval) {
-    LTRACEF("cb %p, arg %p, interval %u\n", callback, arg, interval);
-
-    // disable timer
-    riscv_csr_clear(RISCV_CSR_XIE, RISCV_CSR_XIE_TIE);
+static uint64_t ns_to_ticks(lk_time_ns_t ns) {
+    return (ns / 1000000000u) * ARCH_RISCV_MTIME_RATE +
+           ((ns % 1000000000u) * ARCH_RISCV_MTIME_RATE) / 1000000000u;
+}
 
-    timer_cb = callback;
-    timer_arg = arg;
+static lk_time_ns_t ticks_to_ns(uint64_t ticks) {
+    return (ticks / ARCH_RISCV_MTIME_RATE) * 1000000000u +
+           ((ticks % ARCH_RISCV_MTIME_RATE) * 1000000000u) / ARCH_RISCV_MTIME_RATE;
+}
 
-    // enable the timer
-    riscv_csr_set(RISCV_CSR_XIE, RISCV_CSR_XIE_TIE);
+/* load the compare register with whichever deadline is next, interrupts must be disabled */
+static void program_timer(struct riscv_timer_state *ts) {
+    uint64_t ticks;
+
+    if (ts->armed && ts->hr_armed) {
+        ticks = MIN(ts->deadline, ts->hr_deadline);
+    } else if (ts->armed) {
+        ticks = ts->deadline;
+    } else if (ts->hr_armed) {
+        ticks = ts->hr_deadline;
+    } else {
+        riscv_csr_clear(RISCV_CSR_XIE, RISCV_CSR_XIE_TIE);
+        return;
+    }
 
-    // convert interval to ticks
-    uint64_t ticks = riscv_get_time() + ((interval * ARCH_RISCV_MTIME_RATE) / 1000u);
 #if RISCV_M_MODE
     extern void clint_set_timer(uint64_t ticks);
     clint_set_timer(ticks);
@@ -43,9 +70,48 @@ status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg
     sbi_set_timer(ticks);
 #endif
 
+    // enable the timer
+    riscv_csr_set(RISCV_CSR_XIE, RISCV_CSR_XIE_TIE);
+}
+
+status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg, lk_time_t interval) {
+    LTRACEF("cb %p, arg %p, interval %u\n", callback, arg, interval);
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    timer_cb = callback;
+    timer_arg = arg;
+
+    // convert interval to ticks
+    struct riscv_timer_state *ts = &timer_state[arch_curr_cpu_num()];
+    ts->deadline = riscv_get_time() + (((uint64_t)interval * ARCH_RISCV_MTIME_RATE) / 1000u);
+    ts->armed = true;
+    program_timer(ts);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
     return NO_ERROR;
 }
 
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t deadline) {
+    LTRACEF("cb %p, arg %p, deadline %llu\n", callback, arg, deadline);
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    hr_timer_cb = callback;
+    hr_timer_arg = arg;
+
+    struct riscv_timer_state *ts = &timer_state[arch_curr_cpu_num()];
+    ts->hr_deadline = ns_to_ticks(deadline);
+    ts->hr_armed = true;
+    program_timer(ts);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return NO_ERROR;
+}
 
 lk_bigtime_t current_time_hires(void) {
 #if ARCH_RISCV_MTIME_RATE < 10000000
@@ -59,8 +125,30 @@ lk_time_t current_time(void) {
     return riscv_get_time() / (ARCH_RISCV_MTIME_RATE / 1000u);
 }
 
+lk_time_ns_t current_time_ns(void) {
+    return ticks_to_ns(riscv_get_time());
+}
+
 void platform_stop_timer(void) {
-    riscv_csr_clear(RISCV_CSR_XIE, RISCV_CSR_XIE_TIE);
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct riscv_timer_state *ts = &timer_state[arch_curr_cpu_num()];
+    ts->armed = false;
+    program_timer(ts);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+void platform_stop_timer_ns(void) {
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct riscv_timer_state *ts = &timer_state[arch_curr_cpu_num()];
+    ts->hr_armed = false;
+    program_timer(ts);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 }
 
 enum handler_return riscv_timer_exception(void) {
@@ -68,10 +156,23 @@ enum handler_return riscv_timer_exception(void) {
 
     riscv_csr_clear(RISCV_CSR_XIE, RISCV_CSR_XIE_TIE);
 
+    struct riscv_timer_state *ts = &timer_state[arch_curr_cpu_num()];
+    uint64_t now = riscv_get_time();
+
     enum handler_return ret = INT_NO_RESCHEDULE;
-    if (timer_cb) {
-        ret = timer_cb(timer_arg, current_time());
+    if (ts->hr_armed && ts->hr_deadline <= now) {
+        ts->hr_armed = false;
+        if (hr_timer_cb && hr_timer_cb(hr_timer_arg, current_time()) == INT_RESCHEDULE)
+            ret = INT_RESCHEDULE;
+    }
+    if (ts->armed && ts->deadline <= now) {
+        ts->armed = false;
+        if (timer_cb && timer_cb(timer_arg, current_time()) == INT_RESCHEDULE)
+            ret = INT_RESCHEDULE;
     }
 
+    /* the callbacks have usually rearmed by now, but cover the one that didn't fire yet */
+    program_timer(ts);
+
     return ret;
 }
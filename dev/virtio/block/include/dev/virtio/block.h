@@ -10,8 +10,31 @@
 #include <lk/compiler.h>
 #include <sys/types.h>
 #include <dev/virtio.h>
+#include <iovec.h>
+
+/* an asynchronous transfer, owned by the caller until its callback runs */
+typedef struct virtio_block_io {
+    const iovec_t *iov;
+    uint iov_count;
+    off_t offset;
+    bool write;
+
+    /* called once every byte has been transferred or the transfer failed,
+     * usually from interrupt context */
+    void (*callback)(struct virtio_block_io *io, status_t err);
+    void *arg;
+
+    /* private to the driver */
+    volatile int pending;
+    volatile status_t err;
+} virtio_block_io_t;
 
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) __NONNULL();
 
+/* queue a transfer and return without waiting for it. The offset and the total
+ * length must be a multiple of 512 bytes. Returns an error without calling
+ * the callback if the transfer couldn't be queued. */
+status_t virtio_block_submit(struct virtio_device *dev, virtio_block_io_t *io) __NONNULL();
+
 ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write) __NONNULL();
 
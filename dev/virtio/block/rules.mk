@@ -7,7 +7,8 @@ MODULE_SRCS += \
 
 MODULE_DEPS += \
 	dev/virtio \
-	lib/bio
+	lib/bio \
+	lib/iovec
 
 
 include make/module.mk
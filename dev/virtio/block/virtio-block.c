@@ -14,9 +14,11 @@
 #include <lk/compiler.h>
 #include <lk/list.h>
 #include <lk/err.h>
+#include <arch/atomic.h>
+#include <arch/ops.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
-#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <lib/bio.h>
 
 #if WITH_KERNEL_VM
@@ -35,8 +37,18 @@ struct virtio_blk_config {
         uint8_t sectors;
     } geometry;
     uint32_t blk_size;
+    struct virtio_blk_topology {
+        uint8_t physical_block_exp;
+        uint8_t alignment_offset;
+        uint16_t min_io_size;
+        uint32_t opt_io_size;
+    } topology;
+    uint8_t writeback;
+    uint8_t unused0;
+    uint16_t num_queues;
 };
-STATIC_ASSERT(sizeof(struct virtio_blk_config) == 24);
+STATIC_ASSERT(__offsetof(struct virtio_blk_config, topology) == 24);
+STATIC_ASSERT(__offsetof(struct virtio_blk_config, num_queues) == 34);
 
 struct virtio_blk_req {
     uint32_t type;
@@ -55,6 +67,7 @@ STATIC_ASSERT(sizeof(struct virtio_blk_req) == 16);
 #define VIRTIO_BLK_F_FLUSH    (1<<9)
 #define VIRTIO_BLK_F_TOPOLOGY (1<<10)
 #define VIRTIO_BLK_F_CONFIG_WCE (1<<11)
+#define VIRTIO_BLK_F_MQ       (1<<12)
 
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
@@ -64,56 +77,107 @@ STATIC_ASSERT(sizeof(struct virtio_blk_req) == 16);
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
+#define VIRTIO_BLK_SECTOR_SIZE  512
+
+/* descriptors in each virtqueue */
+#define VIRTIO_BLK_RING_LEN     256
+
+/* data descriptors in a single request, larger transfers are split */
+#define VIRTIO_BLK_MAX_SEGS     32
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
 static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static void virtio_bdev_submit(struct bdev *bdev, bio_request_t *req, off_t offset);
+
+/* request header and status byte handed to the device, never crossing a page */
+struct virtio_blk_req_hdr {
+    struct virtio_blk_req req;
+    uint8_t status;
+} __ALIGNED(32);
+
+/*
+ * Each virtqueue carries its own requests. The header, status and completion
+ * of a request are indexed by the head descriptor of its chain, which is the
+ * id the device hands back in the used ring.
+ */
+struct virtio_block_queue {
+    uint index;
+
+    /* protects the descriptor free list and the avail ring */
+    spin_lock_t lock;
+
+    /* signaled when descriptors are returned, for submitters that ran out */
+    event_t desc_event;
+
+    struct virtio_blk_req_hdr *hdrs;
+    virtio_block_io_t *txn[VIRTIO_BLK_RING_LEN];
+
+    /* stats */
+    uint in_flight;
+    uint max_in_flight;
+    uint64_t requests;
+};
 
 struct virtio_block_dev {
     struct virtio_device *dev;
 
-    mutex_t lock;
-    event_t io_event;
-
     /* bio block device */
     bdev_t bdev;
 
-    /* one blk_req structure for io, not crossing a page boundary */
-    struct virtio_blk_req *blk_req;
-    paddr_t blk_req_phys;
+    uint max_segs;
+
+    uint num_queues;
+    struct virtio_block_queue queue[MAX_VIRTIO_RINGS];
+};
+
+/* a physically contiguous piece of a transfer */
+struct virtio_blk_seg {
+    paddr_t pa;
+    size_t len;
+};
 
-    /* one uint8_t response word */
-    uint8_t blk_response;
-    paddr_t blk_response_phys;
+/* position within a list of iovecs */
+struct iov_cursor {
+    const iovec_t *iov;
+    uint count;
+    uint index;
+    size_t pos;
 };
 
+static paddr_t buf_to_paddr(const void *va) {
+#if WITH_KERNEL_VM
+    return vaddr_to_paddr((void *)va);
+#else
+    return (paddr_t)(uintptr_t)va;
+#endif
+}
+
+static status_t virtio_block_init_queue(struct virtio_block_dev *bdev, uint index) {
+    struct virtio_block_queue *q = &bdev->queue[index];
+
+    q->index = index;
+    spin_lock_init(&q->lock);
+    event_init(&q->desc_event, false, 0);
+
+    q->hdrs = memalign(sizeof(struct virtio_blk_req_hdr), VIRTIO_BLK_RING_LEN * sizeof(struct virtio_blk_req_hdr));
+    if (!q->hdrs)
+        return ERR_NO_MEMORY;
+
+    return virtio_alloc_ring(bdev->dev, index, VIRTIO_BLK_RING_LEN);
+}
+
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) {
     LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
 
     /* allocate a new block device */
-    struct virtio_block_dev *bdev = malloc(sizeof(struct virtio_block_dev));
+    struct virtio_block_dev *bdev = calloc(1, sizeof(struct virtio_block_dev));
     if (!bdev)
         return ERR_NO_MEMORY;
 
-    mutex_init(&bdev->lock);
-    event_init(&bdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-
     bdev->dev = dev;
     dev->priv = bdev;
 
-    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req));
-#if WITH_KERNEL_VM
-    bdev->blk_req_phys = vaddr_to_paddr(bdev->blk_req);
-#else
-    bdev->blk_req_phys = (uint64_t)(uintptr_t)bdev->blk_req;
-#endif
-    LTRACEF("blk_req structure at %p (0x%lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
-
-#if WITH_KERNEL_VM
-    bdev->blk_response_phys = vaddr_to_paddr(&bdev->blk_response);
-#else
-    bdev->blk_response_phys = (uint64_t)(uintptr_t)&bdev->blk_response;
-#endif
-
     /* make sure the device is reset */
     virtio_reset_device(dev);
 
@@ -127,10 +191,29 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) {
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
+    /* take as many queues as the device offers, up to one per ring we can track */
+    uint32_t features = 0;
+    bdev->num_queues = 1;
+    if (host_features & VIRTIO_BLK_F_MQ) {
+        features |= VIRTIO_BLK_F_MQ;
+        bdev->num_queues = MAX(1u, MIN((uint)config->num_queues, (uint)MAX_VIRTIO_RINGS));
+    }
+    bdev->max_segs = VIRTIO_BLK_MAX_SEGS;
+    if (host_features & VIRTIO_BLK_F_SEG_MAX) {
+        features |= VIRTIO_BLK_F_SEG_MAX;
+        if (config->seg_max > 0)
+            bdev->max_segs = MIN(bdev->max_segs, config->seg_max);
+    }
+    virtio_set_guest_features(dev, features);
+
+    LTRACEF("%u queues, %u segments per request\n", bdev->num_queues, bdev->max_segs);
 
-    /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 256);
+    /* allocate the virtio rings */
+    for (uint i = 0; i < bdev->num_queues; i++) {
+        status_t err = virtio_block_init_queue(bdev, i);
+        if (err < 0)
+            return err;
+    }
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
@@ -149,19 +232,34 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) {
     /* override our block device hooks */
     bdev->bdev.read_block = &virtio_bdev_read_block;
     bdev->bdev.write_block = &virtio_bdev_write_block;
+    bdev->bdev.submit = &virtio_bdev_submit;
 
     bio_register_device(&bdev->bdev);
 
-    printf("found virtio block device of size %lld\n", config->capacity * config->blk_size);
+    printf("found virtio block device of size %lld, %u queue%s\n", config->capacity * config->blk_size,
+           bdev->num_queues, bdev->num_queues > 1 ? "s" : "");
 
     return NO_ERROR;
 }
 
+/* drop a reference to a transfer, completing it once the last one is gone */
+static void virtio_block_io_put(virtio_block_io_t *io, status_t err) {
+    if (err < 0)
+        io->err = err;
+    if (atomic_add(&io->pending, -1) == 1)
+        io->callback(io, io->err);
+}
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e) {
     struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+    struct virtio_block_queue *q = &bdev->queue[ring];
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
+    DEBUG_ASSERT(ring < bdev->num_queues);
+
+    spin_lock(&q->lock);
+
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
     for (;;) {
@@ -184,117 +282,242 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
         i = next;
     }
 
-    /* signal our event */
-    event_signal(&bdev->io_event, false);
+    /* pick up the request that used this chain */
+    uint16_t head = e->id;
+    virtio_block_io_t *io = q->txn[head];
+    uint8_t status = q->hdrs[head].status;
+    q->txn[head] = NULL;
+    q->in_flight--;
+
+    /* let anyone waiting for descriptors have another go */
+    event_signal(&q->desc_event, false);
+
+    spin_unlock(&q->lock);
+
+    LTRACEF("head %u status 0x%hhx\n", head, status);
+
+    DEBUG_ASSERT(io);
+    virtio_block_io_put(io, (status == VIRTIO_BLK_S_OK) ? NO_ERROR : ERR_IO);
 
     return INT_RESCHEDULE;
 }
 
-ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write) {
-    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+/* give back the last excess bytes the cursor walked over */
+static void iov_cursor_rewind(struct iov_cursor *c, size_t excess) {
+    while (excess > 0) {
+        if (c->pos == 0) {
+            DEBUG_ASSERT(c->index > 0);
+            c->index--;
+            c->pos = c->iov[c->index].iov_len;
+        }
+        size_t n = MIN(excess, c->pos);
+        c->pos -= n;
+        excess -= n;
+    }
+}
 
-    uint16_t i;
-    struct vring_desc *desc;
+/*
+ * Translate the next piece of the transfer into at most max_segs physically
+ * contiguous segments. Returns the number of bytes covered, a whole number of
+ * sectors, and advances the cursor past them.
+ */
+static size_t build_segs(struct iov_cursor *c, size_t len, struct virtio_blk_seg *segs, uint max_segs, uint *nsegs_out) {
+    uint nsegs = 0;
+    size_t total = 0;
+
+    while (total < len && c->index < c->count) {
+        const iovec_t *iov = &c->iov[c->index];
+        if (c->pos == iov->iov_len) {
+            c->index++;
+            c->pos = 0;
+            continue;
+        }
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+        uint8_t *va = (uint8_t *)iov->iov_base + c->pos;
+        size_t chunk = MIN(iov->iov_len - c->pos, len - total);
+#if WITH_KERNEL_VM
+        /* pages are translated one at a time */
+        chunk = MIN(chunk, PAGE_SIZE - ((vaddr_t)va & (PAGE_SIZE - 1)));
+#endif
+        paddr_t pa = buf_to_paddr(va);
+
+        if (nsegs > 0 && segs[nsegs - 1].pa + segs[nsegs - 1].len == pa) {
+            segs[nsegs - 1].len += chunk;
+        } else if (nsegs == max_segs) {
+            break;
+        } else {
+            segs[nsegs].pa = pa;
+            segs[nsegs].len = chunk;
+            nsegs++;
+        }
+
+        c->pos += chunk;
+        total += chunk;
+    }
+
+    /* the device only moves whole sectors, leave any partial one for the next request */
+    size_t excess = total % VIRTIO_BLK_SECTOR_SIZE;
+    if (excess > 0 && total < len) {
+        iov_cursor_rewind(c, excess);
+        total -= excess;
+        while (excess > 0) {
+            size_t n = MIN(excess, segs[nsegs - 1].len);
+            segs[nsegs - 1].len -= n;
+            excess -= n;
+            if (segs[nsegs - 1].len == 0)
+                nsegs--;
+        }
+    }
+
+    *nsegs_out = nsegs;
+    return total;
+}
+
+/* queue a single request made up of the given segments on a virtqueue */
+static void virtio_block_queue_request(struct virtio_block_dev *bdev, struct virtio_block_queue *q,
+                                       virtio_block_io_t *io, uint64_t sector,
+                                       const struct virtio_blk_seg *segs, uint nsegs) {
+    bool write = io->write;
+    struct virtio_device *dev = bdev->dev;
+    uint ring = q->index;
+
+    LTRACEF("queue %u sector %llu nsegs %u write %u\n", ring, sector, nsegs, write);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
 
-    mutex_acquire(&bdev->lock);
+    /* header + data + status, wait for the device to retire enough requests if we're short */
+    uint16_t head;
+    struct vring_desc *desc;
+    while ((desc = virtio_alloc_desc_chain(dev, ring, nsegs + 2, &head)) == NULL) {
+        event_unsignal(&q->desc_event);
+        spin_unlock_irqrestore(&q->lock, state);
+        event_wait(&q->desc_event);
+        spin_lock_irqsave(&q->lock, state);
+    }
 
-    /* set up the request */
-    bdev->blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    bdev->blk_req->ioprio = 0;
-    bdev->blk_req->sector = offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
-            bdev->blk_req->type, bdev->blk_req->ioprio, bdev->blk_req->sector);
+    struct virtio_blk_req_hdr *hdr = &q->hdrs[head];
+    hdr->req.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    hdr->req.ioprio = 0;
+    hdr->req.sector = sector;
+    hdr->status = 0xff;
 
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
+    q->txn[head] = io;
+    atomic_add(&io->pending, 1);
 
     // XXX not cache safe.
-    // At the moment only tested on arm qemu, which doesn't emulate cache.
+    // At the moment only tested on qemu, which doesn't emulate cache.
 
     /* set up the descriptor pointing to the head */
-    desc->addr = bdev->blk_req_phys;
+    paddr_t hdr_pa = buf_to_paddr(hdr);
+    desc->addr = hdr_pa + __offsetof(struct virtio_blk_req_hdr, req);
     desc->len = sizeof(struct virtio_blk_req);
     desc->flags |= VRING_DESC_F_NEXT;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-#if WITH_KERNEL_VM
-    /* translate the first buffer */
-    vaddr_t va = (vaddr_t)buf;
-    paddr_t pa = vaddr_to_paddr((void *)va);
-    desc->addr = (uint64_t)pa;
-    /* desc->len is filled in below */
-#else
-    desc->addr = (uint64_t)(uintptr_t)buf;
-    desc->len = len;
-#endif
-    desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-    desc->flags |= VRING_DESC_F_NEXT;
+    /* set up the descriptors pointing to the buffer */
+    for (uint i = 0; i < nsegs; i++) {
+        desc = virtio_desc_index_to_desc(dev, ring, desc->next);
+        desc->addr = segs[i].pa;
+        desc->len = segs[i].len;
+        desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
+        desc->flags |= VRING_DESC_F_NEXT;
+    }
 
-#if WITH_KERNEL_VM
-    /* see if we need to add more descriptors due to scatter gather */
-    paddr_t next_pa = PAGE_ALIGN(pa + 1);
-    desc->len = MIN(next_pa - pa, len);
-    LTRACEF("first descriptor va 0x%lx desc->addr 0x%llx desc->len %u\n", va, desc->addr, desc->len);
-    len -= desc->len;
-    while (len > 0) {
-        /* amount of source buffer handled by this iteration of the loop */
-        size_t len_tohandle = MIN(len, PAGE_SIZE);
-
-        /* translate the next page in the buffer */
-        va = PAGE_ALIGN(va + 1);
-        pa = vaddr_to_paddr((void *)va);
-        LTRACEF("va now 0x%lx, pa 0x%lx, next_pa 0x%lx, remaining len %zu\n", va, pa, next_pa, len);
-
-        /* is the new translated physical address contiguous to the last one? */
-        if (next_pa == pa) {
-            LTRACEF("extending last one by %zu bytes\n", len_tohandle);
-            desc->len += len_tohandle;
-        } else {
-            uint16_t next_i = virtio_alloc_desc(dev, 0);
-            struct vring_desc *next_desc = virtio_desc_index_to_desc(dev, 0, next_i);
-            DEBUG_ASSERT(next_desc);
+    /* set up the descriptor pointing to the response */
+    desc = virtio_desc_index_to_desc(dev, ring, desc->next);
+    desc->addr = hdr_pa + __offsetof(struct virtio_blk_req_hdr, status);
+    desc->len = 1;
+    desc->flags = VRING_DESC_F_WRITE;
 
-            LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
+    q->requests++;
+    q->in_flight++;
+    q->max_in_flight = MAX(q->max_in_flight, q->in_flight);
 
-            /* fill this descriptor in and put it after the last one but before the response descriptor */
-            next_desc->addr = (uint64_t)pa;
-            next_desc->len = len_tohandle;
-            next_desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-            next_desc->flags |= VRING_DESC_F_NEXT;
-            next_desc->next = desc->next;
-            desc->next = next_i;
+    /* submit the transfer and kick it off */
+    virtio_submit_chain(dev, ring, head);
+    virtio_kick(dev, ring);
 
-            desc = next_desc;
-        }
-        len -= len_tohandle;
-        next_pa += PAGE_SIZE;
+    spin_unlock_irqrestore(&q->lock, state);
+}
+
+status_t virtio_block_submit(struct virtio_device *dev, virtio_block_io_t *io) {
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+
+    LTRACEF("dev %p, io %p, iov %p, count %u, offset 0x%llx, write %u\n", dev, io,
+            io->iov, io->iov_count, io->offset, io->write);
+
+    ssize_t len = iovec_size(io->iov, io->iov_count);
+    if (len <= 0 || (io->offset % VIRTIO_BLK_SECTOR_SIZE) != 0 || (len % VIRTIO_BLK_SECTOR_SIZE) != 0)
+        return ERR_INVALID_ARGS;
+
+    /* spread the load over the queues by cpu, the device works on each one in parallel */
+    struct virtio_block_queue *q = &bdev->queue[arch_curr_cpu_num() % bdev->num_queues];
+
+    struct virtio_blk_seg segs[VIRTIO_BLK_MAX_SEGS];
+    uint nsegs;
+    struct iov_cursor c = { .iov = io->iov, .count = io->iov_count };
+    uint64_t sector = io->offset / VIRTIO_BLK_SECTOR_SIZE;
+
+    size_t done = build_segs(&c, len, segs, bdev->max_segs, &nsegs);
+    if (done == 0)
+        return ERR_INVALID_ARGS;
+
+    /* hold a reference while queuing so the transfer can't complete until every piece is out */
+    io->pending = 1;
+    io->err = NO_ERROR;
+
+    /* anything too fragmented for one request goes out as several, back to back */
+    while (done > 0) {
+        virtio_block_queue_request(bdev, q, io, sector, segs, nsegs);
+
+        sector += done / VIRTIO_BLK_SECTOR_SIZE;
+        len -= done;
+        done = (len > 0) ? build_segs(&c, len, segs, bdev->max_segs, &nsegs) : 0;
     }
-#endif
 
-    /* set up the descriptor pointing to the response */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-    desc->addr = bdev->blk_response_phys;
-    desc->len = 1;
-    desc->flags = VRING_DESC_F_WRITE;
+    virtio_block_io_put(io, (len > 0) ? ERR_INVALID_ARGS : NO_ERROR);
 
-    /* submit the transfer */
-    virtio_submit_chain(dev, 0, i);
+    return NO_ERROR;
+}
 
-    /* kick it off */
-    virtio_kick(dev, 0);
+struct virtio_block_wait {
+    virtio_block_io_t io;
+    event_t event;
+};
+
+static void virtio_block_wait_callback(virtio_block_io_t *io, status_t err) {
+    struct virtio_block_wait *wait = containerof(io, struct virtio_block_wait, io);
+
+    event_signal(&wait->event, false);
+}
+
+ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write) {
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
 
-    /* wait for the transfer to complete */
-    event_wait(&bdev->io_event);
+    iovec_t iov = { .iov_base = buf, .iov_len = len };
+    struct virtio_block_wait wait = {
+        .io = {
+            .iov = &iov,
+            .iov_count = 1,
+            .offset = offset,
+            .write = write,
+            .callback = &virtio_block_wait_callback,
+        },
+    };
+    event_init(&wait.event, false, 0);
+
+    status_t err = virtio_block_submit(dev, &wait.io);
+    if (err >= 0) {
+        /* wait for the transfer to complete */
+        event_wait(&wait.event);
+        err = wait.io.err;
+    }
 
-    LTRACEF("status 0x%hhx\n", bdev->blk_response);
+    event_destroy(&wait.event);
 
-    mutex_release(&bdev->lock);
+    LTRACEF("err %d\n", err);
 
-    return len;
+    return err;
 }
 
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count) {
@@ -303,7 +526,7 @@ static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block
     LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
 
     if (virtio_block_read_write(dev->dev, buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, false) == 0) {
+                                count * dev->bdev.block_size, false) == NO_ERROR) {
         return count * dev->bdev.block_size;
     } else {
         return ERR_IO;
@@ -316,10 +539,38 @@ static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_
     LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
 
     if (virtio_block_read_write(dev->dev, (void *)buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, true) == 0) {
+                                count * dev->bdev.block_size, true) == NO_ERROR) {
         return count * dev->bdev.block_size;
     } else {
         return ERR_IO;
     }
 }
 
+/* the transfer lives in the bio request's driver scratch space while it is in flight */
+STATIC_ASSERT(sizeof(virtio_block_io_t) <= sizeof(((bio_request_t *)0)->driver_state));
+
+static void virtio_bdev_io_callback(virtio_block_io_t *io, status_t err) {
+    bio_request_t *req = (bio_request_t *)io->arg;
+
+    bio_request_complete(req, (err < 0) ? err : (ssize_t)req->len);
+}
+
+static void virtio_bdev_submit(struct bdev *bdev, bio_request_t *req, off_t offset) {
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+    virtio_block_io_t *io = (virtio_block_io_t *)req->driver_state;
+
+    LTRACEF("dev %p, req %p, offset 0x%llx, len %zu\n", bdev, req, offset, req->len);
+
+    *io = (virtio_block_io_t) {
+        .iov = req->iov,
+        .iov_count = req->iov_count,
+        .offset = offset,
+        .write = req->write,
+        .callback = &virtio_bdev_io_callback,
+        .arg = req,
+    };
+
+    status_t err = virtio_block_submit(dev->dev, io);
+    if (err < 0)
+        bio_request_complete(req, err);
+}
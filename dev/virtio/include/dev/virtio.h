@@ -44,6 +44,9 @@ void virtio_reset_device(struct virtio_device *dev);
 void virtio_status_acknowledge_driver(struct virtio_device *dev);
 void virtio_status_driver_ok(struct virtio_device *dev);
 
+/* accept a subset of the device's feature bits, between acknowledge and driver ok */
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features);
+
 /* api used by devices to interact with the virtio bus */
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len) __NONNULL();
 
@@ -54,14 +54,18 @@ void event_init(event_t *e, bool initial, uint flags) {
 void event_destroy(event_t *e) {
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&e->wait, state);
 
     e->magic = 0;
     e->signaled = false;
     e->flags = 0;
+    int woken = e->wait.count;
     wait_queue_destroy(&e->wait, true);
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&e->wait, state);
+
+    if (woken > 0)
+        thread_handoff();
 }
 
 /**
@@ -84,7 +88,7 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout) {
 
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&e->wait, state);
 
     if (e->signaled) {
         /* signaled, we're going to fall through */
@@ -93,11 +97,14 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout) {
             e->signaled = false;
         }
     } else {
-        /* unsignaled, block here */
+        /* unsignaled, block here. the event may be destroyed by the time we
+         * wake up, so wait_queue_block() has already dropped its lock. */
         ret = wait_queue_block(&e->wait, timeout);
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+        return ret;
     }
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&e->wait, state);
 
     return ret;
 }
@@ -122,12 +129,13 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout) {
 status_t event_signal(event_t *e, bool reschedule) {
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&e->wait, state);
 
+    int woken = 0;
     if (!e->signaled) {
         if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
             /* try to release one thread and leave unsignaled if successful */
-            if (wait_queue_wake_one(&e->wait, reschedule, NO_ERROR) <= 0) {
+            if ((woken = wait_queue_wake_one(&e->wait, reschedule, NO_ERROR)) <= 0) {
                 /*
                  * if we didn't actually find a thread to wake up, go to
                  * signaled state and let the next call to event_wait
@@ -138,11 +146,14 @@ status_t event_signal(event_t *e, bool reschedule) {
         } else {
             /* release all threads and remain signaled */
             e->signaled = true;
-            wait_queue_wake_all(&e->wait, reschedule, NO_ERROR);
+            woken = wait_queue_wake_all(&e->wait, reschedule, NO_ERROR);
         }
     }
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&e->wait, state);
+
+    if (reschedule && woken > 0)
+        thread_handoff();
 
     return NO_ERROR;
 }
@@ -7,6 +7,7 @@
  */
 #pragma once
 
+#include <arch/atomic.h>
 #include <kernel/thread.h>
 #include <limits.h>
 #include <lk/compiler.h>
@@ -27,6 +28,7 @@ typedef uint32_t mp_cpu_mask_t;
 typedef enum {
     MP_IPI_GENERIC,
     MP_IPI_RESCHEDULE,
+    MP_IPI_TLB_SHOOTDOWN,
 } mp_ipi_t;
 
 #ifdef WITH_SMP
@@ -42,9 +44,9 @@ enum handler_return mp_mbx_reschedule_irq(void);
 struct mp_state {
     volatile mp_cpu_mask_t active_cpus;
 
-    /* only safely accessible with thread lock held */
-    mp_cpu_mask_t idle_cpus;
-    mp_cpu_mask_t realtime_cpus;
+    /* updated atomically, since each cpu's scheduler runs under its own lock */
+    volatile mp_cpu_mask_t idle_cpus;
+    volatile mp_cpu_mask_t realtime_cpus;
 };
 
 extern struct mp_state mp;
@@ -57,13 +59,12 @@ static inline int mp_is_cpu_idle(uint cpu) {
     return mp.idle_cpus & (1 << cpu);
 }
 
-/* must be called with the thread lock held */
 static inline void mp_set_cpu_idle(uint cpu) {
-    mp.idle_cpus |= 1UL << cpu;
+    atomic_or((volatile int *)&mp.idle_cpus, 1U << cpu);
 }
 
 static inline void mp_set_cpu_busy(uint cpu) {
-    mp.idle_cpus &= ~(1UL << cpu);
+    atomic_and((volatile int *)&mp.idle_cpus, ~(1U << cpu));
 }
 
 static inline mp_cpu_mask_t mp_get_idle_mask(void) {
@@ -71,11 +72,11 @@ static inline mp_cpu_mask_t mp_get_idle_mask(void) {
 }
 
 static inline void mp_set_cpu_realtime(uint cpu) {
-    mp.realtime_cpus |= 1UL << cpu;
+    atomic_or((volatile int *)&mp.realtime_cpus, 1U << cpu);
 }
 
 static inline void mp_set_cpu_non_realtime(uint cpu) {
-    mp.realtime_cpus &= ~(1UL << cpu);
+    atomic_and((volatile int *)&mp.realtime_cpus, ~(1U << cpu));
 }
 
 static inline mp_cpu_mask_t mp_get_realtime_mask(void) {
@@ -17,27 +17,53 @@ __BEGIN_CDECLS
 
 #define MUTEX_MAGIC (0x6D757478)  // 'mutx'
 
+/* spin briefly before blocking while the holder is running on another cpu */
+#define MUTEX_FLAG_ADAPTIVE (1<<0)
+
 typedef struct mutex {
     uint32_t magic;
+    uint flags;
     thread_t *holder;
+#if WITH_SMP
+    int holder_cpu; /* cpu the holder took the mutex on, -1 if not known */
+#endif
     int count;
     wait_queue_t wait;
+    struct list_node held_node; /* on holder->held_mutexes */
 } mutex_t;
 
-#define MUTEX_INITIAL_VALUE(m) \
+#if WITH_SMP
+#define MUTEX_INITIAL_HOLDER_CPU .holder_cpu = -1,
+#else
+#define MUTEX_INITIAL_HOLDER_CPU
+#endif
+
+#define MUTEX_INITIAL_VALUE_ETC(m, _flags) \
 { \
     .magic = MUTEX_MAGIC, \
+    .flags = _flags, \
     .holder = NULL, \
+    MUTEX_INITIAL_HOLDER_CPU \
     .count = 0, \
     .wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
+    .held_node = LIST_INITIAL_CLEARED_VALUE, \
 }
 
+#define MUTEX_INITIAL_VALUE(m) MUTEX_INITIAL_VALUE_ETC(m, 0)
+
 /* Rules for Mutexes:
  * - Mutexes are only safe to use from thread context.
  * - Mutexes are non-recursive.
+ * - Mutexes implement priority inheritance: while a thread waits on a mutex,
+ *   the holder (and the holder of any mutex that holder is waiting on) runs
+ *   at no less than the waiter's priority, until it releases the mutex.
+ * - Mutexes created with MUTEX_FLAG_ADAPTIVE spin for a short while before
+ *   blocking if the holder is running on another cpu. Use it for locks held
+ *   over short critical sections. It has no effect without SMP.
 */
 
 void mutex_init(mutex_t *);
+void mutex_init_etc(mutex_t *, uint flags);
 void mutex_destroy(mutex_t *);
 status_t mutex_acquire_timeout(mutex_t *, lk_time_t); /* try to acquire the mutex with a timeout value */
 status_t mutex_release(mutex_t *);
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2026 The LK Contributors
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <assert.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lk/compiler.h>
+#include <lk/debug.h>
+#include <stdint.h>
+
+__BEGIN_CDECLS
+
+/*
+ * Reader/writer locks, for read-mostly data. Any number of readers can hold
+ * the lock at once, or a single writer. A waiting writer holds off new readers,
+ * so a steady stream of readers can't starve it.
+ *
+ * rwlock_t is the blocking version, for thread context only. Unlike mutex_t it
+ * does not do priority inheritance.
+ *
+ * spin_rwlock_t is the spinning version, with the same rules as spin_lock_t:
+ * disable interrupts first (or use the irqsave variants) if the lock is also
+ * taken from interrupt context.
+ *
+ * Neither is recursive, not even for readers: a reader that takes the lock
+ * again while a writer is waiting deadlocks.
+ */
+
+#define RWLOCK_MAGIC (0x72776c6b)  // 'rwlk'
+
+typedef struct rwlock {
+    uint32_t magic;
+    int readers; /* number of readers holding the lock */
+    int writers_waiting;
+    thread_t *writer; /* writer holding the lock, if any */
+    wait_queue_t wait; /* readers and writers waiting for the lock */
+} rwlock_t;
+
+#define RWLOCK_INITIAL_VALUE(l) \
+{ \
+    .magic = RWLOCK_MAGIC, \
+    .readers = 0, \
+    .writers_waiting = 0, \
+    .writer = NULL, \
+    .wait = WAIT_QUEUE_INITIAL_VALUE((l).wait), \
+}
+
+void rwlock_init(rwlock_t *);
+void rwlock_destroy(rwlock_t *);
+status_t rwlock_acquire_read(rwlock_t *);
+status_t rwlock_release_read(rwlock_t *);
+status_t rwlock_acquire_write(rwlock_t *);
+status_t rwlock_release_write(rwlock_t *);
+
+/* does the current thread hold the lock for writing? */
+static inline bool is_rwlock_write_held(rwlock_t *l) {
+    return l->writer == get_current_thread();
+}
+
+/* spinning reader/writer lock */
+typedef struct spin_rwlock {
+    volatile int state;
+} spin_rwlock_t;
+
+#define SPIN_RWLOCK_INITIAL_VALUE { .state = 0 }
+
+/* state is a reader count plus these two bits */
+#define SPIN_RWLOCK_WRITER          (1 << 30)
+#define SPIN_RWLOCK_WRITER_WAITING  (1 << 29)
+
+static inline void spin_rwlock_init(spin_rwlock_t *l) {
+    l->state = 0;
+}
+
+/* interrupts should already be disabled */
+static inline void spin_rwlock_read_lock(spin_rwlock_t *l) {
+    for (;;) {
+        int state = l->state;
+        if (!(state & (SPIN_RWLOCK_WRITER | SPIN_RWLOCK_WRITER_WAITING)) &&
+                __atomic_compare_exchange_n(&l->state, &state, state + 1, true,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+static inline void spin_rwlock_read_unlock(spin_rwlock_t *l) {
+    DEBUG_ASSERT((l->state & ~SPIN_RWLOCK_WRITER_WAITING) > 0);
+    __atomic_fetch_sub(&l->state, 1, __ATOMIC_RELEASE);
+}
+
+/* interrupts should already be disabled */
+static inline void spin_rwlock_write_lock(spin_rwlock_t *l) {
+    for (;;) {
+        int state = l->state;
+        if ((state & ~SPIN_RWLOCK_WRITER_WAITING) == 0) {
+            /* taking the lock also clears the waiting bit. any other waiting
+             * writers set it again on their next pass. */
+            if (__atomic_compare_exchange_n(&l->state, &state, SPIN_RWLOCK_WRITER, true,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return;
+        } else if (!(state & SPIN_RWLOCK_WRITER_WAITING)) {
+            __atomic_fetch_or(&l->state, SPIN_RWLOCK_WRITER_WAITING, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static inline void spin_rwlock_write_unlock(spin_rwlock_t *l) {
+    DEBUG_ASSERT(l->state & SPIN_RWLOCK_WRITER);
+    __atomic_fetch_and(&l->state, ~SPIN_RWLOCK_WRITER, __ATOMIC_RELEASE);
+}
+
+static inline bool spin_rwlock_write_held(spin_rwlock_t *l) {
+    return l->state & SPIN_RWLOCK_WRITER;
+}
+
+/* same as above, but save and disable interrupts first */
+#define spin_rwlock_read_lock_irqsave(l, statep) \
+    do { arch_interrupt_save(&(statep), SPIN_LOCK_FLAG_INTERRUPTS); spin_rwlock_read_lock(l); } while (0)
+#define spin_rwlock_read_unlock_irqrestore(l, statep) \
+    do { spin_rwlock_read_unlock(l); arch_interrupt_restore(statep, SPIN_LOCK_FLAG_INTERRUPTS); } while (0)
+#define spin_rwlock_write_lock_irqsave(l, statep) \
+    do { arch_interrupt_save(&(statep), SPIN_LOCK_FLAG_INTERRUPTS); spin_rwlock_write_lock(l); } while (0)
+#define spin_rwlock_write_unlock_irqrestore(l, statep) \
+    do { spin_rwlock_write_unlock(l); arch_interrupt_restore(statep, SPIN_LOCK_FLAG_INTERRUPTS); } while (0)
+
+__END_CDECLS
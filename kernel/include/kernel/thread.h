@@ -72,12 +72,16 @@ typedef struct thread {
 
     /* active bits */
     struct list_node queue_node;
-    int priority;
+    int priority; /* effective priority, including any inherited boost */
+    int base_priority; /* priority as set by thread_create() or thread_set_priority() */
+    int run_queue_cpu; /* run queue queue_node is on, -1 if none */
+    int run_queue_priority; /* list within that run queue, -1 if parked for handoff */
     enum thread_state state;
     int remaining_quantum;
     unsigned int flags;
 #if WITH_SMP
     int curr_cpu;
+    int last_cpu; /* cpu this thread most recently ran on, -1 if never */
     int pinned_cpu; /* only run on pinned_cpu if >= 0 */
 #endif
 #if WITH_KERNEL_VM
@@ -88,6 +92,10 @@ typedef struct thread {
     struct wait_queue *blocking_wait_queue;
     status_t wait_queue_block_ret;
 
+    /* priority inheritance, protected by the mutex code */
+    struct mutex *blocking_mutex; /* mutex we're waiting to acquire */
+    struct list_node held_mutexes; /* mutexes we own that have had waiters */
+
     /* architecture stuff */
     struct arch_thread arch;
 
@@ -112,13 +120,17 @@ typedef struct thread {
 #if WITH_SMP
 #define thread_curr_cpu(t) ((t)->curr_cpu)
 #define thread_pinned_cpu(t) ((t)->pinned_cpu)
+#define thread_last_cpu(t) ((t)->last_cpu)
 #define thread_set_curr_cpu(t,c) ((t)->curr_cpu = (c))
-#define thread_set_pinned_cpu(t, c) ((t)->pinned_cpu = (c))
+void thread_set_pinned_cpu(thread_t *t, int cpu);
+#define thread_set_last_cpu(t,c) ((t)->last_cpu = (c))
 #else
 #define thread_curr_cpu(t) (0)
 #define thread_pinned_cpu(t) (-1)
+#define thread_last_cpu(t) (0)
 #define thread_set_curr_cpu(t,c) do {} while(0)
-#define thread_set_pinned_cpu(t, c) do {} while(0)
+#define thread_set_pinned_cpu(t, c) do { (void)(t); (void)(c); } while(0)
+#define thread_set_last_cpu(t,c) do {} while(0)
 #endif
 
 /* thread priority */
@@ -151,6 +163,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 status_t thread_resume(thread_t *);
 void thread_exit(int retcode) __NO_RETURN;
 void thread_sleep(lk_time_t delay);
+void thread_sleep_ns(lk_time_ns_t delay);
 status_t thread_detach(thread_t *t);
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout);
 status_t thread_detach_and_resume(thread_t *t);
@@ -164,7 +177,11 @@ void dump_all_threads(void);
 void thread_yield(void); /* give up the cpu voluntarily */
 void thread_preempt(void); /* get preempted (inserted into head of run queue) */
 void thread_block(void); /* block on something and reschedule */
-void thread_unblock(thread_t *t, bool resched); /* go back in the run queue */
+void thread_handoff(void); /* run threads woken with reschedule set ahead of us */
+void thread_set_effective_priority(thread_t *t, int priority); /* priority inheritance */
+#if WITH_SMP
+bool thread_running_on_cpu(const thread_t *t, uint cpu); /* t may be stale, it's never dereferenced */
+#endif
 
 #ifdef WITH_LIB_UTHREAD
 void uthread_context_switch(thread_t *oldthread, thread_t *newthread);
@@ -183,14 +200,28 @@ static inline void set_current_thread(thread_t *t) {
     arch_set_current_thread(t);
 }
 
-/* scheduler lock */
-extern spin_lock_t thread_lock;
+/*
+ * scheduler lock
+ *
+ * Each cpu has its own run queue, protected by its own spinlock. THREAD_LOCK
+ * takes the lock of the cpu we're running on, which keeps the scheduler from
+ * switching threads on this cpu. The lock is held across a context switch and
+ * released by whichever thread runs next, so always unlock the current cpu's
+ * lock rather than a saved pointer. See kernel/wait.h for the lock ordering.
+ */
+spin_lock_t *thread_curr_cpu_lock(void);
 
-#define THREAD_LOCK(state) spin_lock_saved_state_t state; spin_lock_irqsave(&thread_lock, state)
-#define THREAD_UNLOCK(state) spin_unlock_irqrestore(&thread_lock, state)
+#define THREAD_LOCK(state) \
+    spin_lock_saved_state_t state; \
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS); \
+    spin_lock(thread_curr_cpu_lock())
+#define THREAD_UNLOCK(state) do { \
+    spin_unlock(thread_curr_cpu_lock()); \
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS); \
+} while (0)
 
 static inline bool thread_lock_held(void) {
-    return spin_lock_held(&thread_lock);
+    return spin_lock_held(thread_curr_cpu_lock());
 }
 
 /* thread local storage */
@@ -225,6 +256,7 @@ struct thread_stats {
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong steals; /* threads pulled from another cpu's run queue */
 #endif
 };
 
@@ -29,6 +29,15 @@ typedef struct timer {
 
     timer_callback callback;
     void *arg;
+
+    /* where the timer is filed while it's pending */
+    uint cpu;
+    uint wheel_slot;
+
+#if PLATFORM_HAS_HRTIMER
+    lk_time_ns_t scheduled_time_ns;
+    lk_time_ns_t periodic_time_ns;
+#endif
 } timer_t;
 
 #define TIMER_INITIAL_VALUE(t) \
@@ -39,6 +48,8 @@ typedef struct timer {
     .periodic_time = 0, \
     .callback = NULL, \
     .arg = NULL, \
+    .cpu = 0, \
+    .wheel_slot = 0, \
 }
 
 /* Rules for Timers:
@@ -52,4 +63,11 @@ void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
 void timer_set_periodic(timer_t *, lk_time_t period, timer_callback, void *arg);
 void timer_cancel(timer_t *);
 
+/* Nanosecond resolution timers, for sub millisecond deadlines.
+ * - Periodic timers are rearmed relative to their previous deadline, so they don't drift
+ * - Without PLATFORM_HAS_HRTIMER the delay is rounded up to whole milliseconds
+ */
+void timer_set_oneshot_ns(timer_t *, lk_time_ns_t delay, timer_callback, void *arg);
+void timer_set_periodic_ns(timer_t *, lk_time_ns_t period, timer_callback, void *arg);
+
 __END_CDECLS
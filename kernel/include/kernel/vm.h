@@ -68,10 +68,12 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 8; /* block order, valid on the head page of a free block */
+    uint ref : 16;
 } vm_page_t;
 
-#define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_NONFREE    (0x1)
+#define VM_PAGE_FLAG_FREE_HEAD  (0x2) /* first page of a free block in the buddy allocator */
 
 /* kernel address space */
 #ifndef KERNEL_ASPACE_BASE
@@ -102,6 +104,12 @@ static inline bool is_user_address(vaddr_t va) {
 }
 
 /* physical allocator */
+
+/* largest block the buddy allocator tracks, as log2 of the page count */
+#ifndef PMM_MAX_ORDER
+#define PMM_MAX_ORDER 10
+#endif
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -115,7 +123,10 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+
+    /* free blocks of 1 << order pages, aligned to their size in physical memory */
+    struct list_node free_list[PMM_MAX_ORDER + 1];
+    size_t free_blocks[PMM_MAX_ORDER + 1];
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
@@ -187,7 +198,12 @@ typedef struct vmm_aspace {
     vaddr_t base;
     size_t  size;
 
+    /* regions sorted by base, also indexed by a balanced tree for lookups */
     struct list_node region_list;
+    struct vmm_region *region_tree;
+
+    /* mask of cpus that have loaded this aspace and may have cached translations */
+    volatile int tlb_cpus;
 
     arch_aspace_t arch_aspace;
 } vmm_aspace_t;
@@ -205,10 +221,22 @@ typedef struct vmm_region {
     size_t  size;
 
     struct list_node page_list;
+
+    /* avl tree node, keyed by base */
+    struct vmm_region *tree_parent;
+    struct vmm_region *tree_left;
+    struct vmm_region *tree_right;
+    int tree_height;
+
+    /* free space between the previous region (or the aspace base) and this one,
+     * and the largest such gap anywhere in this subtree */
+    size_t gap_before;
+    size_t subtree_max_gap;
 } vmm_region_t;
 
 #define VMM_REGION_FLAG_RESERVED 0x1
 #define VMM_REGION_FLAG_PHYSICAL 0x2
+#define VMM_REGION_FLAG_LAZY     0x4
 
 /* grab a handle to the kernel address space */
 extern vmm_aspace_t _kernel_aspace;
@@ -241,6 +269,11 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t va);
 
 /* For the above region creation routines. Allocate virtual space at the passed in pointer. */
 #define VMM_FLAG_VALLOC_SPECIFIC 0x1
+/* For vmm_alloc. Don't allocate any pages up front, each one is allocated and
+   zeroed by the page fault handler on first touch. The region must not be
+   touched with interrupts disabled, or by code running under the vmm's own
+   lock (a fault there is fatal rather than a deadlock). */
+#define VMM_FLAG_LAZY            0x2
 
 /* allocate a new address space */
 status_t vmm_create_aspace(vmm_aspace_t **aspace, const char *name, uint flags)
@@ -250,6 +283,16 @@ __NONNULL((1));
 status_t vmm_free_aspace(vmm_aspace_t *aspace)
 __NONNULL((1));
 
+/* called by arch code on a translation fault, with interrupts enabled if they
+   were in the faulting context. returns NO_ERROR if the fault was resolved and
+   the access can be retried. faults taken while the vmm lock is held are
+   refused with ERR_BAD_STATE. */
+#define VMM_PF_FLAG_WRITE       (1u << 0)
+#define VMM_PF_FLAG_INSTRUCTION (1u << 1)
+#define VMM_PF_FLAG_USER        (1u << 2)
+
+status_t vmm_page_fault_handler(vaddr_t addr, uint pf_flags);
+
 /* internal routine by the scheduler to swap mmu contexts */
 void vmm_context_switch(vmm_aspace_t *oldspace, vmm_aspace_t *newaspace);
 
@@ -257,6 +300,30 @@ void vmm_context_switch(vmm_aspace_t *oldspace, vmm_aspace_t *newaspace);
    NULL is a valid argument, which unmaps the current user address space */
 void vmm_set_active_aspace(vmm_aspace_t *aspace);
 
+/* batched tlb shootdown.
+   collect the ranges unmapped from an aspace, then invalidate them on every
+   cpu that may hold translations for it with a single ipi per cpu. only does
+   anything on SMP architectures that set ARCH_MMU_NEEDS_TLB_SHOOTDOWN, elsewhere
+   arch_mmu_unmap() already takes care of every cpu. */
+#define VMM_TLB_BATCH_RANGES 8
+
+typedef struct vmm_tlb_batch {
+    vmm_aspace_t *aspace;
+    bool flush_all; /* too many ranges to track, invalidate the whole aspace */
+    uint count;
+    struct {
+        vaddr_t base;
+        size_t size;
+    } ranges[VMM_TLB_BATCH_RANGES];
+} vmm_tlb_batch_t;
+
+void vmm_tlb_batch_init(vmm_tlb_batch_t *batch, vmm_aspace_t *aspace) __NONNULL((1, 2));
+void vmm_tlb_batch_add(vmm_tlb_batch_t *batch, vaddr_t base, size_t size) __NONNULL((1));
+void vmm_tlb_batch_flush(vmm_tlb_batch_t *batch) __NONNULL((1));
+
+/* called from arch code when a MP_IPI_TLB_SHOOTDOWN arrives */
+void vmm_tlb_shootdown_irq(void);
+
 __END_CDECLS
 
 #endif // !ASSEMBLY
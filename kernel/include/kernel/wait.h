@@ -10,6 +10,7 @@
 #include <arch/defines.h>
 #include <arch/ops.h>
 #include <arch/thread.h>
+#include <kernel/spinlock.h>
 #include <lk/compiler.h>
 #include <lk/list.h>
 #include <sys/types.h>
@@ -21,6 +22,7 @@ __BEGIN_CDECLS
 
 typedef struct wait_queue {
     int magic;
+    spin_lock_t lock;
     struct list_node list;
     int count;
 } wait_queue_t;
@@ -28,18 +30,37 @@ typedef struct wait_queue {
 #define WAIT_QUEUE_INITIAL_VALUE(q) \
 { \
     .magic = WAIT_QUEUE_MAGIC, \
+    .lock = SPIN_LOCK_INITIAL_VALUE, \
     .list = LIST_INITIAL_VALUE((q).list), \
     .count = 0 \
 }
 
+/*
+ * Each wait queue carries its own spinlock, which the objects built on top of
+ * it (mutex, semaphore, event, ...) also use to protect their own state.
+ *
+ * Lock ordering:
+ *   1) subsystem locks that nest outside wait queues (port_lock, the mutex
+ *      priority inheritance lock)
+ *   2) wait queue locks, at most one at a time
+ *   3) run queue locks (THREAD_LOCK), at most one at a time
+ *   4) timer_lock and the thread list lock, which are leaves
+ *
+ * Never switch threads while holding a wait queue lock. wait_queue_block()
+ * drops it and returns without it, since the queue may be gone by the time the
+ * thread runs again.
+ */
+#define WAIT_QUEUE_LOCK(q, state) spin_lock_saved_state_t state; spin_lock_irqsave(&(q)->lock, state)
+#define WAIT_QUEUE_UNLOCK(q, state) spin_unlock_irqrestore(&(q)->lock, state)
+
 /* wait queue primitive */
-/* NOTE: must be inside critical section when using these */
+/* NOTE: the wait queue's lock must be held when using these */
 void wait_queue_init(wait_queue_t *wait);
 
 /*
  * release all the threads on this wait queue with a return code of ERR_OBJECT_DESTROYED.
  * the caller must assure that no other threads are operating on the wait queue during or
- * after the call.
+ * after the call. the queue's storage may be freed as soon as its lock is dropped.
  */
 void wait_queue_destroy(wait_queue_t *, bool reschedule);
 
@@ -48,17 +69,26 @@ void wait_queue_destroy(wait_queue_t *, bool reschedule);
  * return status is whatever the caller of wait_queue_wake_*() specifies.
  * a timeout other than INFINITE_TIME will set abort after the specified time
  * and return ERR_TIMED_OUT. a timeout of 0 will immediately return.
+ * returns with the queue's lock released but interrupts still disabled.
  */
 status_t wait_queue_block(wait_queue_t *, lk_time_t timeout);
 
 /*
  * release one or more threads from the wait queue.
- * reschedule = should the system reschedule if any is released.
+ * reschedule = woken threads should run on this cpu ahead of the current thread.
+ *   the switch itself happens in thread_handoff(), which the caller must call
+ *   after dropping the wait queue lock (and any other locks it holds).
  * wait_queue_error = what wait_queue_block() should return for the blocking thread.
  */
 int wait_queue_wake_one(wait_queue_t *, bool reschedule, status_t wait_queue_error);
 int wait_queue_wake_all(wait_queue_t *, bool reschedule, status_t wait_queue_error);
 
+/*
+ * release the highest priority thread on the wait queue, the first one to have
+ * blocked among equals. returns the thread woken, or NULL if the queue was empty.
+ */
+struct thread *wait_queue_wake_highest(wait_queue_t *, bool reschedule, status_t wait_queue_error);
+
 /*
  * remove the thread from whatever wait queue it's in.
  * return an error if the thread is not currently blocked (or is the current thread)
@@ -19,8 +19,114 @@
 
 #include <assert.h>
 #include <kernel/thread.h>
+#include <kernel/spinlock.h>
 #include <lk/debug.h>
 #include <lk/err.h>
+#include <lk/list.h>
+
+/*
+ * Priority inheritance.
+ *
+ * The uncontended acquire and release paths only touch the mutex's own wait
+ * queue lock. Everything that involves a waiter -- blocking, handing the mutex
+ * over, timing out, lending and returning priority -- also runs under pi_lock,
+ * which nests outside the wait queue locks (see kernel/wait.h). Since a mutex
+ * with a waiter can only change hands on those slow paths, the holder of every
+ * mutex along a chain of blocked threads is stable while pi_lock is held.
+ *
+ * A thread's held_mutexes list only tracks the mutexes it holds that have had
+ * waiters, which are the only ones that can contribute to its priority. It is
+ * only changed with pi_lock held, so the fast paths never touch it.
+ */
+static spin_lock_t pi_lock = SPIN_LOCK_INITIAL_VALUE;
+
+/* bound on how far a boost is propagated, in case of a deadlock cycle */
+#define MAX_PI_CHAIN_DEPTH 16
+
+/* note where the new holder is running, for adaptive spinners */
+static inline void mutex_set_holder_cpu(mutex_t *m, int cpu) {
+#if WITH_SMP
+    m->holder_cpu = cpu;
+#endif
+}
+
+/* highest priority of any thread waiting on the mutex, -1 if there are none */
+static int mutex_waiter_priority(mutex_t *m) {
+    DEBUG_ASSERT(spin_lock_held(&m->wait.lock));
+
+    int priority = -1;
+    thread_t *t;
+    list_for_every_entry(&m->wait.list, t, thread_t, queue_node) {
+        if (t->priority > priority)
+            priority = t->priority;
+    }
+    return priority;
+}
+
+/*
+ * Lend priority to the holder of m, then to the holder of whatever mutex that
+ * thread is blocked on, and so on down the chain. Stops at the first holder that
+ * is already running at least as high, since everything past it already is too.
+ */
+static void mutex_boost_chain(mutex_t *m, int priority) {
+    DEBUG_ASSERT(spin_lock_held(&pi_lock));
+
+    for (int depth = 0; m && depth < MAX_PI_CHAIN_DEPTH; depth++) {
+        thread_t *holder = m->holder;
+        if (!holder || holder->priority >= priority)
+            break;
+
+        thread_set_effective_priority(holder, priority);
+        m = holder->blocking_mutex;
+    }
+}
+
+/*
+ * Recompute a mutex holder's priority from its base priority and the waiters
+ * on the mutexes it still holds. Called with pi_lock held but no wait queue lock.
+ */
+static void mutex_update_priority(thread_t *t) {
+    DEBUG_ASSERT(spin_lock_held(&pi_lock));
+
+    int priority = t->base_priority;
+    mutex_t *held;
+    list_for_every_entry(&t->held_mutexes, held, mutex_t, held_node) {
+        spin_lock(&held->wait.lock);
+        int waiter_priority = mutex_waiter_priority(held);
+        spin_unlock(&held->wait.lock);
+
+        if (waiter_priority > priority)
+            priority = waiter_priority;
+    }
+
+    thread_set_effective_priority(t, priority);
+}
+
+/*
+ * Give an unowned mutex directly to its highest priority waiter, which then
+ * inherits from whoever is left waiting. Called with pi_lock and the mutex's
+ * wait queue lock held. The waiter can't get past wait_queue_block() until we
+ * drop the wait queue lock, so its bookkeeping is safe to touch from here.
+ */
+static bool mutex_hand_off(mutex_t *m, bool reschedule) {
+    DEBUG_ASSERT(m->holder == NULL);
+
+    thread_t *t = wait_queue_wake_highest(&m->wait, reschedule, NO_ERROR);
+    if (!t)
+        return false;
+
+    m->holder = t;
+    mutex_set_holder_cpu(m, -1); /* until it gets to run */
+    t->blocking_mutex = NULL;
+    DEBUG_ASSERT(!list_in_list(&m->held_node));
+    list_add_head(&t->held_mutexes, &m->held_node);
+
+    int waiter_priority = mutex_waiter_priority(m);
+    if (waiter_priority > t->priority)
+        thread_set_effective_priority(t, waiter_priority);
+
+    return true;
+}
 
 /**
  * @brief  Initialize a mutex_t
@@ -29,6 +135,16 @@ void mutex_init(mutex_t *m) {
     *m = (mutex_t)MUTEX_INITIAL_VALUE(*m);
 }
 
+/**
+ * @brief  Initialize a mutex_t with flags
+ *
+ * @param m      The mutex to initialize
+ * @param flags  MUTEX_FLAG_* options, see kernel/mutex.h
+ */
+void mutex_init_etc(mutex_t *m, uint flags) {
+    *m = (mutex_t)MUTEX_INITIAL_VALUE_ETC(*m, flags);
+}
+
 /**
  * @brief  Destroy a mutex_t
  *
@@ -44,11 +160,153 @@ void mutex_destroy(mutex_t *m) {
               get_current_thread(), get_current_thread()->name, m, m->holder, m->holder->name);
 #endif
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&pi_lock, state);
+    spin_lock(&m->wait.lock);
+
+    /* the waiters are about to be told the mutex is gone */
+    thread_t *t;
+    list_for_every_entry(&m->wait.list, t, thread_t, queue_node) {
+        t->blocking_mutex = NULL;
+    }
+
+    thread_t *holder = m->holder;
+    if (list_in_list(&m->held_node))
+        list_delete(&m->held_node);
+    m->holder = NULL;
+
     m->magic = 0;
     m->count = 0;
+    int woken = m->wait.count;
     wait_queue_destroy(&m->wait, true);
-    THREAD_UNLOCK(state);
+    spin_unlock(&m->wait.lock);
+
+    if (holder)
+        mutex_update_priority(holder);
+
+    spin_unlock_irqrestore(&pi_lock, state);
+
+    if (woken > 0)
+        thread_handoff();
+}
+
+/* take the mutex if it's free */
+static bool mutex_try_take(mutex_t *m, thread_t *current_thread) {
+    bool taken = false;
+
+    WAIT_QUEUE_LOCK(&m->wait, state);
+    if (m->count == 0) {
+        m->count = 1;
+        m->holder = current_thread;
+        mutex_set_holder_cpu(m, arch_curr_cpu_num());
+        taken = true;
+    }
+    WAIT_QUEUE_UNLOCK(&m->wait, state);
+
+    return taken;
+}
+
+#if WITH_SMP
+/*
+ * Adaptive mutexes: a holder that is running on another cpu will likely let go
+ * soon, so wait for that by spinning instead of paying for two context switches.
+ * Give up as soon as the holder stops running, once someone else has gone to
+ * sleep on the mutex (it will be handed to them, not us), or after a while.
+ * The holder may exit and be freed once it has released the mutex, so it is
+ * never dereferenced: whether it's running is checked by comparing it against
+ * what the cpu it took the mutex on is running. A holder that has migrated
+ * since counts as not running.
+ */
+#define MUTEX_SPIN_LIMIT 10000
+
+static bool mutex_spin(mutex_t *m, thread_t *current_thread) {
+    volatile mutex_t *vm = m;
+
+    for (uint i = 0; i < MUTEX_SPIN_LIMIT; i++) {
+        int count = vm->count;
+        if (count == 0) {
+            if (mutex_try_take(m, current_thread))
+                return true;
+            continue;
+        }
+        if (count > 1)
+            return false;
+
+        thread_t *holder = vm->holder;
+        int holder_cpu = vm->holder_cpu;
+        if (holder && (holder_cpu < 0 || !thread_running_on_cpu(holder, holder_cpu)))
+            return false;
+
+        CF;
+    }
+
+    return false;
+}
+#endif
+
+static status_t mutex_acquire_contended(mutex_t *m, lk_time_t timeout) {
+    thread_t *current_thread = get_current_thread();
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&pi_lock, state);
+    spin_lock(&m->wait.lock);
+
+    /* the mutex may have been released while we were getting here */
+    if (++m->count == 1) {
+        m->holder = current_thread;
+        mutex_set_holder_cpu(m, arch_curr_cpu_num());
+        spin_unlock(&m->wait.lock);
+        spin_unlock_irqrestore(&pi_lock, state);
+        return NO_ERROR;
+    }
+
+    /* the holder's priority now depends on us, so track the mutex on its list.
+     * there may be no holder if the mutex is in the middle of being handed off. */
+    if (m->holder && !list_in_list(&m->held_node))
+        list_add_head(&m->holder->held_mutexes, &m->held_node);
+
+    current_thread->blocking_mutex = m;
+    mutex_boost_chain(m, current_thread->priority);
+
+    /* holding the wait queue lock until we're on the queue is enough to keep
+     * the holder from releasing past us. wait_queue_block() drops it. */
+    spin_unlock(&pi_lock);
+    status_t ret = wait_queue_block(&m->wait, timeout);
+
+    /* on success the releasing thread has already made us the holder. on a
+     * general error the mutex may have been destroyed out from underneath us,
+     * so just exit (which is really an invalid state anyway).
+     */
+    if (unlikely(ret == ERR_TIMED_OUT)) {
+        /* back out the acquire. any boost we lent the holder stays with it
+         * until it releases the mutex.
+         *
+         * race: the mutex may have been destroyed after the timeout,
+         * but before we got scheduled again which makes messing with the
+         * count variable dangerous.
+         */
+        spin_lock(&pi_lock);
+        spin_lock(&m->wait.lock);
+
+        current_thread->blocking_mutex = NULL;
+        m->count--;
+
+        /* if the holder released while we were on our way out, it found no one
+         * on the queue to hand the mutex to. pass it on for it. */
+        if (m->holder == NULL && m->count > 0)
+            mutex_hand_off(m, false);
+
+        spin_unlock(&m->wait.lock);
+        spin_unlock_irqrestore(&pi_lock, state);
+        return ret;
+    }
+
+    /* we hold the mutex now, so it can't go away */
+    if (ret == NO_ERROR)
+        mutex_set_holder_cpu(m, arch_curr_cpu_num());
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    return ret;
 }
 
 /**
@@ -56,7 +314,11 @@ void mutex_destroy(mutex_t *m) {
  *
  * This function waits up to \a timeout ms for the mutex to become available.
  * Timeout may be zero, in which case this function returns immediately if
- * the mutex is not free.
+ * the mutex is not free. Adaptive mutexes spin for a short while first if the
+ * holder is running on another cpu.
+ *
+ * While waiting, the holder of the mutex runs at no less than the calling
+ * thread's priority.
  *
  * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
  * other values on error
@@ -64,39 +326,54 @@ void mutex_destroy(mutex_t *m) {
 status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout) {
     DEBUG_ASSERT(m->magic == MUTEX_MAGIC);
 
+    thread_t *current_thread = get_current_thread();
+
 #if LK_DEBUGLEVEL > 0
-    if (unlikely(get_current_thread() == m->holder))
+    if (unlikely(current_thread == m->holder))
         panic("mutex_acquire_timeout: thread %p (%s) tried to acquire mutex %p it already owns.\n",
-              get_current_thread(), get_current_thread()->name, m);
+              current_thread, current_thread->name, m);
 #endif
 
-    THREAD_LOCK(state);
-
-    status_t ret = NO_ERROR;
-    if (unlikely(++m->count > 1)) {
-        ret = wait_queue_block(&m->wait, timeout);
-        if (unlikely(ret < NO_ERROR)) {
-            /* if the acquisition timed out, back out the acquire and exit */
-            if (likely(ret == ERR_TIMED_OUT)) {
-                /*
-                 * race: the mutex may have been destroyed after the timeout,
-                 * but before we got scheduled again which makes messing with the
-                 * count variable dangerous.
-                 */
-                m->count--;
-            }
-            /* if there was a general error, it may have been destroyed out from
-             * underneath us, so just exit (which is really an invalid state anyway)
-             */
-            goto err;
-        }
+    if (likely(mutex_try_take(m, current_thread)))
+        return NO_ERROR;
+
+    if (timeout == 0)
+        return ERR_TIMED_OUT;
+
+#if WITH_SMP
+    if ((m->flags & MUTEX_FLAG_ADAPTIVE) && mutex_spin(m, current_thread))
+        return NO_ERROR;
+#endif
+
+    return mutex_acquire_contended(m, timeout);
+}
+
+static void mutex_release_contended(mutex_t *m) {
+    thread_t *current_thread = get_current_thread();
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&pi_lock, state);
+    spin_lock(&m->wait.lock);
+
+    if (list_in_list(&m->held_node))
+        list_delete(&m->held_node);
+    m->holder = NULL;
+
+    bool woken = false;
+    if (--m->count >= 1) {
+        /* hand the mutex straight to the most important waiter */
+        woken = mutex_hand_off(m, true);
     }
 
-    m->holder = get_current_thread();
+    spin_unlock(&m->wait.lock);
 
-err:
-    THREAD_UNLOCK(state);
-    return ret;
+    /* give back whatever we inherited through this mutex */
+    mutex_update_priority(current_thread);
+
+    spin_unlock_irqrestore(&pi_lock, state);
+
+    if (woken)
+        thread_handoff();
 }
 
 /**
@@ -105,23 +382,29 @@ err:
 status_t mutex_release(mutex_t *m) {
     DEBUG_ASSERT(m->magic == MUTEX_MAGIC);
 
+    thread_t *current_thread = get_current_thread();
+
 #if LK_DEBUGLEVEL > 0
-    if (unlikely(get_current_thread() != m->holder)) {
+    if (unlikely(current_thread != m->holder)) {
         panic("mutex_release: thread %p (%s) tried to release mutex %p it doesn't own. owned by %p (%s)\n",
-              get_current_thread(), get_current_thread()->name, m, m->holder, m->holder ? m->holder->name : "none");
+              current_thread, current_thread->name, m, m->holder, m->holder ? m->holder->name : "none");
     }
 #endif
 
-    THREAD_LOCK(state);
-
-    m->holder = 0;
+    WAIT_QUEUE_LOCK(&m->wait, state);
 
-    if (unlikely(--m->count >= 1)) {
-        /* release a thread */
-        wait_queue_wake_one(&m->wait, true, NO_ERROR);
+    /* no waiters, never had any while we held it, and no boost to give back */
+    if (likely(m->count == 1 && !list_in_list(&m->held_node) &&
+               current_thread->priority == current_thread->base_priority)) {
+        m->count = 0;
+        m->holder = NULL;
+        WAIT_QUEUE_UNLOCK(&m->wait, state);
+        return NO_ERROR;
     }
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&m->wait, state);
+
+    mutex_release_contended(m);
+
     return NO_ERROR;
 }
-
@@ -19,8 +19,8 @@
 #include <lk/debug.h>
 #include <lk/err.h>
 #include <lk/list.h>
+#include <lib/kmem_cache.h>
 #include <lk/pow2.h>
-#include <malloc.h>
 #include <string.h>
 
 // write ports can be in two states, open and closed, which have a
@@ -74,13 +74,71 @@ typedef struct {
 } read_port_t;
 
 
+#define PORT_BUF_ALLOC_SIZE(pk_count) \
+    (sizeof(port_buf_t) + (((pk_count) - 1) * sizeof(port_packet_t)))
+
+// every port object and buffer comes out of one of these.
+static kmem_cache_t write_port_cache =
+    KMEM_CACHE_INITIAL_VALUE(write_port_cache, "write_port_t",
+                             sizeof(write_port_t), __alignof(write_port_t), NULL);
+static kmem_cache_t read_port_cache =
+    KMEM_CACHE_INITIAL_VALUE(read_port_cache, "read_port_t",
+                             sizeof(read_port_t), __alignof(read_port_t), NULL);
+static kmem_cache_t port_group_cache =
+    KMEM_CACHE_INITIAL_VALUE(port_group_cache, "port_group_t",
+                             sizeof(port_group_t), __alignof(port_group_t), NULL);
+static kmem_cache_t port_buf_cache =
+    KMEM_CACHE_INITIAL_VALUE(port_buf_cache, "port_buf_t",
+                             PORT_BUF_ALLOC_SIZE(PORT_BUFF_SIZE), __alignof(port_buf_t), NULL);
+static kmem_cache_t port_buf_big_cache =
+    KMEM_CACHE_INITIAL_VALUE(port_buf_big_cache, "port_buf_t big",
+                             PORT_BUF_ALLOC_SIZE(PORT_BUFF_SIZE_BIG), __alignof(port_buf_t), NULL);
+
 static struct list_node write_port_list;
 
+// protects the port list, the port buffers and the port/group links. ports
+// are tied together across objects (a write touches every reader and their
+// groups) so this lock is taken outside of the individual wait queue locks.
+static spin_lock_t port_lock = SPIN_LOCK_INITIAL_VALUE;
+
+#define PORT_LOCK(state) spin_lock_saved_state_t state; spin_lock_irqsave(&port_lock, state)
+#define PORT_UNLOCK(state) spin_unlock_irqrestore(&port_lock, state)
+
+// block on a port's wait queue, dropping the port lock while asleep. on
+// ERR_OBJECT_DESTROYED the port may already be freed, callers must not touch it.
+static status_t port_block(wait_queue_t *wait, lk_time_t timeout) {
+    spin_lock(&wait->lock);
+    spin_unlock(&port_lock);
+    status_t ret = wait_queue_block(wait, timeout);
+    spin_lock(&port_lock);
+    return ret;
+}
+
+static int port_wake_one(wait_queue_t *wait, status_t wait_queue_error) {
+    spin_lock(&wait->lock);
+    int ret = wait_queue_wake_one(wait, false, wait_queue_error);
+    spin_unlock(&wait->lock);
+    return ret;
+}
+
+static void port_wake_all(wait_queue_t *wait, status_t wait_queue_error) {
+    spin_lock(&wait->lock);
+    wait_queue_wake_all(wait, false, wait_queue_error);
+    spin_unlock(&wait->lock);
+}
+
+static int port_wait_queue_destroy(wait_queue_t *wait) {
+    spin_lock(&wait->lock);
+    int ret = wait->count;
+    wait_queue_destroy(wait, true);
+    spin_unlock(&wait->lock);
+    return ret;
+}
+
 
 static port_buf_t *make_buf(bool big) {
     uint pk_count = big ? PORT_BUFF_SIZE_BIG : PORT_BUFF_SIZE;
-    uint size = sizeof(port_buf_t) + ((pk_count - 1) * sizeof(port_packet_t));
-    port_buf_t *buf = (port_buf_t *) malloc(size);
+    port_buf_t *buf = kmem_cache_alloc(big ? &port_buf_big_cache : &port_buf_cache);
     if (!buf)
         return NULL;
     buf->log2 = log2_uint(pk_count);
@@ -89,6 +147,16 @@ static port_buf_t *make_buf(bool big) {
     return buf;
 }
 
+static void free_buf(port_buf_t *buf) {
+    if (!buf)
+        return;
+    if (valpow2(buf->log2) == PORT_BUFF_SIZE_BIG) {
+        kmem_cache_free(&port_buf_big_cache, buf);
+    } else {
+        kmem_cache_free(&port_buf_cache, buf);
+    }
+}
+
 static inline bool buf_is_empty(port_buf_t *buf) {
     return buf->avail == valpow2(buf->log2);
 }
@@ -134,13 +202,13 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port) {
 
     // lookup for existing port, return that if found.
     write_port_t *wp = NULL;
-    THREAD_LOCK(state1);
+    PORT_LOCK(state1);
     list_for_every_entry(&write_port_list, wp, write_port_t, node) {
         if (strcmp(wp->name, name) == 0) {
             // can't return closed ports.
             if (wp->magic == WRITEPORT_MAGIC_X)
                 wp = NULL;
-            THREAD_UNLOCK(state1);
+            PORT_UNLOCK(state1);
             if (wp) {
                 *port = (void *) wp;
                 return ERR_ALREADY_EXISTS;
@@ -149,10 +217,10 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port) {
             }
         }
     }
-    THREAD_UNLOCK(state1);
+    PORT_UNLOCK(state1);
 
     // not found, create the write port and the circular buffer.
-    wp = calloc(1, sizeof(write_port_t));
+    wp = kmem_cache_zalloc(&write_port_cache);
     if (!wp)
         return ERR_NO_MEMORY;
 
@@ -163,15 +231,15 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port) {
 
     wp->buf = make_buf(mode & PORT_MODE_BIG_BUFFER);
     if (!wp->buf) {
-        free(wp);
+        kmem_cache_free(&write_port_cache, wp);
         return ERR_NO_MEMORY;
     }
 
     // todo: race condtion! a port with the same name could have been created
     // by another thread at is point.
-    THREAD_LOCK(state2);
+    PORT_LOCK(state2);
     list_add_tail(&write_port_list, &wp->node);
-    THREAD_UNLOCK(state2);
+    PORT_UNLOCK(state2);
 
     *port = (void *)wp;
     return NO_ERROR;
@@ -182,7 +250,7 @@ status_t port_open(const char *name, void *ctx, port_t *port) {
         return ERR_INVALID_ARGS;
 
     // assume success; create the read port and buffer now.
-    read_port_t *rp = calloc(1, sizeof(read_port_t));
+    read_port_t *rp = kmem_cache_zalloc(&read_port_cache);
     if (!rp)
         return ERR_NO_MEMORY;
 
@@ -195,14 +263,14 @@ status_t port_open(const char *name, void *ctx, port_t *port) {
     // that here.
     port_buf_t *buf = make_buf(false);  // Small is enough.
     if (!buf) {
-        free(rp);
+        kmem_cache_free(&read_port_cache, rp);
         return ERR_NO_MEMORY;
     }
 
     // find the named write port and associate it with read port.
     status_t rc = ERR_NOT_FOUND;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     write_port_t *wp = NULL;
     list_for_every_entry(&write_port_list, wp, write_port_t, node) {
         if (strcmp(wp->name, name) == 0) {
@@ -233,15 +301,14 @@ status_t port_open(const char *name, void *ctx, port_t *port) {
             break;
         }
     }
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
-    if (buf)
-        free(buf);
+    free_buf(buf);
 
     if (rc == NO_ERROR) {
         *port = (void *)rp;
     } else {
-        free(rp);
+        kmem_cache_free(&read_port_cache, rp);
     }
     return rc;
 }
@@ -258,7 +325,7 @@ status_t port_group(port_t *ports, size_t count, port_t *group) {
         return ERR_INVALID_ARGS;
 
     // assume success; create port group now.
-    port_group_t *pg = calloc(1, sizeof(port_group_t));
+    port_group_t *pg = kmem_cache_zalloc(&port_group_cache);
     if (!pg)
         return ERR_NO_MEMORY;
 
@@ -268,7 +335,7 @@ status_t port_group(port_t *ports, size_t count, port_t *group) {
 
     status_t rc = NO_ERROR;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     for (size_t ix = 0; ix != count; ix++) {
         read_port_t *rp = (read_port_t *)ports[ix];
         if ((rp->magic != READPORT_MAGIC) || rp->gport) {
@@ -284,12 +351,12 @@ status_t port_group(port_t *ports, size_t count, port_t *group) {
         rp->gport = pg;
         list_add_tail(&pg->rp_list, &rp->g_node);
     }
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     if (rc == NO_ERROR) {
         *group = (port_t *)pg;
     } else {
-        free(pg);
+        kmem_cache_free(&port_group_cache, pg);
     }
     return rc;
 }
@@ -308,7 +375,7 @@ status_t port_group_add(port_t group, port_t port) {
         return ERR_BAD_HANDLE;
 
     status_t rc = NO_ERROR;
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
 
     if (list_length(&pg->rp_list) == MAX_PORT_GROUP_COUNT) {
         rc = ERR_TOO_BIG;
@@ -319,11 +386,11 @@ status_t port_group_add(port_t group, port_t port) {
         // If the new read port being added has messages available, try to wake
         // any readers that might be present.
         if (!buf_is_empty(rp->buf)) {
-            wait_queue_wake_one(&pg->wait, false, NO_ERROR);
+            port_wake_one(&pg->wait, NO_ERROR);
         }
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     return rc;
 }
@@ -341,7 +408,7 @@ status_t port_group_remove(port_t group, port_t port) {
     if (rp->magic != READPORT_MAGIC || rp->gport != pg)
         return ERR_BAD_HANDLE;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
 
     bool found = false;
     read_port_t *current_rp;
@@ -351,12 +418,14 @@ status_t port_group_remove(port_t group, port_t port) {
         }
     }
 
-    if (!found)
+    if (!found) {
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
+    }
 
     list_delete(&rp->g_node);
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     return NO_ERROR;
 }
@@ -366,10 +435,10 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count) {
         return ERR_INVALID_ARGS;
 
     write_port_t *wp = (write_port_t *)port;
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (wp->magic != WRITEPORT_MAGIC_W) {
         // wrong port type.
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
 
@@ -392,17 +461,17 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count) {
 
             int awaken = 0;
             if (rp->gport) {
-                awaken = wait_queue_wake_one(&rp->gport->wait, false, NO_ERROR);
+                awaken = port_wake_one(&rp->gport->wait, NO_ERROR);
             }
             if (!awaken) {
-                awaken = wait_queue_wake_one(&rp->wait, false, NO_ERROR);
+                awaken = port_wake_one(&rp->wait, NO_ERROR);
             }
 
             awake_count += awaken;
         }
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
 #if RESCHEDULE_POLICY
     if (awake_count)
@@ -423,7 +492,7 @@ static inline status_t read_no_lock(read_port_t *rp, lk_time_t timeout, port_res
     if (!timeout)
         return ERR_TIMED_OUT;
 
-    status_t wr = wait_queue_block(&rp->wait, timeout);
+    status_t wr = port_block(&rp->wait, timeout);
     if (wr != NO_ERROR)
         return wr;
     // recursive tail call is usually optimized away with a goto.
@@ -437,7 +506,7 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result) {
     status_t rc = ERR_GENERIC;
     read_port_t *rp = (read_port_t *)port;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a single port.
         rc = read_no_lock(rp, timeout, result);
@@ -453,7 +522,7 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result) {
                     goto read_exit;
             }
             // no data, block on the group waitqueue.
-            rc = wait_queue_block(&pg->wait, timeout);
+            rc = port_block(&pg->wait, timeout);
         } while (rc == NO_ERROR);
     } else {
         // wrong port type.
@@ -461,7 +530,7 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result) {
     }
 
 read_exit:
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
     return rc;
 }
 
@@ -472,10 +541,10 @@ status_t port_destroy(port_t port) {
     write_port_t *wp = (write_port_t *) port;
     port_buf_t *buf = NULL;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (wp->magic != WRITEPORT_MAGIC_X) {
         // wrong port type.
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
     // remove self from global named ports list.
@@ -489,9 +558,9 @@ status_t port_destroy(port_t port) {
         read_port_t *rp;
         list_for_every_entry(&wp->rp_list, rp, read_port_t, w_node) {
             // wake the read and group ports.
-            wait_queue_wake_all(&rp->wait, false, ERR_CANCELLED);
+            port_wake_all(&rp->wait, ERR_CANCELLED);
             if (rp->gport) {
-                wait_queue_wake_all(&rp->gport->wait, false, ERR_CANCELLED);
+                port_wake_all(&rp->gport->wait, ERR_CANCELLED);
             }
             // remove self from reader ports.
             rp->wport = NULL;
@@ -499,10 +568,10 @@ status_t port_destroy(port_t port) {
     }
 
     wp->magic = 0;
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
-    free(buf);
-    free(wp);
+    free_buf(buf);
+    kmem_cache_free(&write_port_cache, wp);
     return NO_ERROR;
 }
 
@@ -512,8 +581,10 @@ status_t port_close(port_t port) {
 
     read_port_t *rp = (read_port_t *) port;
     port_buf_t *buf = NULL;
+    kmem_cache_t *cache;
+    int woken = 0;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a read port.
         if (rp->wport) {
@@ -531,38 +602,44 @@ status_t port_close(port_t port) {
             list_delete(&rp->g_node);
         }
         // wake up waiters, the return code is ERR_OBJECT_DESTROYED.
-        wait_queue_destroy(&rp->wait, true);
+        woken = port_wait_queue_destroy(&rp->wait);
         rp->magic = 0;
+        cache = &read_port_cache;
 
     } else if (rp->magic == PORTGROUP_MAGIC) {
         // dealing with a port group.
         port_group_t *pg = (port_group_t *) port;
         // wake up waiters.
-        wait_queue_destroy(&pg->wait, true);
+        woken = port_wait_queue_destroy(&pg->wait);
         // remove self from reader ports.
         rp = NULL;
         list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
             rp->gport = NULL;
         }
         pg->magic = 0;
+        cache = &port_group_cache;
 
     } else if (rp->magic == WRITEPORT_MAGIC_W) {
         // dealing with a write port.
         write_port_t *wp = (write_port_t *) port;
         // mark it as closed. Now it can be read but not written to.
         wp->magic = WRITEPORT_MAGIC_X;
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return NO_ERROR;
 
     } else {
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
+
+    // let the woken waiters run before the port goes away.
+    if (woken > 0)
+        thread_handoff();
 
-    free(buf);
-    free(port);
+    free_buf(buf);
+    kmem_cache_free(cache, port);
     return NO_ERROR;
 }
 
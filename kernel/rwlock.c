@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2026 The LK Contributors
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+
+/**
+ * @file
+ * @brief  Reader/writer lock functions
+ *
+ * @defgroup rwlock Reader/writer lock
+ * @{
+ */
+
+#include <kernel/rwlock.h>
+
+#include <kernel/thread.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+
+/*
+ * Readers and writers sleep on the same wait queue, whose lock also protects
+ * the rest of the rwlock. Whenever the lock may have become available every
+ * waiter is woken to recheck. Writes are expected to be rare, so the extra
+ * wakeups are cheaper than keeping separate queues.
+ */
+
+/**
+ * @brief  Initialize a rwlock_t
+ */
+void rwlock_init(rwlock_t *l) {
+    *l = (rwlock_t)RWLOCK_INITIAL_VALUE(*l);
+}
+
+/**
+ * @brief  Destroy a rwlock_t
+ *
+ * Any threads waiting for the lock are woken with ERR_OBJECT_DESTROYED.
+ */
+void rwlock_destroy(rwlock_t *l) {
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+    WAIT_QUEUE_LOCK(&l->wait, state);
+    l->magic = 0;
+    l->readers = 0;
+    l->writers_waiting = 0;
+    l->writer = NULL;
+    int woken = l->wait.count;
+    wait_queue_destroy(&l->wait, true);
+    WAIT_QUEUE_UNLOCK(&l->wait, state);
+
+    if (woken > 0)
+        thread_handoff();
+}
+
+/**
+ * @brief  Acquire the lock for reading
+ *
+ * Waits while a writer holds the lock or is waiting for it.
+ *
+ * @return  NO_ERROR on success, ERR_OBJECT_DESTROYED if the lock was destroyed
+ */
+status_t rwlock_acquire_read(rwlock_t *l) {
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+    DEBUG_ASSERT(l->writer != get_current_thread());
+
+    status_t ret = NO_ERROR;
+
+    WAIT_QUEUE_LOCK(&l->wait, state);
+    while (unlikely(l->writer || l->writers_waiting > 0)) {
+        /* returns with the lock dropped. if the lock was destroyed it may be
+         * gone already, so only retake it on a normal wakeup */
+        ret = wait_queue_block(&l->wait, INFINITE_TIME);
+        if (ret < NO_ERROR) {
+            arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+            return ret;
+        }
+        spin_lock(&l->wait.lock);
+    }
+    l->readers++;
+
+    WAIT_QUEUE_UNLOCK(&l->wait, state);
+    return ret;
+}
+
+/**
+ * @brief  Release a read hold on the lock
+ */
+status_t rwlock_release_read(rwlock_t *l) {
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+    int woken = 0;
+
+    WAIT_QUEUE_LOCK(&l->wait, state);
+    DEBUG_ASSERT(l->readers > 0);
+    if (--l->readers == 0 && l->wait.count > 0)
+        woken = wait_queue_wake_all(&l->wait, true, NO_ERROR);
+    WAIT_QUEUE_UNLOCK(&l->wait, state);
+
+    if (woken > 0)
+        thread_handoff();
+
+    return NO_ERROR;
+}
+
+/**
+ * @brief  Acquire the lock for writing
+ *
+ * Waits until there are no readers or writers. New readers are held off in
+ * the meantime.
+ *
+ * @return  NO_ERROR on success, ERR_OBJECT_DESTROYED if the lock was destroyed
+ */
+status_t rwlock_acquire_write(rwlock_t *l) {
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+    DEBUG_ASSERT(l->writer != get_current_thread());
+
+    status_t ret = NO_ERROR;
+
+    WAIT_QUEUE_LOCK(&l->wait, state);
+    if (unlikely(l->writer || l->readers > 0)) {
+        l->writers_waiting++;
+        do {
+            ret = wait_queue_block(&l->wait, INFINITE_TIME);
+            if (ret < NO_ERROR) {
+                /* it may have been destroyed out from underneath us */
+                arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+                return ret;
+            }
+            spin_lock(&l->wait.lock);
+        } while (l->writer || l->readers > 0);
+        l->writers_waiting--;
+    }
+    l->writer = get_current_thread();
+
+    WAIT_QUEUE_UNLOCK(&l->wait, state);
+    return ret;
+}
+
+/**
+ * @brief  Release a write hold on the lock
+ */
+status_t rwlock_release_write(rwlock_t *l) {
+    DEBUG_ASSERT(l->magic == RWLOCK_MAGIC);
+
+#if LK_DEBUGLEVEL > 0
+    if (unlikely(l->writer != get_current_thread())) {
+        panic("rwlock_release_write: thread %p (%s) tried to release rwlock %p it doesn't own. owned by %p\n",
+              get_current_thread(), get_current_thread()->name, l, l->writer);
+    }
+#endif
+
+    int woken = 0;
+
+    WAIT_QUEUE_LOCK(&l->wait, state);
+    l->writer = NULL;
+    if (l->wait.count > 0)
+        woken = wait_queue_wake_all(&l->wait, true, NO_ERROR);
+    WAIT_QUEUE_UNLOCK(&l->wait, state);
+
+    if (woken > 0)
+        thread_handoff();
+
+    return NO_ERROR;
+}
+
+/** @} */
@@ -25,16 +25,20 @@ void sem_init(semaphore_t *sem, unsigned int value) {
 }
 
 void sem_destroy(semaphore_t *sem) {
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&sem->wait, state);
     sem->count = 0;
+    int woken = sem->wait.count;
     wait_queue_destroy(&sem->wait, true);
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&sem->wait, state);
+
+    if (woken > 0)
+        thread_handoff();
 }
 
 int sem_post(semaphore_t *sem, bool resched) {
     int ret = 0;
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&sem->wait, state);
 
     /*
      * If the count is or was negative then a thread is waiting for a resource, otherwise
@@ -43,52 +47,63 @@ int sem_post(semaphore_t *sem, bool resched) {
     if (unlikely(++sem->count <= 0))
         ret = wait_queue_wake_one(&sem->wait, resched, NO_ERROR);
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&sem->wait, state);
+
+    if (resched && ret > 0)
+        thread_handoff();
 
     return ret;
 }
 
 status_t sem_wait(semaphore_t *sem) {
     status_t ret = NO_ERROR;
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&sem->wait, state);
 
     /*
      * If there are no resources available then we need to
      * sit in the wait queue until sem_post adds some.
      */
-    if (unlikely(--sem->count < 0))
+    if (unlikely(--sem->count < 0)) {
+        /* returns with the lock dropped */
         ret = wait_queue_block(&sem->wait, INFINITE_TIME);
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+        return ret;
+    }
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&sem->wait, state);
     return ret;
 }
 
 status_t sem_trywait(semaphore_t *sem) {
     status_t ret = NO_ERROR;
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&sem->wait, state);
 
     if (unlikely(sem->count <= 0))
         ret = ERR_NOT_READY;
     else
         sem->count--;
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&sem->wait, state);
     return ret;
 }
 
 status_t sem_timedwait(semaphore_t *sem, lk_time_t timeout) {
     status_t ret = NO_ERROR;
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&sem->wait, state);
 
     if (unlikely(--sem->count < 0)) {
+        /* returns with the lock dropped */
         ret = wait_queue_block(&sem->wait, timeout);
-        if (ret < NO_ERROR) {
-            if (ret == ERR_TIMED_OUT) {
-                sem->count++;
-            }
+        if (ret != ERR_TIMED_OUT) {
+            arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+            return ret;
         }
+
+        /* a timed out waiter still holds its place in the count */
+        spin_lock(&sem->wait.lock);
+        sem->count++;
     }
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&sem->wait, state);
     return ret;
 }
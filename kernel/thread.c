@@ -22,6 +22,7 @@
 #include <kernel/mp.h>
 #include <kernel/timer.h>
 #include <lib/heap.h>
+#include <lib/kmem_cache.h>
 #include <lk/debug.h>
 #include <lk/err.h>
 #include <lk/list.h>
@@ -43,18 +44,45 @@ struct thread_stats thread_stats[SMP_MAX_CPUS];
 
 #define DEBUG_THREAD_CONTEXT_SWITCH 0
 
-/* global thread list */
+/* global thread list, protected by thread_list_lock */
 static struct list_node thread_list;
+static spin_lock_t thread_list_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* master thread spinlock */
-spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
+/* thread structures allocated on behalf of thread_create() */
+static kmem_cache_t thread_cache =
+    KMEM_CACHE_INITIAL_VALUE(thread_cache, "thread_t", sizeof(thread_t), __alignof(thread_t), NULL);
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/* detached threads that exited and still need their structure freed, protected by thread_list_lock */
+static struct list_node dead_thread_list = LIST_INITIAL_VALUE(dead_thread_list);
+
+/*
+ * the run queues, one per cpu, each protected by its own lock.
+ *
+ * A thread's scheduling state is protected by the lock of whatever it's
+ * currently on: the wait queue lock while it's blocked, the run queue lock
+ * while it's ready or running. Transitions out of THREAD_SUSPENDED and into
+ * THREAD_DEATH, along with the thread's flags, are protected by the thread's
+ * retcode_wait_queue lock.
+ *
+ * A thread takes its cpu's run queue lock before dropping whatever lock it
+ * blocked under, and that lock is only released once the switch away from it
+ * is complete. Taking a thread's last cpu's run queue lock is therefore enough
+ * to know it's no longer running there.
+ */
+struct run_queue {
+    spin_lock_t lock;
+    struct list_node list[NUM_PRIORITIES];
+    uint32_t bitmap;
+    uint count;
+
+    /* threads woken with reschedule set, waiting for thread_handoff() */
+    struct list_node handoff;
+} __CPU_ALIGN;
+
+static struct run_queue run_queue[SMP_MAX_CPUS];
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue[0].bitmap) * 8);
 
 /* the idle thread(s) (statically allocated) */
 #if WITH_SMP
@@ -68,50 +96,212 @@ static thread_t _idle_thread;
 /* local routines */
 static void thread_resched(void);
 static void idle_thread_routine(void) __NO_RETURN;
+static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, void *arg);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
 /* preemption timer */
 static timer_t preempt_timer[SMP_MAX_CPUS];
 #endif
 
+#if WITH_SMP
+/* the thread each cpu is running, only ever compared against, never followed */
+static thread_t *volatile cpu_running_thread[SMP_MAX_CPUS];
+#endif
+
+spin_lock_t *thread_curr_cpu_lock(void) {
+    return &run_queue[arch_curr_cpu_num()].lock;
+}
+
 /* run queue manipulation */
-static void insert_in_run_queue_head(thread_t *t) {
+static void insert_in_run_queue_head(thread_t *t, uint cpu) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
-
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+    DEBUG_ASSERT(spin_lock_held(&run_queue[cpu].lock));
+
+    struct run_queue *rq = &run_queue[cpu];
+    list_add_head(&rq->list[t->priority], &t->queue_node);
+    rq->bitmap |= (1<<t->priority);
+    rq->count++;
+    t->run_queue_cpu = cpu;
+    t->run_queue_priority = t->priority;
 }
 
-static void insert_in_run_queue_tail(thread_t *t) {
+static void insert_in_run_queue_tail(thread_t *t, uint cpu) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+    DEBUG_ASSERT(spin_lock_held(&run_queue[cpu].lock));
+
+    struct run_queue *rq = &run_queue[cpu];
+    list_add_tail(&rq->list[t->priority], &t->queue_node);
+    rq->bitmap |= (1<<t->priority);
+    rq->count++;
+    t->run_queue_cpu = cpu;
+    t->run_queue_priority = t->priority;
+}
+
+/* the thread's priority may have been changed by priority inheritance since it
+ * was queued, so use the list it was actually put on */
+static void remove_from_run_queue(thread_t *t, uint cpu) {
+    struct run_queue *rq = &run_queue[cpu];
+    int priority = t->run_queue_priority;
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    DEBUG_ASSERT(t->run_queue_cpu == (int)cpu);
+
+    list_delete(&t->queue_node);
+    if (list_is_empty(&rq->list[priority]))
+        rq->bitmap &= ~(1<<priority);
+    rq->count--;
+    t->run_queue_cpu = -1;
 }
 
-static void wakeup_cpu_for_thread(thread_t *t)
-{
-    /* Wake up the core to which this thread is pinned
-     * or wake up all if thread is unpinned */
+/*
+ * Pick the cpu whose run queue a newly readied thread should go on.
+ * Pinned threads always go to their cpu. Otherwise prefer an idle cpu,
+ * starting with the one the thread last ran on, then the last cpu if it
+ * is not running a real time thread, and finally the local cpu.
+ */
+static uint select_cpu_for_thread(thread_t *t) {
+#if WITH_SMP
+    if (t->pinned_cpu >= 0)
+        return t->pinned_cpu;
+
+    uint local_cpu = arch_curr_cpu_num();
+    int last_cpu = t->last_cpu;
+    mp_cpu_mask_t candidates = mp.active_cpus & ~mp_get_realtime_mask();
+    mp_cpu_mask_t idle = candidates & mp_get_idle_mask();
+
+    if (idle) {
+        uint cpu = (last_cpu >= 0 && (idle & (1U << last_cpu))) ? (uint)last_cpu : (uint)__builtin_ctz(idle);
+
+        /* mark it busy now so the next wakeup spreads to another idle cpu.
+         * the cpu will correct this when it reschedules. */
+        mp_set_cpu_busy(cpu);
+        return cpu;
+    }
+    if (last_cpu >= 0 && (candidates & (1U << last_cpu)))
+        return last_cpu;
+
+    return local_cpu;
+#else
+    return 0;
+#endif
+}
+
+/* poke the cpu whose run queue we just put a thread on */
+static void wakeup_cpu(uint cpu) {
+    mp_reschedule(1U << cpu, 0);
+}
+
+/*
+ * Make sure a thread that just came off a wait queue has finished switching
+ * out of the cpu it last ran on before it's queued somewhere else. Must not be
+ * called with a run queue lock held.
+ */
+static void wait_for_thread_off_cpu(thread_t *t, uint target_cpu) {
+#if WITH_SMP
+    int last_cpu = t->last_cpu;
+
+    if (last_cpu >= 0 && (uint)last_cpu != target_cpu && (uint)last_cpu != arch_curr_cpu_num()) {
+        spin_lock(&run_queue[last_cpu].lock);
+        spin_unlock(&run_queue[last_cpu].lock);
+    }
+#endif
+}
+
+/* free the structures of detached threads that have exited since the last call */
+static void free_dead_threads(void) {
+    for (;;) {
+        spin_lock_saved_state_t state;
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        spin_lock(&thread_list_lock);
+        thread_t *t = list_remove_head_type(&dead_thread_list, thread_t, thread_list_node);
+        spin_unlock(&thread_list_lock);
+
+        if (t) {
+            /* the thread holds its retcode lock until it has its run queue lock,
+             * and that isn't dropped until it has switched away for good */
+            spin_lock(&t->retcode_wait_queue.lock);
+            spin_unlock(&t->retcode_wait_queue.lock);
+            wait_for_thread_off_cpu(t, arch_curr_cpu_num());
+        }
+
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        if (!t)
+            break;
+
+        kmem_cache_free(&thread_cache, t);
+    }
+}
+
+/*
+ * Put a thread that was blocked or sleeping back on a cpu's run queue and kick
+ * that cpu. The caller holds whatever lock protected the thread's previous
+ * state, but no run queue lock.
+ */
+static void make_thread_ready(thread_t *t, uint cpu) {
+    DEBUG_ASSERT(t->state == THREAD_READY);
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    for (;;) {
+        wait_for_thread_off_cpu(t, cpu);
+
+        spin_lock(&run_queue[cpu].lock);
+
+        /* the thread may have been pinned elsewhere since its cpu was picked */
+        int pinned_cpu = thread_pinned_cpu(t);
+        if (pinned_cpu < 0 || (uint)pinned_cpu == cpu)
+            break;
+
+        spin_unlock(&run_queue[cpu].lock);
+        cpu = pinned_cpu;
+    }
+
+    insert_in_run_queue_head(t, cpu);
+    spin_unlock(&run_queue[cpu].lock);
+
+    wakeup_cpu(cpu);
+}
+
+/*
+ * Queue a thread that was just woken with reschedule set so that it runs on
+ * this cpu ahead of the current thread at the next thread_handoff(). Threads
+ * pinned to another cpu are simply made ready there.
+ */
+static void make_thread_ready_handoff(thread_t *t) {
+    uint cpu = arch_curr_cpu_num();
+
+    wait_for_thread_off_cpu(t, cpu);
+
+    spin_lock(&run_queue[cpu].lock);
+
     int pinned_cpu = thread_pinned_cpu(t);
-    if (pinned_cpu < 0)
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-    else
-        mp_reschedule(1U << pinned_cpu, 0);
+    if (pinned_cpu >= 0 && (uint)pinned_cpu != cpu) {
+        spin_unlock(&run_queue[cpu].lock);
+        make_thread_ready(t, pinned_cpu);
+        return;
+    }
+
+    list_add_tail(&run_queue[cpu].handoff, &t->queue_node);
+    t->run_queue_cpu = cpu;
+    t->run_queue_priority = -1;
+    spin_unlock(&run_queue[cpu].lock);
 }
 
 void init_thread_struct(thread_t *t, const char *name) {
     memset(t, 0, sizeof(thread_t));
     t->magic = THREAD_MAGIC;
+    t->run_queue_cpu = -1;
+    thread_set_last_cpu(t, -1);
     thread_set_pinned_cpu(t, -1);
+    list_initialize(&t->held_mutexes);
     strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -146,7 +336,9 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     unsigned int flags = 0;
 
     if (!t) {
-        t = malloc(sizeof(thread_t));
+        free_dead_threads();
+
+        t = kmem_cache_alloc(&thread_cache);
         if (!t)
             return NULL;
         flags |= THREAD_FLAG_FREE_STRUCT;
@@ -157,6 +349,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     t->entry = entry;
     t->arg = arg;
     t->priority = priority;
+    t->base_priority = priority;
     t->state = THREAD_SUSPENDED;
     t->blocking_wait_queue = NULL;
     t->wait_queue_block_ret = NO_ERROR;
@@ -178,7 +371,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
         t->stack = malloc(stack_size);
         if (!t->stack) {
             if (flags & THREAD_FLAG_FREE_STRUCT)
-                free(t);
+                kmem_cache_free(&thread_cache, t);
             return NULL;
         }
         flags |= THREAD_FLAG_FREE_STACK;
@@ -212,9 +405,10 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     arch_thread_initialize(t);
 
     /* add it to the global thread list */
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&thread_list_lock, state);
     list_add_head(&thread_list, &t->thread_list_node);
-    THREAD_UNLOCK(state);
+    spin_unlock_irqrestore(&thread_list_lock, state);
 
     return t;
 }
@@ -236,7 +430,7 @@ status_t thread_set_real_time(thread_t *t) {
 
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&t->retcode_wait_queue, state);
 #if PLATFORM_HAS_DYNAMIC_TIMER
     if (t == get_current_thread()) {
         /* if we're currently running, cancel the preemption timer. */
@@ -244,7 +438,7 @@ status_t thread_set_real_time(thread_t *t) {
     }
 #endif
     t->flags |= THREAD_FLAG_REAL_TIME;
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&t->retcode_wait_queue, state);
 
     return NO_ERROR;
 }
@@ -277,17 +471,15 @@ status_t thread_resume(thread_t *t) {
 
     bool resched = false;
     bool ints_disabled = arch_ints_disabled();
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&t->retcode_wait_queue, state);
     if (t->state == THREAD_SUSPENDED) {
         t->state = THREAD_READY;
-        insert_in_run_queue_head(t);
+        make_thread_ready(t, select_cpu_for_thread(t));
         if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
             resched = true;
     }
 
-    wakeup_cpu_for_thread(t);
-
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&t->retcode_wait_queue, state);
 
     if (resched)
         thread_yield();
@@ -306,11 +498,11 @@ status_t thread_detach_and_resume(thread_t *t) {
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&t->retcode_wait_queue, state);
 
     if (t->flags & THREAD_FLAG_DETACHED) {
         /* the thread is detached, go ahead and exit */
-        THREAD_UNLOCK(state);
+        WAIT_QUEUE_UNLOCK(&t->retcode_wait_queue, state);
         return ERR_THREAD_DETACHED;
     }
 
@@ -318,9 +510,12 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout) {
     if (t->state != THREAD_DEATH) {
         status_t err = wait_queue_block(&t->retcode_wait_queue, timeout);
         if (err < 0) {
-            THREAD_UNLOCK(state);
+            arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
             return err;
         }
+
+        /* only we can free the thread, so its wait queue is still there */
+        spin_lock(&t->retcode_wait_queue.lock);
     }
 
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
@@ -332,20 +527,27 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout) {
     if (retcode)
         *retcode = t->retcode;
 
+    WAIT_QUEUE_UNLOCK(&t->retcode_wait_queue, state);
+
+    /* the dead thread may still be switching out on another cpu, let it finish */
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    wait_for_thread_off_cpu(t, arch_curr_cpu_num());
+
     /* remove it from the master thread list */
+    spin_lock(&thread_list_lock);
     list_delete(&t->thread_list_node);
+    spin_unlock(&thread_list_lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 
     /* clear the structure's magic */
     t->magic = 0;
 
-    THREAD_UNLOCK(state);
-
     /* free its stack and the thread structure itself */
     if (t->flags & THREAD_FLAG_FREE_STACK && t->stack)
         free(t->stack);
 
     if (t->flags & THREAD_FLAG_FREE_STRUCT)
-        free(t);
+        kmem_cache_free(&thread_cache, t);
 
     return NO_ERROR;
 }
@@ -353,7 +555,7 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout) {
 status_t thread_detach(thread_t *t) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&t->retcode_wait_queue, state);
 
     /* if another thread is blocked inside thread_join() on this thread,
      * wake them up with a specific return code */
@@ -362,11 +564,11 @@ status_t thread_detach(thread_t *t) {
     /* if it's already dead, then just do what join would have and exit */
     if (t->state == THREAD_DEATH) {
         t->flags &= ~THREAD_FLAG_DETACHED; /* makes sure thread_join continues */
-        THREAD_UNLOCK(state);
+        WAIT_QUEUE_UNLOCK(&t->retcode_wait_queue, state);
         return thread_join(t, NULL, 0);
     } else {
         t->flags |= THREAD_FLAG_DETACHED;
-        THREAD_UNLOCK(state);
+        WAIT_QUEUE_UNLOCK(&t->retcode_wait_queue, state);
         return NO_ERROR;
     }
 }
@@ -387,7 +589,7 @@ void thread_exit(int retcode) {
 
 //  dprintf("thread_exit: current %p\n", current_thread);
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&current_thread->retcode_wait_queue, state);
 
     /* enter the dead state */
     current_thread->state = THREAD_DEATH;
@@ -395,8 +597,13 @@ void thread_exit(int retcode) {
 
     /* if we're detached, then do our teardown here */
     if (current_thread->flags & THREAD_FLAG_DETACHED) {
-        /* remove it from the master thread list */
+        /* remove it from the master thread list, the structure is freed later
+         * by whoever next creates a thread, once we're off the cpu */
+        spin_lock(&thread_list_lock);
         list_delete(&current_thread->thread_list_node);
+        if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
+            list_add_tail(&dead_thread_list, &current_thread->thread_list_node);
+        spin_unlock(&thread_list_lock);
 
         /* clear the structure's magic */
         current_thread->magic = 0;
@@ -408,14 +615,15 @@ void thread_exit(int retcode) {
             /* make sure its not going to get a bounds check performed on the half-freed stack */
             current_thread->flags &= ~THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
         }
-
-        if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
-            heap_delayed_free(current_thread);
     } else {
         /* signal if anyone is waiting */
         wait_queue_wake_all(&current_thread->retcode_wait_queue, false, 0);
     }
 
+    /* switch to the run queue lock, a joiner may free us once the queue lock is dropped */
+    spin_lock(thread_curr_cpu_lock());
+    spin_unlock(&current_thread->retcode_wait_queue.lock);
+
     /* reschedule */
     thread_resched();
 
@@ -427,30 +635,75 @@ static void idle_thread_routine(void) {
         arch_idle();
 }
 
-static thread_t *get_top_thread(int cpu) {
-    thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
+#if WITH_SMP
+/*
+ * Called when a cpu's own run queue is empty. Find the sibling with the most
+ * ready threads and take the highest priority one that isn't pinned. Threads
+ * are taken from the tail of the queue, since they're the least likely to
+ * have warm cache state on the victim cpu.
+ */
+static thread_t *steal_thread(uint cpu) {
+    uint busiest = cpu;
+    uint busiest_count = 0;
 
-    while (local_run_queue_bitmap) {
-        /* find the first (remaining) queue with a thread in it */
-        uint next_queue = sizeof(run_queue_bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i != cpu && run_queue[i].count > busiest_count) {
+            busiest = i;
+            busiest_count = run_queue[i].count;
+        }
+    }
+    if (busiest_count == 0)
+        return NULL;
+
+    /* don't wait on a busy sibling, we'll get another chance on the next pass */
+    struct run_queue *rq = &run_queue[busiest];
+    if (spin_trylock(&rq->lock))
+        return NULL;
+
+    uint32_t local_bitmap = rq->bitmap;
+    while (local_bitmap) {
+        uint next_queue = sizeof(local_bitmap) * 8 - 1 - __builtin_clz(local_bitmap);
+
+        thread_t *t = list_peek_tail_type(&rq->list[next_queue], thread_t, queue_node);
+        while (t) {
+            if (t->pinned_cpu < 0) {
+                remove_from_run_queue(t, busiest);
+                spin_unlock(&rq->lock);
+                THREAD_STATS_INC(steals);
+                return t;
+            }
+            t = list_prev_type(&rq->list[next_queue], &t->queue_node, thread_t, queue_node);
+        }
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
-#if WITH_SMP
-            if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
+        local_bitmap &= ~(1<<next_queue);
+    }
+
+    spin_unlock(&rq->lock);
+    return NULL;
+}
 #endif
-            {
-                list_delete(&newthread->queue_node);
 
-                if (list_is_empty(&run_queue[next_queue]))
-                    run_queue_bitmap &= ~(1<<next_queue);
+static thread_t *get_top_thread(uint cpu) {
+    struct run_queue *rq = &run_queue[cpu];
 
-                return newthread;
-            }
-        }
+    if (likely(rq->bitmap)) {
+        /* find the first queue with a thread in it */
+        uint next_queue = sizeof(rq->bitmap) * 8 - 1 - __builtin_clz(rq->bitmap);
 
-        local_run_queue_bitmap &= ~(1<<next_queue);
+        thread_t *newthread = list_peek_head_type(&rq->list[next_queue], thread_t, queue_node);
+        DEBUG_ASSERT(thread_pinned_cpu(newthread) < 0 || thread_pinned_cpu(newthread) == (int)cpu);
+        remove_from_run_queue(newthread, cpu);
+
+        return newthread;
     }
+
+#if WITH_SMP
+    /* nothing local to run, try to pull work from a sibling before going idle */
+    thread_t *stolen = steal_thread(cpu);
+    if (stolen)
+        return stolen;
+#endif
+
     /* no threads to run, select the idle thread for this cpu */
     return idle_thread(cpu);
 }
@@ -473,11 +726,18 @@ void thread_resched(void) {
     uint cpu = arch_curr_cpu_num();
 
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&run_queue[cpu].lock));
     DEBUG_ASSERT(current_thread->state != THREAD_RUNNING);
 
     THREAD_STATS_INC(reschedules);
 
+    /* threads handed to us by a rescheduling wake go ahead of everything else at their priority */
+    thread_t *t;
+    while ((t = list_remove_tail_type(&run_queue[cpu].handoff, thread_t, queue_node))) {
+        t->run_queue_cpu = -1;
+        insert_in_run_queue_head(t, cpu);
+    }
+
     newthread = get_top_thread(cpu);
 
     DEBUG_ASSERT(newthread);
@@ -497,6 +757,7 @@ void thread_resched(void) {
     /* mark the cpu ownership of the threads */
     thread_set_curr_cpu(oldthread, -1);
     thread_set_curr_cpu(newthread, cpu);
+    thread_set_last_cpu(newthread, cpu);
 
 #if WITH_SMP
     if (thread_is_idle(newthread)) {
@@ -553,6 +814,9 @@ void thread_resched(void) {
 
     /* do the switch */
     set_current_thread(newthread);
+#if WITH_SMP
+    cpu_running_thread[cpu] = newthread;
+#endif
 
 #if DEBUG_THREAD_CONTEXT_SWITCH
     dprintf(ALWAYS, "arch_context_switch: cpu %d, old %p (%s, pri %d, flags 0x%x), new %p (%s, pri %d, flags 0x%x)\n",
@@ -593,6 +857,28 @@ void thread_resched(void) {
     arch_context_switch(oldthread, newthread);
 }
 
+/* true if the current thread has been pinned to a cpu other than the one it's on */
+static bool thread_pinned_away(thread_t *t) {
+    int pinned_cpu = thread_pinned_cpu(t);
+
+    return pinned_cpu >= 0 && (uint)pinned_cpu != arch_curr_cpu_num();
+}
+
+/*
+ * Move the current thread to the cpu it was pinned to while it was running.
+ * It can't put itself on another cpu's run queue before it has switched out,
+ * so it sleeps for a tick and lets the sleep timer queue it on the right cpu.
+ * Called with the local run queue lock held, in place of requeuing locally.
+ */
+static void migrate_current_thread_locked(thread_t *current_thread) {
+    timer_t timer;
+
+    timer_initialize(&timer);
+    timer_set_oneshot(&timer, 0, thread_sleep_handler, (void *)current_thread);
+    current_thread->state = THREAD_SLEEPING;
+    thread_resched();
+}
+
 /**
  * @brief Yield the cpu to another thread
  *
@@ -612,11 +898,17 @@ void thread_yield(void) {
 
     THREAD_STATS_INC(yields);
 
+    if (unlikely(thread_pinned_away(current_thread))) {
+        migrate_current_thread_locked(current_thread);
+        THREAD_UNLOCK(state);
+        return;
+    }
+
     /* we are yielding the cpu, so stick ourselves into the tail of the run queue and reschedule */
     current_thread->state = THREAD_READY;
     current_thread->remaining_quantum = 0;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
-        insert_in_run_queue_tail(current_thread);
+        insert_in_run_queue_tail(current_thread, arch_curr_cpu_num());
     }
     thread_resched();
 
@@ -653,13 +945,19 @@ void thread_preempt(void) {
 
     THREAD_LOCK(state);
 
+    if (unlikely(thread_pinned_away(current_thread))) {
+        migrate_current_thread_locked(current_thread);
+        THREAD_UNLOCK(state);
+        return;
+    }
+
     /* we are being preempted, so we get to go back into the front of the run queue if we have quantum left */
     current_thread->state = THREAD_READY;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
         if (current_thread->remaining_quantum > 0)
-            insert_in_run_queue_head(current_thread);
+            insert_in_run_queue_head(current_thread, arch_curr_cpu_num());
         else
-            insert_in_run_queue_tail(current_thread); /* if we're out of quantum, go to the tail of the queue */
+            insert_in_run_queue_tail(current_thread, arch_curr_cpu_num()); /* if we're out of quantum, go to the tail of the queue */
     }
     thread_resched();
 
@@ -681,25 +979,43 @@ void thread_block(void) {
 
     DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
     DEBUG_ASSERT(current_thread->state == THREAD_BLOCKED);
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(thread_lock_held());
     DEBUG_ASSERT(!thread_is_idle(current_thread));
 
     /* we are blocking on something. the blocking code should have already stuck us on a queue */
     thread_resched();
 }
 
-void thread_unblock(thread_t *t, bool resched) {
-    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
-    DEBUG_ASSERT(t->state == THREAD_BLOCKED);
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
-    DEBUG_ASSERT(!thread_is_idle(t));
+/**
+ * @brief  Let threads woken with reschedule set run ahead of the current thread.
+ *
+ * Wait queue wakes with reschedule set park the woken threads on this cpu
+ * instead of switching to them, since the caller is still holding the wait
+ * queue lock. Call this once all locks have been dropped.
+ */
+void thread_handoff(void) {
+    thread_t *current_thread = get_current_thread();
 
-    t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
-    wakeup_cpu_for_thread(t);
+    DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
 
-    if (resched)
+    THREAD_LOCK(state);
+
+    if (unlikely(thread_pinned_away(current_thread))) {
+        /* the parked threads are queued by the reschedule either way */
+        migrate_current_thread_locked(current_thread);
+    } else if (!list_is_empty(&run_queue[arch_curr_cpu_num()].handoff)) {
+        /* stick the current thread on the head of the run queue, so that the newly awakened
+         * threads get a chance to run before the current one, but the current one doesn't
+         * get unnecessarilly punished.
+         */
+        current_thread->state = THREAD_READY;
+        if (likely(!thread_is_idle(current_thread)))
+            insert_in_run_queue_head(current_thread, arch_curr_cpu_num());
         thread_resched();
+    }
+
+    THREAD_UNLOCK(state);
 }
 
 enum handler_return thread_timer_tick(struct timer *t, lk_time_t now, void *arg) {
@@ -723,12 +1039,9 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_SLEEPING);
 
-    THREAD_LOCK(state);
-
+    /* nothing else touches a sleeping thread, so no lock is needed to move it */
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
-
-    THREAD_UNLOCK(state);
+    make_thread_ready(t, select_cpu_for_thread(t));
 
     return INT_RESCHEDULE;
 }
@@ -761,6 +1074,31 @@ void thread_sleep(lk_time_t delay) {
     THREAD_UNLOCK(state);
 }
 
+/**
+ * @brief  Put thread to sleep; delay specified in ns
+ *
+ * Same as thread_sleep(), for delays that need better than millisecond
+ * resolution. On platforms without a high resolution timer the delay is
+ * rounded up to the next millisecond.
+ */
+void thread_sleep_ns(lk_time_ns_t delay) {
+    timer_t timer;
+
+    thread_t *current_thread = get_current_thread();
+
+    DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
+    DEBUG_ASSERT(!thread_is_idle(current_thread));
+
+    timer_initialize(&timer);
+
+    THREAD_LOCK(state);
+    timer_set_oneshot_ns(&timer, delay, thread_sleep_handler, (void *)current_thread);
+    current_thread->state = THREAD_SLEEPING;
+    thread_resched();
+    THREAD_UNLOCK(state);
+}
+
 /**
  * @brief  Initialize threading system
  *
@@ -772,8 +1110,12 @@ void thread_init_early(void) {
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
     /* initialize the run queues */
-    for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        spin_lock_init(&run_queue[cpu].lock);
+        for (i=0; i < NUM_PRIORITIES; i++)
+            list_initialize(&run_queue[cpu].list[i]);
+        list_initialize(&run_queue[cpu].handoff);
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
@@ -784,13 +1126,18 @@ void thread_init_early(void) {
 
     /* half construct this thread, since we're already running */
     t->priority = HIGHEST_PRIORITY;
+    t->base_priority = HIGHEST_PRIORITY;
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED;
     thread_set_curr_cpu(t, 0);
+    thread_set_last_cpu(t, 0);
     thread_set_pinned_cpu(t, 0);
     wait_queue_init(&t->retcode_wait_queue);
     list_add_head(&thread_list, &t->thread_list_node);
     set_current_thread(t);
+#if WITH_SMP
+    cpu_running_thread[0] = t;
+#endif
 }
 
 /**
@@ -828,15 +1175,137 @@ void thread_set_priority(int priority) {
         priority = IDLE_PRIORITY + 1;
     if (priority > HIGHEST_PRIORITY)
         priority = HIGHEST_PRIORITY;
-    current_thread->priority = priority;
+
+    /* keep any boost inherited from a mutex waiter until the mutex is released */
+    bool boosted = current_thread->priority > current_thread->base_priority;
+    current_thread->base_priority = priority;
+    if (!boosted || priority > current_thread->priority)
+        current_thread->priority = priority;
 
     current_thread->state = THREAD_READY;
-    insert_in_run_queue_head(current_thread);
+    insert_in_run_queue_head(current_thread, arch_curr_cpu_num());
     thread_resched();
 
     THREAD_UNLOCK(state);
 }
 
+/**
+ * @brief Change the priority a thread is scheduled at, without touching its base priority
+ *
+ * Used by the mutex code to lend a waiter's priority to the mutex holder and to
+ * take it back again. A thread sitting in a run queue is requeued at the new
+ * priority and its cpu is poked to reconsider what it is running. Must be called
+ * with interrupts disabled and no run queue lock held.
+ */
+void thread_set_effective_priority(thread_t *t, int priority) {
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(priority >= LOWEST_PRIORITY && priority <= HIGHEST_PRIORITY);
+
+    if (t->priority == priority)
+        return;
+
+    t->priority = priority;
+
+    /* a thread can move between run queues while we look for it, so recheck
+     * where it is once we hold the lock we think protects it */
+    for (;;) {
+        int cpu = ((volatile thread_t *)t)->run_queue_cpu;
+        if (cpu < 0)
+            return;
+
+        spin_lock(&run_queue[cpu].lock);
+        if (t->run_queue_cpu != cpu) {
+            spin_unlock(&run_queue[cpu].lock);
+            continue;
+        }
+
+        /* threads parked for handoff pick up the new priority when they're queued */
+        if (t->run_queue_priority >= 0 && t->run_queue_priority != priority) {
+            remove_from_run_queue(t, cpu);
+            insert_in_run_queue_head(t, cpu);
+        }
+        spin_unlock(&run_queue[cpu].lock);
+
+        wakeup_cpu(cpu);
+        return;
+    }
+}
+
+#if WITH_SMP
+/**
+ * @brief Pin a thread to a cpu, or unpin it by passing -1
+ *
+ * A thread waiting in another cpu's run queue is moved to its new cpu right
+ * away, and one running on another cpu moves the next time it's preempted or
+ * blocks. If the current thread is pinned away from its cpu it has moved by
+ * the time this returns. Must be called with no run queue lock held.
+ */
+void thread_set_pinned_cpu(thread_t *t, int cpu) {
+    DEBUG_ASSERT(t->magic == THREAD_MAGIC);
+    DEBUG_ASSERT(cpu >= -1 && cpu < SMP_MAX_CPUS);
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* every path that queues a thread checks its pin under the lock of the run
+     * queue it's queuing onto, so holding all of them makes the change atomic.
+     * nothing else nests run queue locks, and pinning is rare. */
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        spin_lock(&run_queue[i].lock);
+
+    t->pinned_cpu = cpu;
+
+    int rq_cpu = t->run_queue_cpu;
+    bool requeued = false;
+    if (cpu >= 0 && rq_cpu >= 0 && rq_cpu != cpu) {
+        if (t->run_queue_priority >= 0) {
+            remove_from_run_queue(t, rq_cpu);
+        } else {
+            /* parked for handoff, not counted in the run queue */
+            list_delete(&t->queue_node);
+            t->run_queue_cpu = -1;
+        }
+        insert_in_run_queue_head(t, cpu);
+        requeued = true;
+    }
+    int curr_cpu = t->curr_cpu;
+
+    for (int i = SMP_MAX_CPUS - 1; i >= 0; i--)
+        spin_unlock(&run_queue[i].lock);
+
+    bool migrate = false;
+    if (requeued)
+        wakeup_cpu(cpu);
+    if (cpu >= 0 && curr_cpu >= 0 && curr_cpu != cpu) {
+        if (t == get_current_thread())
+            migrate = true;
+        else
+            wakeup_cpu(curr_cpu);
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (migrate)
+        thread_yield();
+}
+#endif
+
+#if WITH_SMP
+/**
+ * @brief Check whether a thread is running on a cpu right now
+ *
+ * Only compares pointers, so it's safe to ask about a thread that may have
+ * exited and been freed in the meantime. The answer may be stale by the time
+ * the caller looks at it.
+ */
+bool thread_running_on_cpu(const thread_t *t, uint cpu) {
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+
+    return cpu_running_thread[cpu] == t;
+}
+#endif
+
 /**
  * @brief  Become an idle thread
  *
@@ -859,6 +1328,7 @@ void thread_become_idle(void) {
 
     /* mark ourself as idle */
     t->priority = IDLE_PRIORITY;
+    t->base_priority = IDLE_PRIORITY;
     t->flags |= THREAD_FLAG_IDLE;
     thread_set_pinned_cpu(t, arch_curr_cpu_num());
 
@@ -888,24 +1358,29 @@ void thread_secondary_cpu_init_early(void) {
 
     /* half construct this thread, since we're already running */
     t->priority = HIGHEST_PRIORITY;
+    t->base_priority = HIGHEST_PRIORITY;
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED | THREAD_FLAG_IDLE;
     thread_set_curr_cpu(t, cpu);
+    thread_set_last_cpu(t, cpu);
     thread_set_pinned_cpu(t, cpu);
     wait_queue_init(&t->retcode_wait_queue);
 
-    THREAD_LOCK(state);
-
+    spin_lock(&thread_list_lock);
     list_add_head(&thread_list, &t->thread_list_node);
-    set_current_thread(t);
+    spin_unlock(&thread_list_lock);
 
-    THREAD_UNLOCK(state);
+    set_current_thread(t);
+#if WITH_SMP
+    cpu_running_thread[cpu] = t;
+#endif
 }
 
 void thread_secondary_cpu_entry(void) {
     uint cpu = arch_curr_cpu_num();
     thread_t *t = get_current_thread();
     t->priority = IDLE_PRIORITY;
+    t->base_priority = IDLE_PRIORITY;
 
     mp_set_curr_cpu_active(true);
     mp_set_cpu_idle(cpu);
@@ -994,7 +1469,8 @@ void dump_thread(thread_t *t) {
 void dump_all_threads(void) {
     thread_t *t;
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&thread_list_lock, state);
     list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
         if (t->magic != THREAD_MAGIC) {
             dprintf(INFO, "bad magic on thread struct %p, aborting.\n", t);
@@ -1003,7 +1479,7 @@ void dump_all_threads(void) {
         }
         dump_thread(t);
     }
-    THREAD_UNLOCK(state);
+    spin_unlock_irqrestore(&thread_list_lock, state);
 }
 
 /** @} */
@@ -1013,6 +1489,14 @@ void dump_all_threads(void) {
  * @defgroup  wait  Wait Queue
  * @{
  */
+/*
+ * Held by the timeout handler from reading a thread's blocking_wait_queue until
+ * it has that queue's lock, so that wait_queue_destroy() can wait out a handler
+ * that found the queue just before it was torn down. Since wait_queue_destroy()
+ * takes this with the queue's lock held, the handler may only trylock queues.
+ */
+static spin_lock_t wait_timeout_lock = SPIN_LOCK_INITIAL_VALUE;
+
 void wait_queue_init(wait_queue_t *wait) {
     *wait = (wait_queue_t)WAIT_QUEUE_INITIAL_VALUE(*wait);
 }
@@ -1022,14 +1506,32 @@ static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t
 
     DEBUG_ASSERT(thread->magic == THREAD_MAGIC);
 
-    spin_lock(&thread_lock);
-
+    /* the thread may be woken and block somewhere else while we chase its wait queue */
     enum handler_return ret = INT_NO_RESCHEDULE;
-    if (thread_unblock_from_wait_queue(thread, ERR_TIMED_OUT) >= NO_ERROR) {
-        ret = INT_RESCHEDULE;
-    }
+    for (;;) {
+        spin_lock(&wait_timeout_lock);
 
-    spin_unlock(&thread_lock);
+        wait_queue_t *wait = thread->blocking_wait_queue;
+        if (!wait) {
+            spin_unlock(&wait_timeout_lock);
+            break;
+        }
+
+        if (spin_trylock(&wait->lock)) {
+            spin_unlock(&wait_timeout_lock);
+            continue;
+        }
+        spin_unlock(&wait_timeout_lock);
+
+        /* the queue can't be destroyed while we hold its lock */
+        if (thread->blocking_wait_queue == wait) {
+            if (thread_unblock_from_wait_queue(thread, ERR_TIMED_OUT) >= NO_ERROR) {
+                ret = INT_RESCHEDULE;
+            }
+        }
+        spin_unlock(&wait->lock);
+        break;
+    }
 
     return ret;
 }
@@ -1049,6 +1551,11 @@ static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t
  * waits indefinitely.  Otherwise, this function returns with
  * ERR_TIMED_OUT at the end of the timeout period.
  *
+ * The wait queue's lock must be held on entry and is released on return, even
+ * if the call returns immediately. Once woken the queue may already have been
+ * destroyed and freed, so callers must only retake the lock while they know
+ * the object containing it is still alive.
+ *
  * @return ERR_TIMED_OUT on timeout, else returns the return
  * value specified when the queue was woken by wait_queue_wake_one().
  */
@@ -1060,10 +1567,12 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout) {
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
-    if (timeout == 0)
+    if (timeout == 0) {
+        spin_unlock(&wait->lock);
         return ERR_TIMED_OUT;
+    }
 
     list_add_tail(&wait->list, &current_thread->queue_node);
     wait->count++;
@@ -1077,16 +1586,42 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout) {
         timer_set_oneshot(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
     }
 
+    /* hold our run queue lock across the switch so a waker can't queue us while we're still running */
+    spin_lock(thread_curr_cpu_lock());
+    spin_unlock(&wait->lock);
+
     thread_resched();
 
+    /* we may have woken up on a different cpu */
+    spin_unlock(thread_curr_cpu_lock());
+
     /* we don't really know if the timer fired or not, so it's better safe to try to cancel it */
     if (timeout != INFINITE_TIME) {
         timer_cancel(&timer);
     }
 
+    /* don't touch the wait queue again, whoever woke us may have freed it */
     return current_thread->wait_queue_block_ret;
 }
 
+static void wake_waiter(wait_queue_t *wait, thread_t *t, bool reschedule, status_t wait_queue_error) {
+    list_delete(&t->queue_node);
+    wait->count--;
+    DEBUG_ASSERT(t->state == THREAD_BLOCKED);
+    t->state = THREAD_READY;
+    t->wait_queue_block_ret = wait_queue_error;
+    t->blocking_wait_queue = NULL;
+
+    /* if we're instructed to reschedule, keep the woken thread local so it runs
+     * next, once the caller gets to thread_handoff().
+     */
+    if (reschedule) {
+        make_thread_ready_handoff(t);
+    } else {
+        make_thread_ready(t, select_cpu_for_thread(t));
+    }
+}
+
 /**
  * @brief  Wake up one thread sleeping on a wait queue
  *
@@ -1105,40 +1640,47 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
     thread_t *t;
     int ret = 0;
 
-    thread_t *current_thread = get_current_thread();
-
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
-    t = list_remove_head_type(&wait->list, thread_t, queue_node);
+    t = list_peek_head_type(&wait->list, thread_t, queue_node);
     if (t) {
-        wait->count--;
-        DEBUG_ASSERT(t->state == THREAD_BLOCKED);
-        t->state = THREAD_READY;
-        t->wait_queue_block_ret = wait_queue_error;
-        t->blocking_wait_queue = NULL;
-
-        /* if we're instructed to reschedule, stick the current thread on the head
-         * of the run queue first, so that the newly awakened thread gets a chance to run
-         * before the current one, but the current one doesn't get unnecessarilly punished.
-         */
-        if (reschedule) {
-            current_thread->state = THREAD_READY;
-            insert_in_run_queue_head(current_thread);
-        }
-        insert_in_run_queue_head(t);
-        wakeup_cpu_for_thread(t);
-        if (reschedule) {
-            thread_resched();
-        }
+        wake_waiter(wait, t, reschedule, wait_queue_error);
         ret = 1;
-
     }
 
     return ret;
 }
 
+/**
+ * @brief  Wake the highest priority thread sleeping on a wait queue
+ *
+ * Like wait_queue_wake_one(), but picks the waiter with the highest current
+ * priority instead of the one that has waited longest. Waiters of equal
+ * priority are still woken in the order they blocked.
+ *
+ * @return  The thread woken, or NULL if there were no waiters
+ */
+thread_t *wait_queue_wake_highest(wait_queue_t *wait, bool reschedule, status_t wait_queue_error) {
+    thread_t *t;
+    thread_t *best = NULL;
+
+    DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
+    DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
+
+    list_for_every_entry(&wait->list, t, thread_t, queue_node) {
+        if (!best || t->priority > best->priority)
+            best = t;
+    }
+
+    if (best)
+        wake_waiter(wait, best, reschedule, wait_queue_error);
+
+    return best;
+}
+
 
 /**
  * @brief  Wake all threads sleeping on a wait queue
@@ -1157,50 +1699,32 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
 int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue_error) {
     thread_t *t;
     int ret = 0;
-    uint32_t cpu_mask = 0;
-
-    thread_t *current_thread = get_current_thread();
 
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
-    if (reschedule && wait->count > 0) {
-        /* if we're instructed to reschedule, stick the current thread on the head
-         * of the run queue first, so that the newly awakened threads get a chance to run
-         * before the current one, but the current one doesn't get unnecessarilly punished.
-         */
-        current_thread->state = THREAD_READY;
-        insert_in_run_queue_head(current_thread);
-    }
-
-    /* pop all the threads off the wait queue into the run queue */
+    /* pop all the threads off the wait queue into the run queues. if we're instructed
+     * to reschedule, the ones that end up on this cpu run ahead of the current thread
+     * once the caller gets to thread_handoff().
+     */
     while ((t = list_remove_head_type(&wait->list, thread_t, queue_node))) {
         wait->count--;
         DEBUG_ASSERT(t->state == THREAD_BLOCKED);
         t->state = THREAD_READY;
         t->wait_queue_block_ret = wait_queue_error;
         t->blocking_wait_queue = NULL;
-        int pinned_cpu = thread_pinned_cpu(t);
-        if (pinned_cpu < 0) {
-            /* assumes MP_CPU_ALL_BUT_LOCAL is defined as all bits on */
-            cpu_mask = MP_CPU_ALL_BUT_LOCAL;
+        uint cpu = select_cpu_for_thread(t);
+        if (reschedule && cpu == arch_curr_cpu_num()) {
+            make_thread_ready_handoff(t);
         } else {
-            cpu_mask |= (1U << pinned_cpu);
+            make_thread_ready(t, cpu);
         }
-        insert_in_run_queue_head(t);
         ret++;
     }
 
     DEBUG_ASSERT(wait->count == 0);
 
-    if (ret > 0) {
-        mp_reschedule(cpu_mask, 0);
-        if (reschedule) {
-            thread_resched();
-        }
-    }
-
     return ret;
 }
 
@@ -1212,10 +1736,15 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
 void wait_queue_destroy(wait_queue_t *wait, bool reschedule) {
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
     wait_queue_wake_all(wait, reschedule, ERR_OBJECT_DESTROYED);
     wait->magic = 0;
+
+    /* wait out any timeout handler that found one of the waiters on this
+     * queue before we woke it. later ones will find it no longer blocked. */
+    spin_lock(&wait_timeout_lock);
+    spin_unlock(&wait_timeout_lock);
 }
 
 /**
@@ -1233,13 +1762,13 @@ void wait_queue_destroy(wait_queue_t *wait, bool reschedule) {
 status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error) {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
     if (t->state != THREAD_BLOCKED)
         return ERR_NOT_BLOCKED;
 
     DEBUG_ASSERT(t->blocking_wait_queue != NULL);
     DEBUG_ASSERT(t->blocking_wait_queue->magic == WAIT_QUEUE_MAGIC);
+    DEBUG_ASSERT(spin_lock_held(&t->blocking_wait_queue->lock));
     DEBUG_ASSERT(list_in_list(&t->queue_node));
 
     list_delete(&t->queue_node);
@@ -1247,8 +1776,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
     t->blocking_wait_queue = NULL;
     t->state = THREAD_READY;
     t->wait_queue_block_ret = wait_queue_error;
-    insert_in_run_queue_head(t);
-    wakeup_cpu_for_thread(t);
+    make_thread_ready(t, select_cpu_for_thread(t));
 
     return NO_ERROR;
 }
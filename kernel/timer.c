@@ -28,6 +28,7 @@
 #include <lk/debug.h>
 #include <lk/list.h>
 #include <lk/trace.h>
+#include <limits.h>
 #include <platform.h>
 #include <platform/timer.h>
 
@@ -35,13 +36,52 @@
 
 spin_lock_t timer_lock;
 
+/*
+ * Each cpu keeps its pending timers in a hierarchical timing wheel.
+ *
+ * Level 0 has one slot per millisecond for the next TIMER_WHEEL_SLOTS ms,
+ * each level above it covers TIMER_WHEEL_SLOTS times the range of the one
+ * below. A timer is filed in the lowest level whose range covers its
+ * deadline, and slots of the upper levels are cascaded down a level as the
+ * wheel's clock reaches them. Arming and cancelling are O(1), expiring is
+ * O(1) amortized per timer.
+ *
+ * The wheel's clock is the next millisecond that hasn't been processed yet.
+ */
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS  ((sizeof(lk_time_t) * 8 + TIMER_WHEEL_BITS - 1) / TIMER_WHEEL_BITS)
+
+/* wheel_slot of a timer queued on the nanosecond queue instead */
+#define TIMER_SLOT_HR       UINT_MAX
+
 struct timer_state {
-    struct list_node timer_queue;
+    lk_time_t clock;
+    uint count;
+    uint64_t pending[TIMER_WHEEL_LEVELS];
+    struct list_node slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the deadline the hardware one-shot is currently programmed for */
+    bool armed;
+    lk_time_t next_deadline;
+#endif
+
+#if PLATFORM_HAS_HRTIMER
+    /* nanosecond timers, sorted by deadline. there are expected to be few of
+     * these (control loops and the like), everything else goes on the wheel.
+     */
+    struct list_node hr_queue;
+#endif
 } __CPU_ALIGN;
 
 static struct timer_state timers[SMP_MAX_CPUS];
 
 static enum handler_return timer_tick(void *arg, lk_time_t now);
+#if PLATFORM_HAS_HRTIMER
+static enum handler_return hrtimer_tick(void *arg, lk_time_t now);
+#endif
 
 /**
  * @brief  Initialize a timer object
@@ -50,24 +90,157 @@ void timer_initialize(timer_t *timer) {
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
+static inline uint wheel_shift(uint level) {
+    return level * TIMER_WHEEL_BITS;
+}
+
+/* file a timer in the slot covering its deadline, relative to the wheel's clock */
+static void file_timer(uint cpu, timer_t *timer) {
+    struct timer_state *ts = &timers[cpu];
+
+    uint level = 0;
+    uint index;
+    lk_time_t delta = timer->scheduled_time - ts->clock;
+    if ((int32_t)delta < 0) {
+        /* already expired, fire on the next slot processed */
+        index = ts->clock & TIMER_WHEEL_MASK;
+    } else {
+        while (level < TIMER_WHEEL_LEVELS - 1 && (delta >> wheel_shift(level + 1)) != 0)
+            level++;
+        index = (timer->scheduled_time >> wheel_shift(level)) & TIMER_WHEEL_MASK;
+    }
+
+    list_add_tail(&ts->slot[level][index], &timer->node);
+    ts->pending[level] |= (1ULL << index);
+
+    timer->cpu = cpu;
+    timer->wheel_slot = level * TIMER_WHEEL_SLOTS + index;
+}
+
 static void insert_timer_in_queue(uint cpu, timer_t *timer) {
-    timer_t *entry;
+    struct timer_state *ts = &timers[cpu];
 
     DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(spin_lock_held(&timer_lock));
 
     LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
 
-    list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-        if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-            list_add_before(&entry->node, &timer->node);
-            return;
+    /* if nothing is pending the clock may have gone stale, catch it up */
+    if (ts->count == 0)
+        ts->clock = current_time();
+
+    file_timer(cpu, timer);
+    ts->count++;
+}
+
+static void remove_timer_from_queue(timer_t *timer) {
+    struct timer_state *ts = &timers[timer->cpu];
+    uint level = timer->wheel_slot / TIMER_WHEEL_SLOTS;
+    uint index = timer->wheel_slot % TIMER_WHEEL_SLOTS;
+
+    DEBUG_ASSERT(spin_lock_held(&timer_lock));
+
+#if PLATFORM_HAS_HRTIMER
+    if (timer->wheel_slot == TIMER_SLOT_HR) {
+        list_delete(&timer->node);
+        return;
+    }
+#endif
+
+    list_delete(&timer->node);
+    if (list_is_empty(&ts->slot[level][index]))
+        ts->pending[level] &= ~(1ULL << index);
+    ts->count--;
+}
+
+/* move the timers in a slot to a list of the caller's */
+static void take_slot(struct timer_state *ts, uint level, uint index, struct list_node *list) {
+    struct list_node *node;
+
+    while ((node = list_remove_head(&ts->slot[level][index])))
+        list_add_tail(list, node);
+    ts->pending[level] &= ~(1ULL << index);
+}
+
+/* refile the timers of the upper level slots the clock just reached */
+static void cascade(uint cpu) {
+    struct timer_state *ts = &timers[cpu];
+
+    for (uint level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        uint index = (ts->clock >> wheel_shift(level)) & TIMER_WHEEL_MASK;
+
+        if (ts->pending[level] & (1ULL << index)) {
+            struct list_node list = LIST_INITIAL_VALUE(list);
+            timer_t *timer;
+
+            take_slot(ts, level, index, &list);
+            while ((timer = list_remove_head_type(&list, timer_t, node)))
+                file_timer(cpu, timer);
+        }
+
+        /* the next level up only turns over when this one wraps */
+        if (index != 0)
+            break;
+    }
+}
+
+/*
+ * Return the earliest time the wheel has work to do: the first occupied slot
+ * of level 0, or the first cascade of an occupied upper level slot. A
+ * cascade is never later than the deadlines of the timers it refiles.
+ */
+static bool next_wheel_event(uint cpu, lk_time_t *when) {
+    struct timer_state *ts = &timers[cpu];
+    bool found = false;
+
+    for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t pending = ts->pending[level];
+        if (!pending)
+            continue;
+
+        uint shift = wheel_shift(level);
+        lk_time_t low_mask = (level == 0) ? 0 : ((lk_time_t)1 << shift) - 1;
+        uint cur = (ts->clock >> shift) & TIMER_WHEEL_MASK;
+
+        /* a slot equal to the current one is a full turn away unless we're right at its start */
+        uint off = (ts->clock & low_mask) ? 1 : 0;
+        uint start = (cur + off) & TIMER_WHEEL_MASK;
+        uint64_t rotated = start ? ((pending >> start) | (pending << (TIMER_WHEEL_SLOTS - start))) : pending;
+        uint64_t slots_ahead = __builtin_ctzll(rotated) + off;
+
+        lk_time_t t = (lk_time_t)((ts->clock & ~low_mask) + (slots_ahead << shift));
+        if (!found || TIME_LT(t, *when)) {
+            *when = t;
+            found = true;
         }
     }
 
-    /* walked off the end of the list */
-    list_add_tail(&timers[cpu].timer_queue, &timer->node);
+    return found;
 }
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* program the hardware for the next wheel event if it's earlier than what's set */
+static void update_oneshot(uint cpu, lk_time_t now, bool force) {
+    struct timer_state *ts = &timers[cpu];
+    lk_time_t when;
+
+    if (!next_wheel_event(cpu, &when)) {
+        ts->armed = false;
+        return;
+    }
+
+    if (!force && ts->armed && !TIME_LT(when, ts->next_deadline))
+        return;
+
+    lk_time_t delay = TIME_LT(when, now) ? 0 : when - now;
+
+    LTRACEF("setting new timer for %u msecs\n", (uint)delay);
+    ts->armed = true;
+    ts->next_deadline = when;
+    platform_set_oneshot_timer(timer_tick, NULL, delay);
+}
+#endif
+
 static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg) {
     lk_time_t now;
 
@@ -94,11 +267,7 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
     insert_timer_in_queue(cpu, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
-        /* we just modified the head of the timer queue */
-        LTRACEF("setting new timer for %u msecs\n", delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    update_oneshot(cpu, now, false);
 #endif
 
     spin_unlock_irqrestore(&timer_lock, state);
@@ -144,23 +313,113 @@ void timer_set_periodic(timer_t *timer, lk_time_t period, timer_callback callbac
     timer_set(timer, period, period, callback, arg);
 }
 
-/**
- * @brief  Cancel a pending timer
- */
-void timer_cancel(timer_t *timer) {
+#if PLATFORM_HAS_HRTIMER
+static void insert_hrtimer_in_queue(uint cpu, timer_t *timer) {
+    timer_t *entry;
+
+    DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(spin_lock_held(&timer_lock));
+
+    timer->cpu = cpu;
+    timer->wheel_slot = TIMER_SLOT_HR;
+
+    list_for_every_entry(&timers[cpu].hr_queue, entry, timer_t, node) {
+        if (entry->scheduled_time_ns > timer->scheduled_time_ns) {
+            list_add_before(&entry->node, &timer->node);
+            return;
+        }
+    }
+
+    /* walked off the end of the list */
+    list_add_tail(&timers[cpu].hr_queue, &timer->node);
+}
+
+static void timer_set_ns(timer_t *timer, lk_time_ns_t delay, lk_time_ns_t period, timer_callback callback, void *arg) {
+    LTRACEF("timer %p, delay %llu, period %llu, callback %p, arg %p\n", timer, delay, period, callback, arg);
+
     DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
+    if (list_in_list(&timer->node)) {
+        panic("timer %p already in list\n", timer);
+    }
+
+    timer->scheduled_time_ns = current_time_ns() + delay;
+    timer->periodic_time_ns = period;
+    timer->periodic_time = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&timer_lock, state);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
     uint cpu = arch_curr_cpu_num();
+    insert_hrtimer_in_queue(cpu, timer);
+
+    if (list_peek_head_type(&timers[cpu].hr_queue, timer_t, node) == timer) {
+        /* we just modified the head of the queue */
+        platform_set_oneshot_timer_ns(hrtimer_tick, NULL, timer->scheduled_time_ns);
+    }
+
+    spin_unlock_irqrestore(&timer_lock, state);
+}
+#else
+/* no finer timer to use, round up to the millisecond wheel */
+static lk_time_t ns_to_timer_delay(lk_time_ns_t ns) {
+    lk_time_ns_t ms = (ns + 999999) / 1000000;
+
+    return (ms >= INFINITE_TIME) ? INFINITE_TIME - 1 : (lk_time_t)ms;
+}
+#endif
+
+/**
+ * @brief  Set up a timer that executes once, with nanosecond resolution
+ *
+ * @param  timer The timer to use
+ * @param  delay The delay, in ns, before the timer is executed
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_oneshot_ns(timer_t *timer, lk_time_ns_t delay, timer_callback callback, void *arg) {
+#if PLATFORM_HAS_HRTIMER
+    timer_set_ns(timer, delay, 0, callback, arg);
+#else
+    timer_set_oneshot(timer, ns_to_timer_delay(delay), callback, arg);
+#endif
+}
 
-    timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
+/**
+ * @brief  Set up a timer that executes repeatedly, with nanosecond resolution
+ *
+ * Each expiration is scheduled one period after the previous deadline rather
+ * than after the callback ran, so the timer doesn't drift. Periods that were
+ * missed entirely are skipped.
+ *
+ * @param  timer The timer to use
+ * @param  period The delay, in ns, between timer executions
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_periodic_ns(timer_t *timer, lk_time_ns_t period, timer_callback callback, void *arg) {
+    if (period == 0)
+        period = 1;
+#if PLATFORM_HAS_HRTIMER
+    timer_set_ns(timer, period, period, callback, arg);
+#else
+    timer_set_periodic(timer, ns_to_timer_delay(period), callback, arg);
 #endif
+}
+
+/**
+ * @brief  Cancel a pending timer
+ */
+void timer_cancel(timer_t *timer) {
+    DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&timer_lock, state);
 
     if (list_in_list(&timer->node))
-        list_delete(&timer->node);
+        remove_timer_from_queue(timer);
 
     /* to keep it from being reinserted into the queue if called from
      * periodic timer callback.
@@ -169,23 +428,28 @@ void timer_cancel(timer_t *timer) {
     timer->callback = NULL;
     timer->arg = NULL;
 
+#if PLATFORM_HAS_HRTIMER
+    timer->periodic_time_ns = 0;
+
+    if (timer->wheel_slot == TIMER_SLOT_HR) {
+        uint cpu = timer->cpu;
+        if (cpu == arch_curr_cpu_num() && list_is_empty(&timers[cpu].hr_queue))
+            platform_stop_timer_ns();
+
+        spin_unlock_irqrestore(&timer_lock, state);
+        return;
+    }
+#endif
+
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    /* see if we've just modified the head of the timer queue */
-    timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (newhead == NULL) {
+    /* if that was the last timer on its cpu, and it's ours, stop the hardware.
+     * otherwise an early tick simply finds nothing to do and reprograms.
+     */
+    uint cpu = timer->cpu;
+    if (cpu == arch_curr_cpu_num() && timers[cpu].count == 0 && timers[cpu].armed) {
         LTRACEF("clearing old hw timer, nothing in the queue\n");
+        timers[cpu].armed = false;
         platform_stop_timer();
-    } else if (newhead != oldhead) {
-        lk_time_t delay;
-        lk_time_t now = current_time();
-
-        if (TIME_LT(newhead->scheduled_time, now))
-            delay = 0;
-        else
-            delay = newhead->scheduled_time - now;
-
-        LTRACEF("setting new timer to %u\n", (uint) delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
     }
 #endif
 
@@ -203,64 +467,75 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
 //  KEVLOG_TIMER_TICK(); // enable only if necessary
 
     uint cpu = arch_curr_cpu_num();
+    struct timer_state *ts = &timers[cpu];
 
     LTRACEF("cpu %u now %u, sp %p\n", cpu, now, __GET_FRAME());
 
     spin_lock(&timer_lock);
 
-    for (;;) {
-        /* see if there's an event to process */
-        timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-        if (likely(timer == 0))
-            break;
-        LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-        if (likely(TIME_LT(now, timer->scheduled_time)))
-            break;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the one-shot has fired */
+    ts->armed = false;
+#endif
 
-        /* process it */
-        LTRACEF("timer %p\n", timer);
-        DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-        list_delete(&timer->node);
+    while (ts->count > 0 && !TIME_GT(ts->clock, now)) {
+        uint index = ts->clock & TIMER_WHEEL_MASK;
 
-        /* we pulled it off the list, release the list lock to handle it */
-        spin_unlock(&timer_lock);
+        /* turning over level 0, pull down whatever is due from above */
+        if (index == 0)
+            cascade(cpu);
 
-        LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
+        /* detach the slot, anything the callbacks queue for right now lands in the next one */
+        struct list_node expired = LIST_INITIAL_VALUE(expired);
+        take_slot(ts, 0, index, &expired);
+        ts->clock++;
 
-        THREAD_STATS_INC(timers);
+        while ((timer = list_peek_head_type(&expired, timer_t, node))) {
+            /* process it */
+            LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
+            DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
+            list_delete(&timer->node);
+            ts->count--;
 
-        bool periodic = timer->periodic_time > 0;
+            /* we pulled it off the list, release the list lock to handle it */
+            spin_unlock(&timer_lock);
 
-        LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
-        KEVLOG_TIMER_CALL(timer->callback, timer->arg);
-        if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
-            ret = INT_RESCHEDULE;
+            LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
 
-        /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
-        spin_lock(&timer_lock);
+            THREAD_STATS_INC(timers);
 
-        /* if it was a periodic timer and it hasn't been requeued
-         * by the callback put it back in the list
-         */
-        if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
-            LTRACEF("periodic timer, period %u\n", timer->periodic_time);
-            timer->scheduled_time = now + timer->periodic_time;
-            insert_timer_in_queue(cpu, timer);
+            bool periodic = timer->periodic_time > 0;
+
+            LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
+            KEVLOG_TIMER_CALL(timer->callback, timer->arg);
+            if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
+                ret = INT_RESCHEDULE;
+
+            /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
+            spin_lock(&timer_lock);
+
+            /* if it was a periodic timer and it hasn't been requeued
+             * by the callback put it back in the list
+             */
+            if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
+                LTRACEF("periodic timer, period %u\n", timer->periodic_time);
+                timer->scheduled_time = now + timer->periodic_time;
+                insert_timer_in_queue(cpu, timer);
+            }
+        }
+
+        /* skip ahead to the next occupied slot or level 0 turnover, whichever is first */
+        index = ts->clock & TIMER_WHEEL_MASK;
+        if (index != 0) {
+            uint64_t ahead = ts->pending[0] >> index;
+            lk_time_t next = ahead ? ts->clock + __builtin_ctzll(ahead) : (ts->clock | TIMER_WHEEL_MASK) + 1;
+            ts->clock = TIME_GT(next, now) ? now + 1 : next;
         }
     }
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     /* reset the timer to the next event */
-    timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (timer) {
-        /* has to be the case or it would have fired already */
-        DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
-
-        lk_time_t delay = timer->scheduled_time - now;
-
-        LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    update_oneshot(cpu, now, true);
 
     /* we're done manipulating the timer queue */
     spin_unlock(&timer_lock);
@@ -277,10 +552,75 @@ static enum handler_return timer_tick(void *arg, lk_time_t now) {
     return ret;
 }
 
+#if PLATFORM_HAS_HRTIMER
+/* called at interrupt time to process any pending nanosecond timers */
+static enum handler_return hrtimer_tick(void *arg, lk_time_t now) {
+    timer_t *timer;
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    DEBUG_ASSERT(arch_ints_disabled());
+
+    uint cpu = arch_curr_cpu_num();
+    lk_time_ns_t now_ns = current_time_ns();
+
+    LTRACEF("cpu %u now %llu\n", cpu, now_ns);
+
+    spin_lock(&timer_lock);
+
+    for (;;) {
+        timer = list_peek_head_type(&timers[cpu].hr_queue, timer_t, node);
+        if (!timer || timer->scheduled_time_ns > now_ns)
+            break;
+
+        DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
+        list_delete(&timer->node);
+
+        /* we pulled it off the list, release the list lock to handle it */
+        spin_unlock(&timer_lock);
+
+        THREAD_STATS_INC(timers);
+
+        bool periodic = timer->periodic_time_ns > 0;
+
+        KEVLOG_TIMER_CALL(timer->callback, timer->arg);
+        if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
+            ret = INT_RESCHEDULE;
+
+        /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
+        spin_lock(&timer_lock);
+
+        if (periodic && !list_in_list(&timer->node) && timer->periodic_time_ns > 0) {
+            timer->scheduled_time_ns += timer->periodic_time_ns;
+            if (timer->scheduled_time_ns <= now_ns) {
+                /* we've fallen behind by at least a period, skip ahead */
+                lk_time_ns_t missed = (now_ns - timer->scheduled_time_ns) / timer->periodic_time_ns + 1;
+                timer->scheduled_time_ns += missed * timer->periodic_time_ns;
+            }
+            insert_hrtimer_in_queue(cpu, timer);
+        }
+    }
+
+    /* reset the timer to the next event */
+    timer = list_peek_head_type(&timers[cpu].hr_queue, timer_t, node);
+    if (timer)
+        platform_set_oneshot_timer_ns(hrtimer_tick, NULL, timer->scheduled_time_ns);
+
+    spin_unlock(&timer_lock);
+
+    return ret;
+}
+#endif
+
 void timer_init(void) {
     timer_lock = SPIN_LOCK_INITIAL_VALUE;
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        list_initialize(&timers[i].timer_queue);
+        for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            for (uint index = 0; index < TIMER_WHEEL_SLOTS; index++)
+                list_initialize(&timers[i].slot[level][index]);
+        }
+#if PLATFORM_HAS_HRTIMER
+        list_initialize(&timers[i].hr_queue);
+#endif
     }
 #if !PLATFORM_HAS_DYNAMIC_TIMER
     /* register for a periodic timer tick */
@@ -7,8 +7,10 @@
  */
 #include <kernel/vm.h>
 
+#include <arch/ops.h>
 #include <assert.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <lk/console_cmd.h>
 #include <lk/err.h>
 #include <lk/list.h>
@@ -24,6 +26,36 @@
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
 static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 
+/*
+ * Per cpu magazines of free pages in front of the arenas. Single page
+ * allocations and frees only touch the current cpu's magazine with interrupts
+ * disabled, and go to the arenas a batch at a time when it runs empty or full.
+ * Pages sitting in a magazine are allocated as far as the arenas are concerned.
+ * Each magazine has its own lock, which only another cpu draining it contends.
+ */
+#ifndef PMM_PCP_SIZE
+#define PMM_PCP_SIZE 32
+#endif
+#ifndef PMM_PCP_BATCH
+#define PMM_PCP_BATCH (PMM_PCP_SIZE / 2)
+#endif
+
+STATIC_ASSERT(PMM_PCP_BATCH > 0 && PMM_PCP_BATCH <= PMM_PCP_SIZE);
+
+struct pmm_pcp {
+    spin_lock_t lock;
+    uint count;
+    vm_page_t *pages[PMM_PCP_SIZE];
+
+    /* stats */
+    ulong alloc_hits;
+    ulong alloc_misses;
+    ulong free_hits;
+    ulong free_drains;
+} __ALIGNED(CACHE_LINE);
+
+static struct pmm_pcp pcp[SMP_MAX_CPUS];
+
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
      ((uintptr_t)(page) < ((uintptr_t)(arena)->page_array + (arena)->size / PAGE_SIZE * sizeof(vm_page_t))))
@@ -59,6 +91,164 @@ vm_page_t *paddr_to_vm_page(paddr_t addr) {
     return NULL;
 }
 
+/*
+ * Pages are handed out by a binary buddy allocator. Each arena keeps a free
+ * list per order, where a free block of order n is 1 << n pages long and
+ * aligned to its own size in physical memory. The head page of a free block
+ * carries VM_PAGE_FLAG_FREE_HEAD and the block order, the remaining pages of
+ * the block are only marked free. Allocations split larger blocks as needed
+ * and frees merge a block with its buddy for as long as the buddy is free.
+ */
+static inline size_t arena_page_count(const pmm_arena_t *a) {
+    return a->size / PAGE_SIZE;
+}
+
+static void free_block_insert(pmm_arena_t *a, size_t index, uint order) {
+    vm_page_t *p = &a->page_array[index];
+
+    DEBUG_ASSERT(order <= PMM_MAX_ORDER);
+    DEBUG_ASSERT(index + (1UL << order) <= arena_page_count(a));
+    DEBUG_ASSERT(!list_in_list(&p->node));
+
+    p->flags |= VM_PAGE_FLAG_FREE_HEAD;
+    p->order = order;
+    list_add_head(&a->free_list[order], &p->node);
+    a->free_blocks[order]++;
+}
+
+static void free_block_remove(pmm_arena_t *a, size_t index) {
+    vm_page_t *p = &a->page_array[index];
+
+    DEBUG_ASSERT(p->flags & VM_PAGE_FLAG_FREE_HEAD);
+
+    list_delete(&p->node);
+    p->flags &= ~VM_PAGE_FLAG_FREE_HEAD;
+    a->free_blocks[p->order]--;
+}
+
+/* index of the buddy of a block, or -1 if the buddy falls outside the arena */
+static ssize_t buddy_index(const pmm_arena_t *a, size_t index, uint order) {
+    paddr_t base_pfn = a->base / PAGE_SIZE;
+    paddr_t pfn = (base_pfn + index) ^ (1UL << order);
+
+    if (pfn < base_pfn || pfn - base_pfn >= arena_page_count(a))
+        return -1;
+
+    return pfn - base_pfn;
+}
+
+/* return a block to the free lists, merging it with its buddies */
+static void buddy_free(pmm_arena_t *a, size_t index, uint order) {
+    while (order < PMM_MAX_ORDER) {
+        ssize_t buddy = buddy_index(a, index, order);
+        if (buddy < 0)
+            break;
+
+        const vm_page_t *b = &a->page_array[buddy];
+        if (!(b->flags & VM_PAGE_FLAG_FREE_HEAD) || b->order != order)
+            break;
+
+        free_block_remove(a, buddy);
+        index = MIN(index, (size_t)buddy);
+        order++;
+    }
+
+    free_block_insert(a, index, order);
+}
+
+/* take a block of exactly the given order off the free lists, splitting a larger one if needed */
+static ssize_t buddy_alloc(pmm_arena_t *a, uint order) {
+    for (uint o = order; o <= PMM_MAX_ORDER; o++) {
+        vm_page_t *p = list_peek_head_type(&a->free_list[o], vm_page_t, node);
+        if (!p)
+            continue;
+
+        size_t index = p - a->page_array;
+        free_block_remove(a, index);
+
+        /* hand the upper halves back until we are down to the requested size */
+        while (o > order) {
+            o--;
+            free_block_insert(a, index + (1UL << o), o);
+        }
+
+        return index;
+    }
+
+    return -1;
+}
+
+/* keep the first count pages of a block just taken off the free lists, free the tail */
+static void buddy_trim(pmm_arena_t *a, size_t index, uint order, size_t count) {
+    while (order > 0) {
+        order--;
+        size_t half = 1UL << order;
+        if (count <= half) {
+            /* the buddy is the half we are keeping, so there is nothing to merge with */
+            free_block_insert(a, index + half, order);
+        } else {
+            index += half;
+            count -= half;
+        }
+    }
+}
+
+/* pull a single free page out of the free block that contains it */
+static bool buddy_claim_page(pmm_arena_t *a, size_t index) {
+    paddr_t base_pfn = a->base / PAGE_SIZE;
+    paddr_t pfn = base_pfn + index;
+
+    /* look for a free block head at each alignment below the page */
+    size_t head = 0;
+    uint order;
+    for (order = 0; order <= PMM_MAX_ORDER; order++) {
+        paddr_t head_pfn = pfn & ~(((paddr_t)1 << order) - 1);
+        if (head_pfn < base_pfn)
+            return false;
+
+        head = head_pfn - base_pfn;
+        const vm_page_t *p = &a->page_array[head];
+        if ((p->flags & VM_PAGE_FLAG_FREE_HEAD) && p->order >= order)
+            break;
+    }
+    if (order > PMM_MAX_ORDER)
+        return false;
+
+    order = a->page_array[head].order;
+    free_block_remove(a, head);
+
+    /* split the block, freeing the halves that do not contain the page */
+    while (order > 0) {
+        order--;
+        size_t half = 1UL << order;
+        if (index >= head + half) {
+            free_block_insert(a, head, order);
+            head += half;
+        } else {
+            free_block_insert(a, head + half, order);
+        }
+    }
+    DEBUG_ASSERT(head == index);
+
+    return true;
+}
+
+/* mark a run of pages taken off the free lists as allocated */
+static void arena_mark_allocated(pmm_arena_t *a, size_t index, size_t count, struct list_node *list) {
+    for (size_t i = index; i < index + count; i++) {
+        vm_page_t *p = &a->page_array[i];
+
+        DEBUG_ASSERT(page_is_free(p));
+        DEBUG_ASSERT(!list_in_list(&p->node));
+
+        p->flags |= VM_PAGE_FLAG_NONFREE;
+        if (list)
+            list_add_tail(list, &p->node);
+    }
+
+    a->free_count -= count;
+}
+
 status_t pmm_add_arena(pmm_arena_t *arena) {
     LTRACEF("arena %p name '%s' base 0x%lx size 0x%zx\n", arena, arena->name, arena->base, arena->size);
 
@@ -82,7 +272,10 @@ done_add:
 
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++) {
+        list_initialize(&arena->free_list[i]);
+        arena->free_blocks[i] = 0;
+    }
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
@@ -91,14 +284,20 @@ done_add:
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
-
-        list_add_tail(&arena->free_list, &p->node);
+    /* carve the arena into the largest naturally aligned blocks that fit */
+    paddr_t base_pfn = arena->base / PAGE_SIZE;
+    size_t index = 0;
+    while (index < page_count) {
+        uint order = PMM_MAX_ORDER;
+        while (order > 0 &&
+                (((base_pfn + index) & ((1UL << order) - 1)) || index + (1UL << order) > page_count)) {
+            order--;
+        }
 
-        arena->free_count++;
+        free_block_insert(arena, index, order);
+        index += 1UL << order;
     }
+    arena->free_count = page_count;
 
     return NO_ERROR;
 }
@@ -119,35 +318,76 @@ size_t pmm_alloc_pages(uint count, struct list_node *list) {
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
-
-            a->free_count--;
-
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            /* take the largest block that does not overshoot, falling back to smaller ones */
+            uint order = MIN(log2_uint(count - allocated), PMM_MAX_ORDER);
+            ssize_t index;
+            for (;;) {
+                index = buddy_alloc(a, order);
+                if (index >= 0 || order == 0)
+                    break;
+                order--;
+            }
+            if (index < 0)
+                break;
 
-            allocated++;
+            arena_mark_allocated(a, index, 1UL << order, list);
+            allocated += 1U << order;
         }
+
+        if (allocated == count)
+            break;
     }
 
-done:
     mutex_release(&lock);
     return allocated;
 }
 
 vm_page_t *pmm_alloc_page(void) {
-    struct list_node list = LIST_INITIAL_VALUE(list);
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcp *c = &pcp[arch_curr_cpu_num()];
+    spin_lock(&c->lock);
+    if (likely(c->count > 0)) {
+        vm_page_t *page = c->pages[--c->count];
+        c->alloc_hits++;
+        spin_unlock(&c->lock);
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+        return page;
+    }
+    c->alloc_misses++;
+    spin_unlock(&c->lock);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 
-    size_t ret = pmm_alloc_pages(1, &list);
-    if (ret == 0) {
+    /* magazine is empty, refill it with a batch from the arenas and keep one */
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    if (pmm_alloc_pages(PMM_PCP_BATCH, &list) == 0) {
         return NULL;
     }
 
-    DEBUG_ASSERT(ret == 1);
+    vm_page_t *page = list_remove_head_type(&list, vm_page_t, node);
+
+    if (!list_is_empty(&list)) {
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
 
-    return list_peek_head_type(&list, vm_page_t, node);
+        /* we may have migrated or raced with a free on this cpu, only fill what fits */
+        c = &pcp[arch_curr_cpu_num()];
+        spin_lock(&c->lock);
+        vm_page_t *p;
+        while (c->count < PMM_PCP_SIZE && (p = list_remove_head_type(&list, vm_page_t, node))) {
+            c->pages[c->count++] = p;
+        }
+        spin_unlock(&c->lock);
+
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        if (!list_is_empty(&list)) {
+            pmm_free(&list);
+        }
+    }
+
+    return page;
 }
 
 size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list) {
@@ -177,13 +417,12 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list) {
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
+            if (!buddy_claim_page(a, index)) {
+                break;
+            }
 
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            arena_mark_allocated(a, index, 1, list);
 
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -216,7 +455,7 @@ size_t pmm_free(struct list_node *list) {
             if (PAGE_BELONGS_TO_ARENA(page, a)) {
                 page->flags &= ~VM_PAGE_FLAG_NONFREE;
 
-                list_add_head(&a->free_list, &page->node);
+                buddy_free(a, page - a->page_array, 0);
                 a->free_count++;
                 count++;
                 break;
@@ -229,12 +468,74 @@ size_t pmm_free(struct list_node *list) {
 }
 
 size_t pmm_free_page(vm_page_t *page) {
-    struct list_node list;
-    list_initialize(&list);
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
 
-    list_add_head(&list, &page->node);
+    struct list_node drain = LIST_INITIAL_VALUE(drain);
 
-    return pmm_free(&list);
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcp *c = &pcp[arch_curr_cpu_num()];
+    spin_lock(&c->lock);
+    if (c->count == PMM_PCP_SIZE) {
+        /* magazine is full, hand the oldest batch back to the arenas */
+        for (uint i = 0; i < PMM_PCP_BATCH; i++) {
+            list_add_tail(&drain, &c->pages[i]->node);
+        }
+        memmove(&c->pages[0], &c->pages[PMM_PCP_BATCH], (PMM_PCP_SIZE - PMM_PCP_BATCH) * sizeof(c->pages[0]));
+        c->count -= PMM_PCP_BATCH;
+        c->free_drains++;
+    } else {
+        c->free_hits++;
+    }
+    c->pages[c->count++] = page;
+    spin_unlock(&c->lock);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (!list_is_empty(&drain)) {
+        pmm_free(&drain);
+    }
+
+    return 1;
+}
+
+/* return every page in every cpu's magazine to the arenas */
+static size_t pmm_pcp_drain_all(void) {
+    struct list_node drain = LIST_INITIAL_VALUE(drain);
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct pmm_pcp *c = &pcp[cpu];
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&c->lock, state);
+        for (uint i = 0; i < c->count; i++) {
+            list_add_tail(&drain, &c->pages[i]->node);
+        }
+        c->count = 0;
+        spin_unlock_irqrestore(&c->lock, state);
+    }
+
+    return pmm_free(&drain);
+}
+
+/* count the pages of an arena parked in the magazines */
+static size_t pmm_pcp_count_arena(const pmm_arena_t *arena) {
+    size_t count = 0;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct pmm_pcp *c = &pcp[cpu];
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&c->lock, state);
+        for (uint i = 0; i < c->count; i++) {
+            if (PAGE_BELONGS_TO_ARENA(c->pages[i], arena))
+                count++;
+        }
+        spin_unlock_irqrestore(&c->lock, state);
+    }
+
+    return count;
 }
 
 /* physically allocate a run from arenas marked as KMAP */
@@ -248,6 +549,9 @@ void *pmm_alloc_kpages(uint count, struct list_node *list) {
             return NULL;
         }
 
+        if (list)
+            list_add_tail(list, &p->node);
+
         return paddr_to_kvaddr(vm_page_to_paddr(p));
     }
 
@@ -264,6 +568,12 @@ size_t pmm_free_kpages(void *_ptr, uint count) {
 
     uint8_t *ptr = (uint8_t *)_ptr;
 
+    /* single pages go back through the per cpu magazine */
+    if (count == 1) {
+        vm_page_t *p = paddr_to_vm_page(vaddr_to_paddr(ptr));
+        return p ? pmm_free_page(p) : 0;
+    }
+
     struct list_node list;
     list_initialize(&list);
 
@@ -280,6 +590,47 @@ size_t pmm_free_kpages(void *_ptr, uint count) {
     return pmm_free(&list);
 }
 
+/* slow path when no free block covers the request: scan the arena for a free run */
+static ssize_t arena_find_run(pmm_arena_t *a, uint count, uint8_t alignment_log2) {
+    /* walk the list starting at alignment boundaries.
+     * calculate the starting offset into this arena, based on the
+     * base address of the arena to handle the case where the arena
+     * is not aligned on the same boundary requested.
+     */
+    paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
+    if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        return -1;
+
+    uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
+    uint start = aligned_offset;
+    LTRACEF("starting search at aligned offset %u\n", start);
+    LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+
+retry:
+    /* search while we're still within the arena and have a chance of finding a slot
+       (start + count < end of arena) */
+    while ((start < a->size / PAGE_SIZE) &&
+            ((start + count) <= a->size / PAGE_SIZE)) {
+        vm_page_t *p = &a->page_array[start];
+        for (uint i = 0; i < count; i++) {
+            if (p->flags & VM_PAGE_FLAG_NONFREE) {
+                /* this run is broken, break out of the inner loop.
+                 * start over at the next alignment boundary
+                 */
+                start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
+                goto retry;
+            }
+            p++;
+        }
+
+        /* we found a run */
+        LTRACEF("found run from pn %u to %u\n", start, start + count);
+        return start;
+    }
+
+    return -1;
+}
+
 size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list) {
     LTRACEF("count %u, align %u\n", count, alignment_log2);
 
@@ -288,72 +639,59 @@ size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, str
     if (alignment_log2 < PAGE_SIZE_SHIFT)
         alignment_log2 = PAGE_SIZE_SHIFT;
 
+    /* a block of this order is both large enough and aligned enough */
+    uint order = log2_uint(count);
+    if (!ispow2(count))
+        order++;
+    order = MAX(order, (uint)(alignment_log2 - PAGE_SIZE_SHIFT));
+
+    bool drained = false;
+retry:
     mutex_acquire(&lock);
 
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         // XXX make this a flag to only search kmap?
-        if (a->flags & PMM_ARENA_FLAG_KMAP) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
-                continue;
+        if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+            continue;
+
+        ssize_t start = -1;
+        if (order <= PMM_MAX_ORDER) {
+            start = buddy_alloc(a, order);
+            if (start >= 0)
+                buddy_trim(a, start, order, count);
+        }
 
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-            LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+        if (start < 0) {
+            /* no single free block is big enough, look for a run spanning several */
+            start = arena_find_run(a, count, alignment_log2);
+            if (start < 0)
+                continue;
 
-retry:
-            /* search while we're still within the arena and have a chance of finding a slot
-               (start + count < end of arena) */
-            while ((start < a->size / PAGE_SIZE) &&
-                    ((start + count) <= a->size / PAGE_SIZE)) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
-                }
-
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
-
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
-
-                    if (list)
-                        list_add_tail(list, &p->node);
-                }
-
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
-
-                mutex_release(&lock);
-
-                return count;
+            for (size_t i = start; i < (size_t)start + count; i++) {
+                __UNUSED bool claimed = buddy_claim_page(a, i);
+                DEBUG_ASSERT(claimed);
             }
         }
+
+        arena_mark_allocated(a, start, count, list);
+
+        if (pa)
+            *pa = a->base + start * PAGE_SIZE;
+
+        mutex_release(&lock);
+
+        return count;
     }
 
     mutex_release(&lock);
 
+    /* pages parked in the magazines may be what is breaking up the run */
+    if (!drained && pmm_pcp_drain_all() > 0) {
+        drained = true;
+        goto retry;
+    }
+
     LTRACEF("couldn't find run\n");
     return 0;
 }
@@ -365,8 +703,8 @@ static void dump_page(const vm_page_t *page) {
 static void dump_arena(const pmm_arena_t *arena, bool dump_pages) {
     printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x\n",
            arena, arena->name, arena->base, arena->size, arena->priority, arena->flags);
-    printf("\tpage_array %p, free_count %zu\n",
-           arena->page_array, arena->free_count);
+    printf("\tpage_array %p, free_count %zu, in magazines %zu\n",
+           arena->page_array, arena->free_count, pmm_pcp_count_arena(arena));
 
     /* dump all of the pages */
     if (dump_pages) {
@@ -396,6 +734,28 @@ static void dump_arena(const pmm_arena_t *arena, bool dump_pages) {
     }
 }
 
+/* per order free block counts, and how much of the free memory is too fragmented
+ * to satisfy an allocation of each order */
+static void dump_arena_orders(const pmm_arena_t *arena) {
+    printf("arena %p: name '%s' free pages %zu\n", arena, arena->name, arena->free_count);
+    printf("\torder  pages   free blocks   free pages  unusable\n");
+
+    size_t smaller_pages = 0;
+    for (uint order = 0; order <= PMM_MAX_ORDER; order++) {
+        size_t pages = arena->free_blocks[order] << order;
+
+        /* free pages held in blocks too small for this order */
+        uint unusable = arena->free_count ? smaller_pages * 100 / arena->free_count : 0;
+
+        printf("\t%5u %6lu %13zu %12zu %8u%%\n", order, 1UL << order,
+               arena->free_blocks[order], pages, unusable);
+
+        smaller_pages += pages;
+    }
+
+    DEBUG_ASSERT(smaller_pages == arena->free_count);
+}
+
 static int cmd_pmm(int argc, const console_cmd_args *argv) {
     if (argc < 2) {
 notenoughargs:
@@ -403,6 +763,8 @@ notenoughargs:
 usage:
         printf("usage:\n");
         printf("%s arenas\n", argv[0].str);
+        printf("%s orders\n", argv[0].str);
+        printf("%s pcp [drain]\n", argv[0].str);
         printf("%s alloc <count>\n", argv[0].str);
         printf("%s alloc_range <address> <count>\n", argv[0].str);
         printf("%s alloc_kpages <count>\n", argv[0].str);
@@ -419,6 +781,22 @@ usage:
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             dump_arena(a, false);
         }
+    } else if (!strcmp(argv[1].str, "orders")) {
+        mutex_acquire(&lock);
+        pmm_arena_t *a;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            dump_arena_orders(a);
+        }
+        mutex_release(&lock);
+    } else if (!strcmp(argv[1].str, "pcp")) {
+        if (argc >= 3 && !strcmp(argv[2].str, "drain")) {
+            printf("drained %zu pages\n", pmm_pcp_drain_all());
+        }
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            const struct pmm_pcp *c = &pcp[i];
+            printf("cpu %u: cached %u alloc hit %lu miss %lu free hit %lu drain %lu\n", i, c->count,
+                   c->alloc_hits, c->alloc_misses, c->free_hits, c->free_drains);
+        }
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 3) goto notenoughargs;
 
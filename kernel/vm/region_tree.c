@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2026 The LK Contributors
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <assert.h>
+#include <kernel/vm.h>
+#include <lk/trace.h>
+#include <stdlib.h>
+
+#include "vm_priv.h"
+
+#define LOCAL_TRACE 0
+
+/*
+ * AVL tree of the regions in an address space, keyed by base address.
+ *
+ * Each node is augmented with the largest free gap in front of any region in
+ * its subtree, which lets the allocator skip whole subtrees that cannot hold
+ * a request. The region list stays the authority on ordering; the caller keeps
+ * gap_before up to date as neighbors come and go. All of this is protected by
+ * the vmm lock.
+ */
+
+static inline int node_height(const vmm_region_t *r) {
+    return r ? r->tree_height : 0;
+}
+
+static inline size_t node_max_gap(const vmm_region_t *r) {
+    return r ? r->subtree_max_gap : 0;
+}
+
+static void node_update(vmm_region_t *r) {
+    r->tree_height = 1 + MAX(node_height(r->tree_left), node_height(r->tree_right));
+    r->subtree_max_gap = MAX(r->gap_before,
+                             MAX(node_max_gap(r->tree_left), node_max_gap(r->tree_right)));
+}
+
+static void replace_child(vmm_aspace_t *aspace, vmm_region_t *parent,
+                          vmm_region_t *old, vmm_region_t *new) {
+    if (!parent) {
+        aspace->region_tree = new;
+    } else if (parent->tree_left == old) {
+        parent->tree_left = new;
+    } else {
+        DEBUG_ASSERT(parent->tree_right == old);
+        parent->tree_right = new;
+    }
+
+    if (new)
+        new->tree_parent = parent;
+}
+
+static vmm_region_t *rotate_left(vmm_aspace_t *aspace, vmm_region_t *x) {
+    vmm_region_t *y = x->tree_right;
+
+    x->tree_right = y->tree_left;
+    if (y->tree_left)
+        y->tree_left->tree_parent = x;
+
+    replace_child(aspace, x->tree_parent, x, y);
+    y->tree_left = x;
+    x->tree_parent = y;
+
+    node_update(x);
+    node_update(y);
+    return y;
+}
+
+static vmm_region_t *rotate_right(vmm_aspace_t *aspace, vmm_region_t *x) {
+    vmm_region_t *y = x->tree_left;
+
+    x->tree_left = y->tree_right;
+    if (y->tree_right)
+        y->tree_right->tree_parent = x;
+
+    replace_child(aspace, x->tree_parent, x, y);
+    y->tree_right = x;
+    x->tree_parent = y;
+
+    node_update(x);
+    node_update(y);
+    return y;
+}
+
+/* walk from a node up to the root, rebalancing and refreshing the augmented data */
+static void rebalance_up(vmm_aspace_t *aspace, vmm_region_t *r) {
+    while (r) {
+        node_update(r);
+
+        int balance = node_height(r->tree_left) - node_height(r->tree_right);
+        if (balance > 1) {
+            if (node_height(r->tree_left->tree_left) < node_height(r->tree_left->tree_right))
+                rotate_left(aspace, r->tree_left);
+            r = rotate_right(aspace, r);
+        } else if (balance < -1) {
+            if (node_height(r->tree_right->tree_right) < node_height(r->tree_right->tree_left))
+                rotate_right(aspace, r->tree_right);
+            r = rotate_left(aspace, r);
+        }
+
+        r = r->tree_parent;
+    }
+}
+
+void vmm_region_tree_insert(vmm_aspace_t *aspace, vmm_region_t *r) {
+    LTRACEF("aspace %p r %p base 0x%lx size 0x%zx gap 0x%zx\n", aspace, r, r->base, r->size, r->gap_before);
+
+    vmm_region_t *parent = NULL;
+    vmm_region_t **link = &aspace->region_tree;
+    while (*link) {
+        parent = *link;
+        DEBUG_ASSERT(r->base != parent->base);
+        link = (r->base < parent->base) ? &parent->tree_left : &parent->tree_right;
+    }
+
+    r->tree_parent = parent;
+    r->tree_left = r->tree_right = NULL;
+    *link = r;
+
+    rebalance_up(aspace, r);
+}
+
+void vmm_region_tree_remove(vmm_aspace_t *aspace, vmm_region_t *r) {
+    LTRACEF("aspace %p r %p base 0x%lx\n", aspace, r, r->base);
+
+    vmm_region_t *fix;
+    if (r->tree_left && r->tree_right) {
+        /* move the successor, the leftmost node of the right subtree, into our spot */
+        vmm_region_t *s = r->tree_right;
+        while (s->tree_left)
+            s = s->tree_left;
+
+        if (s->tree_parent == r) {
+            fix = s;
+        } else {
+            fix = s->tree_parent;
+            replace_child(aspace, s->tree_parent, s, s->tree_right);
+            s->tree_right = r->tree_right;
+            s->tree_right->tree_parent = s;
+        }
+
+        s->tree_left = r->tree_left;
+        s->tree_left->tree_parent = s;
+        replace_child(aspace, r->tree_parent, r, s);
+    } else {
+        fix = r->tree_parent;
+        replace_child(aspace, r->tree_parent, r, r->tree_left ? r->tree_left : r->tree_right);
+    }
+
+    r->tree_parent = r->tree_left = r->tree_right = NULL;
+
+    rebalance_up(aspace, fix);
+}
+
+void vmm_region_tree_set_gap(vmm_region_t *r, size_t gap_before) {
+    r->gap_before = gap_before;
+
+    /* the shape does not change, just refresh the max gap up to the root */
+    for (; r; r = r->tree_parent)
+        node_update(r);
+}
+
+vmm_region_t *vmm_region_tree_find(const vmm_aspace_t *aspace, vaddr_t vaddr) {
+    vmm_region_t *r = aspace->region_tree;
+
+    while (r) {
+        if (vaddr < r->base) {
+            r = r->tree_left;
+        } else if (vaddr <= r->base + r->size - 1) {
+            return r;
+        } else {
+            r = r->tree_right;
+        }
+    }
+
+    return NULL;
+}
+
+vmm_region_t *vmm_region_tree_find_prev(const vmm_aspace_t *aspace, vaddr_t vaddr) {
+    vmm_region_t *prev = NULL;
+    vmm_region_t *r = aspace->region_tree;
+
+    /* last region that starts at or below vaddr */
+    while (r) {
+        if (vaddr < r->base) {
+            r = r->tree_left;
+        } else {
+            prev = r;
+            r = r->tree_right;
+        }
+    }
+
+    return prev;
+}
@@ -5,6 +5,8 @@ MODULE := $(LOCAL_DIR)
 MODULE_SRCS += \
 	$(LOCAL_DIR)/bootalloc.c \
 	$(LOCAL_DIR)/pmm.c \
+	$(LOCAL_DIR)/region_tree.c \
+	$(LOCAL_DIR)/tlb.c \
 	$(LOCAL_DIR)/vm.c \
 	$(LOCAL_DIR)/vmm.c \
 
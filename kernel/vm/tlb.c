@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2026 The LK Contributors
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <assert.h>
+#include <kernel/vm.h>
+#include <limits.h>
+#include <lk/debug.h>
+#include <lk/trace.h>
+
+#if WITH_SMP && ARCH_MMU_NEEDS_TLB_SHOOTDOWN
+#include <arch/atomic.h>
+#include <arch/mp.h>
+#include <arch/ops.h>
+#include <kernel/mp.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/*
+ * Batched tlb shootdown for architectures that can only invalidate the tlb of
+ * the cpu they run on.
+ *
+ * Callers unmap with arch_mmu_unmap(), which takes care of the local cpu, and
+ * add each range to a batch. Flushing the batch sends a single
+ * MP_IPI_TLB_SHOOTDOWN to every other cpu that may hold translations for the
+ * aspace and waits for all of them to invalidate the ranges, so the pages can
+ * be safely reused afterwards. One shootdown is in flight at a time.
+ *
+ * Page tables emptied by the unmaps are handed back by the arch layer rather
+ * than freed. Walkers on other cpus may have them cached, which only a flush of
+ * the whole aspace gets rid of, so their presence turns the batch into a full
+ * flush and they go back to the pmm once it has completed everywhere.
+ */
+
+void vmm_tlb_batch_init(vmm_tlb_batch_t *batch, vmm_aspace_t *aspace) {
+    batch->aspace = aspace;
+    batch->flush_all = false;
+    batch->count = 0;
+}
+
+void vmm_tlb_batch_add(vmm_tlb_batch_t *batch, vaddr_t base, size_t size) {
+    LTRACEF("batch %p, base %#lx, size %#zx\n", batch, base, size);
+
+    DEBUG_ASSERT(IS_PAGE_ALIGNED(base));
+    DEBUG_ASSERT(IS_PAGE_ALIGNED(size));
+
+    if (batch->flush_all || size == 0)
+        return;
+
+    /* the arch layer takes a page count as a uint, anything bigger is a full flush */
+    if (size / PAGE_SIZE > UINT_MAX) {
+        batch->flush_all = true;
+        return;
+    }
+
+    /* extend the last range if this one follows on from it */
+    if (batch->count > 0) {
+        typeof(batch->ranges[0]) *last = &batch->ranges[batch->count - 1];
+        if (last->base + last->size == base && (last->size + size) / PAGE_SIZE <= UINT_MAX) {
+            last->size += size;
+            return;
+        }
+    }
+
+    if (batch->count == countof(batch->ranges)) {
+        batch->flush_all = true;
+        return;
+    }
+
+    batch->ranges[batch->count].base = base;
+    batch->ranges[batch->count].size = size;
+    batch->count++;
+}
+
+#if WITH_SMP && ARCH_MMU_NEEDS_TLB_SHOOTDOWN
+
+static mutex_t shootdown_lock = MUTEX_INITIAL_VALUE(shootdown_lock);
+static const vmm_tlb_batch_t *volatile shootdown_batch;
+static volatile int shootdown_pending;
+
+static void tlb_batch_invalidate_local(const vmm_tlb_batch_t *batch) {
+    arch_aspace_t *aspace = &batch->aspace->arch_aspace;
+
+    if (batch->flush_all) {
+        arch_mmu_invalidate_tlb_all_local(aspace);
+        return;
+    }
+
+    for (uint i = 0; i < batch->count; i++) {
+        arch_mmu_invalidate_tlb_local(aspace, batch->ranges[i].base, batch->ranges[i].size / PAGE_SIZE);
+    }
+}
+
+static void tlb_batch_shootdown(const vmm_tlb_batch_t *batch) {
+    /* kernel mappings may be cached anywhere, user mappings only where the aspace has run */
+    mp_cpu_mask_t targets;
+    if (batch->aspace->flags & VMM_ASPACE_FLAG_KERNEL) {
+        targets = mp.active_cpus;
+    } else {
+        targets = batch->aspace->tlb_cpus & mp.active_cpus;
+    }
+
+    mutex_acquire(&shootdown_lock);
+
+    /* pick the targets and send the ipi without migrating, then wait with
+     * interrupts enabled so we can service a shootdown ourselves if needed */
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* the unmap may have happened on another cpu if we migrated, so do the local one too */
+    tlb_batch_invalidate_local(batch);
+
+    targets &= ~(1U << arch_curr_cpu_num());
+    if (targets) {
+        shootdown_batch = batch;
+        shootdown_pending = __builtin_popcount(targets);
+        smp_wmb();
+        arch_mp_send_ipi(targets, MP_IPI_TLB_SHOOTDOWN);
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    while (shootdown_pending != 0)
+        ;
+    shootdown_batch = NULL;
+
+    mutex_release(&shootdown_lock);
+}
+
+void vmm_tlb_shootdown_irq(void) {
+    const vmm_tlb_batch_t *batch = shootdown_batch;
+
+    LTRACEF("cpu %u, batch %p\n", arch_curr_cpu_num(), batch);
+
+    DEBUG_ASSERT(batch);
+    tlb_batch_invalidate_local(batch);
+
+    smp_mb();
+    atomic_add(&shootdown_pending, -1);
+}
+
+#else
+
+static void tlb_batch_shootdown(const vmm_tlb_batch_t *batch) {
+    /* arch_mmu_unmap() already covered every cpu */
+}
+
+void vmm_tlb_shootdown_irq(void) {
+}
+
+#endif
+
+void vmm_tlb_batch_flush(vmm_tlb_batch_t *batch) {
+#if ARCH_MMU_NEEDS_TLB_SHOOTDOWN
+    struct list_node tables = LIST_INITIAL_VALUE(tables);
+    if (arch_mmu_take_free_ptables(&batch->aspace->arch_aspace, &tables) > 0)
+        batch->flush_all = true;
+#endif
+
+    LTRACEF("batch %p, aspace %p, count %u, flush_all %u\n", batch, batch->aspace,
+            batch->count, batch->flush_all);
+
+    if (batch->count > 0 || batch->flush_all)
+        tlb_batch_shootdown(batch);
+
+    batch->count = 0;
+    batch->flush_all = false;
+
+#if ARCH_MMU_NEEDS_TLB_SHOOTDOWN
+    pmm_free(&tables);
+#endif
+}
@@ -183,7 +183,13 @@ usage:
             return -1;
         }
 
+        /* go through a batch so other cpus are flushed and emptied tables freed */
+        vmm_tlb_batch_t batch;
+        vmm_tlb_batch_init(&batch, aspace);
         int err = arch_mmu_unmap(&aspace->arch_aspace, argv[2].u, argv[3].u);
+        if (IS_PAGE_ALIGNED(argv[2].u))
+            vmm_tlb_batch_add(&batch, argv[2].u, argv[3].u * PAGE_SIZE);
+        vmm_tlb_batch_flush(&batch);
         printf("arch_mmu_unmap returns %d\n", err);
     } else {
         printf("unknown command\n");
@@ -19,3 +19,9 @@ extern uintptr_t boot_alloc_end;
 void vmm_init_preheap(void);
 void vmm_init(void);
 
+/* balanced tree index of the regions in an aspace, see region_tree.c */
+void vmm_region_tree_insert(vmm_aspace_t *aspace, vmm_region_t *r);
+void vmm_region_tree_remove(vmm_aspace_t *aspace, vmm_region_t *r);
+void vmm_region_tree_set_gap(vmm_region_t *r, size_t gap_before);
+vmm_region_t *vmm_region_tree_find(const vmm_aspace_t *aspace, vaddr_t vaddr);
+vmm_region_t *vmm_region_tree_find_prev(const vmm_aspace_t *aspace, vaddr_t vaddr);
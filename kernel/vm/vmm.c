@@ -5,6 +5,7 @@
  * license that can be found in the LICENSE file or at
  * https://opensource.org/licenses/MIT
  */
+#include <arch/atomic.h>
 #include <assert.h>
 #include <kernel/mutex.h>
 #include <kernel/vm.h>
@@ -105,6 +106,31 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
     return r;
 }
 
+/* link a region into the list after the given node and into the tree,
+ * fixing up the gap in front of it and the one in front of its successor */
+static void insert_region(vmm_aspace_t *aspace, vmm_region_t *r, struct list_node *before) {
+    list_add_after(before, &r->node);
+
+    vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    r->gap_before = r->base - (prev ? prev->base + prev->size : aspace->base);
+    vmm_region_tree_insert(aspace, r);
+
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    if (next)
+        vmm_region_tree_set_gap(next, next->base - (r->base + r->size));
+}
+
+static void remove_region(vmm_aspace_t *aspace, vmm_region_t *r) {
+    vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+
+    list_delete(&r->node);
+    vmm_region_tree_remove(aspace, r);
+
+    if (next)
+        vmm_region_tree_set_gap(next, next->base - (prev ? prev->base + prev->size : aspace->base));
+}
+
 /* add a region to the appropriate spot in the address space list,
  * testing to see if there's a space */
 static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r) {
@@ -122,31 +148,22 @@ static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r) {
 
     vaddr_t r_end = r->base + r->size - 1;
 
-    /* does it fit in front */
-    vmm_region_t *last;
-    last = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
-    if (!last || r_end < last->base) {
-        /* empty list or not empty and fits before the first element */
-        list_add_head(&aspace->region_list, &r->node);
-        return NO_ERROR;
+    /* it has to start after the region below it ends and end before the next one starts */
+    vmm_region_t *prev = vmm_region_tree_find_prev(aspace, r->base);
+    if (prev && r->base <= prev->base + prev->size - 1) {
+        LTRACEF("couldn't find spot\n");
+        return ERR_NO_MEMORY;
     }
 
-    /* walk the list, finding the right spot to put it */
-    list_for_every_entry(&aspace->region_list, last, vmm_region_t, node) {
-        /* does it go after last? */
-        if (r->base > last->base + last->size - 1) {
-            /* get the next element in the list */
-            vmm_region_t *next = list_next_type(&aspace->region_list, &last->node, vmm_region_t, node);
-            if (!next || (r_end < next->base)) {
-                /* end of the list or next exists and it goes between them */
-                list_add_after(&last->node, &r->node);
-                return NO_ERROR;
-            }
-        }
+    vmm_region_t *next = prev ? list_next_type(&aspace->region_list, &prev->node, vmm_region_t, node)
+                              : list_peek_head_type(&aspace->region_list, vmm_region_t, node);
+    if (next && r_end >= next->base) {
+        LTRACEF("couldn't find spot\n");
+        return ERR_NO_MEMORY;
     }
 
-    LTRACEF("couldn't find spot\n");
-    return ERR_NO_MEMORY;
+    insert_region(aspace, r, prev ? &prev->node : &aspace->region_list);
+    return NO_ERROR;
 }
 
 /*
@@ -207,6 +224,33 @@ not_found:
     return true; /* not_found: stop search */
 }
 
+/*
+ *  Find the lowest gap in a subtree that can hold the allocation, in address
+ *  order. Subtrees without a large enough gap are skipped entirely, so only
+ *  gaps that are big enough but fail alignment cost more than the descent.
+ *
+ *  Returns true if the caller has to stop search, like check_gap.
+ */
+static bool alloc_spot_in_tree(vmm_aspace_t *aspace, vmm_region_t *r,
+                               vaddr_t *pva, vaddr_t align, size_t size,
+                               uint arch_mmu_flags, vmm_region_t **next) {
+    if (!r || r->subtree_max_gap < size)
+        return false;
+
+    if (alloc_spot_in_tree(aspace, r->tree_left, pva, align, size, arch_mmu_flags, next))
+        return true;
+
+    if (r->gap_before >= size) {
+        vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+        if (check_gap(aspace, prev, r, pva, align, size, arch_mmu_flags)) {
+            *next = r;
+            return true;
+        }
+    }
+
+    return alloc_spot_in_tree(aspace, r->tree_right, pva, align, size, arch_mmu_flags, next);
+}
+
 static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
                           uint arch_mmu_flags, struct list_node **before) {
     DEBUG_ASSERT(aspace);
@@ -219,28 +263,30 @@ static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
     vaddr_t align = 1UL << align_pow2;
 
     vaddr_t spot;
-    vmm_region_t *r = NULL;
+    vmm_region_t *prev;
 
-    /* try to pick spot at the beginning of address space */
-    if (check_gap(aspace, NULL,
-                  list_peek_head_type(&aspace->region_list, vmm_region_t, node),
-                  &spot, align, size, arch_mmu_flags))
-        goto done;
+    /* try the gaps in front of each region */
+    vmm_region_t *next = NULL;
+    if (alloc_spot_in_tree(aspace, aspace->region_tree, &spot, align, size, arch_mmu_flags, &next)) {
+        if (spot == (vaddr_t)-1)
+            return -1;
 
-    /* search the middle of the list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if (check_gap(aspace, r,
-                      list_next_type(&aspace->region_list, &r->node, vmm_region_t, node),
-                      &spot, align, size, arch_mmu_flags))
-            goto done;
+        prev = next ? list_prev_type(&aspace->region_list, &next->node, vmm_region_t, node) : NULL;
+        goto done;
     }
 
+    /* then the space after the last one */
+    prev = list_peek_tail_type(&aspace->region_list, vmm_region_t, node);
+    if (check_gap(aspace, prev, NULL, &spot, align, size, arch_mmu_flags) &&
+            spot != (vaddr_t)-1)
+        goto done;
+
     /* couldn't find anything */
     return -1;
 
 done:
     if (before)
-        *before = r ? &r->node : &aspace->region_list;
+        *before = prev ? &prev->node : &aspace->region_list;
     return spot;
 }
 
@@ -279,7 +325,7 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
         r->base = (vaddr_t)vaddr;
 
         /* add it to the region list */
-        list_add_after(before, &r->node);
+        insert_region(aspace, r, before);
     }
 
     return r;
@@ -481,6 +527,19 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         vaddr = (vaddr_t)*ptr;
     }
 
+    /* lazy regions are populated one page at a time by vmm_page_fault_handler() */
+    if (vmm_flags & VMM_FLAG_LAZY) {
+        mutex_acquire(&vmm_lock);
+
+        vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
+                                       VMM_REGION_FLAG_PHYSICAL | VMM_REGION_FLAG_LAZY, arch_mmu_flags);
+        if (r && ptr)
+            *ptr = (void *)r->base;
+
+        mutex_release(&vmm_lock);
+        return r ? NO_ERROR : ERR_NO_MEMORY;
+    }
+
     /* allocate physical memory up front, in case it cant be satisfied */
 
     /* allocate a random pile of pages */
@@ -540,20 +599,72 @@ err:
 }
 
 static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr) {
-    vmm_region_t *r;
-
     DEBUG_ASSERT(aspace);
 
     if (!aspace)
         return NULL;
 
-    /* search the region list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if ((vaddr >= r->base) && (vaddr <= r->base + r->size - 1))
-            return r;
+    return vmm_region_tree_find(aspace, vaddr);
+}
+
+status_t vmm_page_fault_handler(vaddr_t addr, uint pf_flags) {
+    LTRACEF("addr %#lx, pf_flags %#x\n", addr, pf_flags);
+
+    vmm_aspace_t *aspace = vaddr_to_aspace((void *)addr);
+    if (!aspace)
+        return ERR_NOT_FOUND;
+
+    vaddr_t va = ROUNDDOWN(addr, PAGE_SIZE);
+    status_t err = NO_ERROR;
+
+    /* a fault taken by the vmm itself can't be resolved, we'd deadlock on our own lock */
+    if (unlikely(is_mutex_held(&vmm_lock))) {
+        TRACEF("fault at %#lx with the vmm lock held\n", addr);
+        return ERR_BAD_STATE;
     }
 
-    return NULL;
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *r = vmm_find_region(aspace, va);
+    if (!r || !(r->flags & VMM_REGION_FLAG_LAZY)) {
+        err = ERR_NOT_FOUND;
+        goto out;
+    }
+
+    /* the page would be there already if the permissions allowed the access */
+    if (((pf_flags & VMM_PF_FLAG_WRITE) && (r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_RO)) ||
+            ((pf_flags & VMM_PF_FLAG_INSTRUCTION) && (r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_NO_EXECUTE)) ||
+            ((pf_flags & VMM_PF_FLAG_USER) && !(r->arch_mmu_flags & ARCH_MMU_FLAG_PERM_USER))) {
+        err = ERR_ACCESS_DENIED;
+        goto out;
+    }
+
+    /* another thread may have faulted it in while we waited for the lock */
+    if (arch_mmu_query(&aspace->arch_aspace, va, NULL, NULL) == NO_ERROR)
+        goto out;
+
+    vm_page_t *p = pmm_alloc_page();
+    if (!p) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    paddr_t pa = vm_page_to_paddr(p);
+    memset(paddr_to_kvaddr(pa), 0, PAGE_SIZE);
+
+    err = arch_mmu_map(&aspace->arch_aspace, va, pa, 1, r->arch_mmu_flags);
+    if (err < 0) {
+        pmm_free_page(p);
+        goto out;
+    }
+
+    list_add_tail(&r->page_list, &p->node);
+
+    LTRACEF("mapped pa %#lx at va %#lx in region '%s'\n", pa, va, r->name);
+
+out:
+    mutex_release(&vmm_lock);
+    return err;
 }
 
 status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr) {
@@ -566,10 +677,14 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr) {
     }
 
     /* remove it from aspace */
-    list_delete(&r->node);
+    remove_region(aspace, r);
 
-    /* unmap it */
+    /* unmap it, and make sure no other cpu still has it cached before the pages are freed */
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch, aspace);
     arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
+    vmm_tlb_batch_add(&batch, r->base, r->size);
+    vmm_tlb_batch_flush(&batch);
 
     mutex_release(&vmm_lock);
 
@@ -635,15 +750,22 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace) {
 
     /* free all of the regions */
     struct list_node region_list = LIST_INITIAL_VALUE(region_list);
+    vmm_tlb_batch_t batch;
+    vmm_tlb_batch_init(&batch, aspace);
 
     vmm_region_t *r;
     while ((r = list_remove_head_type(&aspace->region_list, vmm_region_t, node))) {
         /* add it to our tempoary list */
         list_add_tail(&region_list, &r->node);
+        vmm_region_tree_remove(aspace, r);
 
         /* unmap it */
         arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
+        vmm_tlb_batch_add(&batch, r->base, r->size);
     }
+
+    /* one shootdown for all of the regions */
+    vmm_tlb_batch_flush(&batch);
     mutex_release(&vmm_lock);
 
     /* without the vmm lock held, free all of the pmm pages and the structure */
@@ -676,6 +798,10 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace) {
 void vmm_context_switch(vmm_aspace_t *oldspace, vmm_aspace_t *newaspace) {
     DEBUG_ASSERT(thread_lock_held());
 
+    if (newaspace) {
+        atomic_or(&newaspace->tlb_cpus, 1U << arch_curr_cpu_num());
+    }
+
     arch_mmu_context_switch(newaspace ? &newaspace->arch_aspace : NULL);
 }
 
@@ -722,6 +848,7 @@ usage:
         printf("%s alloc <size> <align_pow2>\n", argv[0].str);
         printf("%s alloc_physical <paddr> <size> <align_pow2>\n", argv[0].str);
         printf("%s alloc_contig <size> <align_pow2>\n", argv[0].str);
+        printf("%s alloc_lazy <size> <align_pow2>\n", argv[0].str);
         printf("%s free_region <address>\n", argv[0].str);
         printf("%s create_aspace\n", argv[0].str);
         printf("%s create_test_aspace\n", argv[0].str);
@@ -758,6 +885,12 @@ usage:
         void *ptr = (void *)0x99;
         status_t err = vmm_alloc_contiguous(test_aspace, "contig test", argv[2].u, &ptr, argv[3].u, 0, 0);
         printf("vmm_alloc_contig returns %d, ptr %p\n", err, ptr);
+    } else if (!strcmp(argv[1].str, "alloc_lazy")) {
+        if (argc < 4) goto notenoughargs;
+
+        void *ptr = (void *)0x99;
+        status_t err = vmm_alloc(test_aspace, "lazy test", argv[2].u, &ptr, argv[3].u, VMM_FLAG_LAZY, 0);
+        printf("vmm_alloc returns %d, ptr %p\n", err, ptr);
     } else if (!strcmp(argv[1].str, "free_region")) {
         if (argc < 2) goto notenoughargs;
 
@@ -12,25 +12,95 @@
 #include <sys/types.h>
 #include <lk/debug.h>
 #include <lk/trace.h>
+#include <lk/err.h>
+#include <lk/pow2.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <platform/time.h>
+#include <arch/atomic.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
 
 #define LOCAL_TRACE 0
 
+/*
+ * Blocks are indexed by block number in a hash table. Blocks nobody holds a
+ * reference to sit on either the clean or the dirty lru list, oldest first, so
+ * picking a victim never has to look past the head of a list. Blocks that are
+ * referenced are only in the hash.
+ *
+ * A single mutex protects the cache. Reads are queued with the async bio api
+ * and the mutex isn't held while waiting for them, anyone that wants a block
+ * still being read in waits on the block's event. Completions can run in
+ * interrupt context, so they only put the transfer on a spinlock protected
+ * list and the block state is updated the next time someone holds the mutex.
+ *
+ * Misses that continue a sequential run read ahead into free or clean slots
+ * with a single multi-block transfer. The window doubles as long as the run
+ * continues, and the first use of a marker block partway into the window
+ * kicks off the next one without waiting for it.
+ *
+ * Dirty blocks are written back by a flusher thread per cache, never on the
+ * path of the caller that needs a free slot. It wakes up when too much of the
+ * cache is dirty, when a block has been dirty for too long, or when someone is
+ * waiting for a clean block, and writes the dirty blocks sorted by block
+ * number with adjacent ones merged into a single transfer. A block is marked
+ * clean when its write is queued, so anyone dirtying it again in the meantime
+ * gets it written again.
+ */
+
+#define BCACHE_RA_MIN 4
+#define BCACHE_RA_MAX 32
+#define BCACHE_IO_MAX_BLOCKS (BCACHE_RA_MAX + 1)
+
+/* writeback defaults, see bcache_set_writeback() */
+#define BCACHE_DIRTY_BACKGROUND 25  // percent of the cache
+#define BCACHE_DIRTY_LIMIT      75  // percent of the cache
+#define BCACHE_DIRTY_MAX_AGE    5000
+
 struct bcache_block {
-    struct list_node node;
+    struct list_node node;      // free, clean or dirty list
+    struct list_node hash_node;
     bnum_t blocknum;
     int ref_count;
     bool is_dirty;
+    bool is_valid;              // contents have been read in
+    bool is_busy;               // being read in, wait on io_event
+    bool is_readahead;          // read ahead and not used yet
+    bool ra_marker;             // first use starts the next readahead window
+    bool is_writing;            // being written back, holds a reference
+    lk_time_t dirty_time;       // when it went from clean to dirty
+    event_t io_event;
     void *ptr;
 };
 
 struct bcache_stats {
     uint32_t hits;
+    uint32_t lookups;
     uint32_t depth;
     uint32_t misses;
     uint32_t reads;
     uint32_t writes;
+    uint32_t ra_reads;
+    uint32_t ra_blocks;
+    uint32_t ra_hits;
+    uint32_t ra_wasted;
+    uint32_t wb_blocks;
+    uint32_t wb_passes;
+    uint32_t alloc_stalls;
+    uint32_t dirty_stalls;
+};
+
+/* a single read or write of one or more consecutive blocks */
+struct bcache_io {
+    struct list_node node;
+    struct bcache *cache;
+    bio_request_t req;
+    uint count;
+    struct bcache_block *blocks[BCACHE_IO_MAX_BLOCKS];
+    iovec_t iov[BCACHE_IO_MAX_BLOCKS];
 };
 
 struct bcache {
@@ -39,12 +109,52 @@ struct bcache {
     int count;
     struct bcache_stats stats;
 
+    mutex_t lock;
+
     struct list_node free_list;
-    struct list_node lru_list;
+    struct list_node clean_list;
+    struct list_node dirty_list;
+
+    struct list_node *hash;
+    uint hash_shift;
+
+    /* finished reads waiting to be retired under the mutex */
+    spin_lock_t done_lock;
+    struct list_node done_list;
+
+    /* sequential readahead state */
+    bnum_t last_block;          // one past the device
+    bnum_t seq_next;            // block that would continue the current run
+    bnum_t ra_next;             // first block past the last readahead
+    uint ra_window;
+    uint ra_max;
+
+    /* writeback state */
+    uint dirty_count;
+    uint dirty_background;
+    uint dirty_limit;
+    lk_time_t dirty_max_age;
+    bool wb_urgent;             // someone is waiting for clean blocks
+    bool wb_exit;
+    uint wb_active;             // blocks being written
+    int wb_status;              // result of the last writeback pass
+    mutex_t wb_lock;            // one writeback pass at a time, taken before lock
+    struct bcache_block **wb_blocks;
+    volatile int wb_pending;
+    event_t wb_kick;
+    event_t wb_done;
+    event_t clean_event;        // signaled at the end of every writeback pass
+    thread_t *flusher;
 
     struct bcache_block *blocks;
 };
 
+static inline uint hash_bucket(const struct bcache *cache, bnum_t blocknum) {
+    return (uint32_t)(blocknum * 2654435761u) >> (32 - cache->hash_shift);
+}
+
+static int bcache_flusher(void *arg);
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count) {
     struct bcache *cache;
 
@@ -55,42 +165,86 @@ bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count) {
     cache->count = block_count;
     memset(&cache->stats, 0, sizeof(cache->stats));
 
+    mutex_init(&cache->lock);
+
     list_initialize(&cache->free_list);
-    list_initialize(&cache->lru_list);
+    list_initialize(&cache->clean_list);
+    list_initialize(&cache->dirty_list);
+
+    spin_lock_init(&cache->done_lock);
+    list_initialize(&cache->done_list);
+
+    cache->last_block = (bnum_t)(dev->total_size / block_size);
+    cache->seq_next = 0;
+    cache->ra_next = 0;
+    cache->ra_window = 0;
+    cache->ra_max = MIN(BCACHE_RA_MAX, (uint)block_count / 2);
+
+    cache->dirty_count = 0;
+    cache->dirty_background = BCACHE_DIRTY_BACKGROUND;
+    cache->dirty_limit = BCACHE_DIRTY_LIMIT;
+    cache->dirty_max_age = BCACHE_DIRTY_MAX_AGE;
+    cache->wb_urgent = false;
+    cache->wb_exit = false;
+    cache->wb_active = 0;
+    cache->wb_status = NO_ERROR;
+    mutex_init(&cache->wb_lock);
+    cache->wb_blocks = malloc(sizeof(struct bcache_block *) * block_count);
+    cache->wb_pending = 0;
+    event_init(&cache->wb_kick, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&cache->wb_done, false, 0);
+    event_init(&cache->clean_event, false, 0);
+
+    /* at least as many buckets as blocks, rounded up to a power of two */
+    cache->hash_shift = MAX(4u, log2_uint(round_up_pow2_u32(block_count)));
+    cache->hash = malloc(sizeof(struct list_node) << cache->hash_shift);
+    for (uint i = 0; i < (1u << cache->hash_shift); i++)
+        list_initialize(&cache->hash[i]);
 
     cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
     int i;
     for (i=0; i < block_count; i++) {
         cache->blocks[i].ref_count = 0;
         cache->blocks[i].is_dirty = false;
+        cache->blocks[i].is_valid = false;
+        cache->blocks[i].is_busy = false;
+        cache->blocks[i].is_readahead = false;
+        cache->blocks[i].ra_marker = false;
+        cache->blocks[i].is_writing = false;
+        event_init(&cache->blocks[i].io_event, false, 0);
+        list_clear_node(&cache->blocks[i].hash_node);
         cache->blocks[i].ptr = malloc(block_size);
         // add to the free list
         list_add_head(&cache->free_list, &cache->blocks[i].node);
     }
 
+    cache->flusher = thread_create("bcache flusher", &bcache_flusher, cache,
+                                   LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(cache->flusher);
+
     return (bcache_t)cache;
 }
 
-static int flush_block(struct bcache *cache, struct bcache_block *block) {
-    int rc;
-
-    rc = bio_write(cache->dev, block->ptr,
-                   (off_t)block->blocknum * cache->block_size,
-                   cache->block_size);
-    if (rc < 0)
-        goto exit;
-
-    block->is_dirty = false;
-    cache->stats.writes++;
-    rc = 0;
-exit:
-    return (rc);
-}
+static void wait_block(struct bcache *cache, struct bcache_block *block);
 
 void bcache_destroy(bcache_t _cache) {
     struct bcache *cache = _cache;
     int i;
 
+    /* stop the flusher, anything still dirty is dropped below */
+    mutex_acquire(&cache->lock);
+    cache->wb_exit = true;
+    mutex_release(&cache->lock);
+    event_signal(&cache->wb_kick, true);
+    thread_join(cache->flusher, NULL, INFINITE_TIME);
+
+    /* let any readahead still in flight land before the buffers go away */
+    mutex_acquire(&cache->lock);
+    for (i=0; i < cache->count; i++) {
+        wait_block(cache, &cache->blocks[i]);
+    }
+    mutex_release(&cache->lock);
+
     for (i=0; i < cache->count; i++) {
         DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
 
@@ -98,9 +252,18 @@ void bcache_destroy(bcache_t _cache) {
             printf("warning: freeing dirty block %u\n",
                    cache->blocks[i].blocknum);
 
+        event_destroy(&cache->blocks[i].io_event);
         free(cache->blocks[i].ptr);
     }
 
+    event_destroy(&cache->wb_kick);
+    event_destroy(&cache->wb_done);
+    event_destroy(&cache->clean_event);
+    mutex_destroy(&cache->wb_lock);
+    mutex_destroy(&cache->lock);
+    free(cache->wb_blocks);
+    free(cache->blocks);
+    free(cache->hash);
     free(cache);
 }
 
@@ -108,86 +271,574 @@ void bcache_destroy(bcache_t _cache) {
 static struct bcache_block *find_block(struct bcache *cache, uint blocknum) {
     uint32_t depth = 0;
     struct bcache_block *block;
+    struct bcache_block *found = NULL;
 
     LTRACEF("num %u\n", blocknum);
 
-    block = NULL;
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+    DEBUG_ASSERT(is_mutex_held(&cache->lock));
+
+    cache->stats.lookups++;
+    list_for_every_entry(&cache->hash[hash_bucket(cache, blocknum)], block, struct bcache_block, hash_node) {
         LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
         depth++;
 
         if (block->blocknum == blocknum) {
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            cache->stats.hits++;
-            cache->stats.depth += depth;
-            return block;
+            found = block;
+            break;
         }
     }
+    cache->stats.depth += depth;
 
-    cache->stats.misses++;
-    return NULL;
+    return found;
 }
 
-/* allocate a new block */
-static struct bcache_block *alloc_block(struct bcache *cache) {
-    int err;
+/* take a reference, a block in use is pulled off the lru lists */
+static void ref_block(struct bcache_block *block) {
+    if (block->ref_count++ == 0)
+        list_delete(&block->node);
+}
+
+/* drop a reference, the last one puts it back at the young end of its lru */
+static void unref_block(struct bcache *cache, struct bcache_block *block) {
+    DEBUG_ASSERT(block->ref_count > 0);
+
+    if (--block->ref_count > 0)
+        return;
+
+    if (!list_in_list(&block->hash_node)) {
+        /* a block whose read failed goes back on the free list */
+        list_add_head(&cache->free_list, &block->node);
+    } else if (block->is_dirty) {
+        list_add_tail(&cache->dirty_list, &block->node);
+    } else {
+        list_add_tail(&cache->clean_list, &block->node);
+    }
+}
+
+/* slot for a readahead block, never worth writing back a dirty one or dropping unused readahead */
+static struct bcache_block *alloc_ra_block(struct bcache *cache) {
     struct bcache_block *block;
 
-    /* pop one off the free list if it's present */
     block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
-    if (block) {
-        block->ref_count = 0;
-        list_add_tail(&cache->lru_list, &block->node);
-        LTRACEF("found block %p on free list\n", block);
+    if (block)
         return block;
+
+    block = list_peek_head_type(&cache->clean_list, struct bcache_block, node);
+    if (!block || block->is_readahead)
+        return NULL;
+
+    DEBUG_ASSERT(block->ref_count == 0);
+    list_delete(&block->node);
+    list_delete(&block->hash_node);
+
+    return block;
+}
+
+/* completion, possibly in interrupt context */
+static void bcache_io_callback(bio_request_t *req) {
+    struct bcache_io *io = req->arg;
+    struct bcache *cache = io->cache;
+
+    LTRACEF("io %p, result %ld\n", io, (long)req->result);
+
+    /* signal under the lock so the io can't be retired and freed underneath us */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->done_lock, state);
+    list_add_tail(&cache->done_list, &io->node);
+    for (uint i = 0; i < io->count; i++) {
+        event_signal(&io->blocks[i]->io_event, false);
     }
+    spin_unlock_irqrestore(&cache->done_lock, state);
+}
 
-    /* walk the lru, looking for a free block */
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-        if (block->ref_count == 0) {
-            if (block->is_dirty) {
-                err = flush_block(cache, block);
-                if (err)
-                    return NULL;
+/* retire finished reads, updating the blocks and dropping the references the reads held */
+static void reap_io(struct bcache *cache) {
+    DEBUG_ASSERT(is_mutex_held(&cache->lock));
+
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cache->done_lock, state);
+        struct bcache_io *io = list_remove_head_type(&cache->done_list, struct bcache_io, node);
+        spin_unlock_irqrestore(&cache->done_lock, state);
+
+        if (!io)
+            break;
+
+        ssize_t result = io->req.result;
+        for (uint i = 0; i < io->count; i++) {
+            struct bcache_block *block = io->blocks[i];
+
+            block->is_busy = false;
+            if (result >= 0 && (size_t)result >= (i + 1) * cache->block_size) {
+                block->is_valid = true;
+            } else {
+                /* unhash it so the next lookup retries, it's freed with the last reference */
+                block->is_readahead = false;
+                block->ra_marker = false;
+                list_delete(&block->hash_node);
             }
+            unref_block(cache, block);
+        }
+
+        free(io);
+    }
+}
+
+/* wait for a block to finish being read in, the caller's reference keeps it from being recycled */
+static void wait_block(struct bcache *cache, struct bcache_block *block) {
+    DEBUG_ASSERT(is_mutex_held(&cache->lock));
+
+    reap_io(cache);
+    while (block->is_busy) {
+        mutex_release(&cache->lock);
+        event_wait(&block->io_event);
+        mutex_acquire(&cache->lock);
+        reap_io(cache);
+    }
+}
+
+/* called whenever a block goes from clean to dirty */
+static void set_dirty(struct bcache *cache, struct bcache_block *block) {
+    if (block->is_dirty)
+        return;
 
-            // add it to the tail of the lru
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
+    block->is_dirty = true;
+    block->dirty_time = current_time();
+    cache->dirty_count++;
+
+    /* an unreferenced clean block moves over to the dirty lru */
+    if (block->ref_count == 0) {
+        list_delete(&block->node);
+        list_add_tail(&cache->dirty_list, &block->node);
+    }
+
+    if (cache->dirty_count * 100 >= cache->count * cache->dirty_background)
+        event_signal(&cache->wb_kick, false);
+}
+
+static int blocknum_compare(const void *_a, const void *_b) {
+    const struct bcache_block *a = *(struct bcache_block * const *)_a;
+    const struct bcache_block *b = *(struct bcache_block * const *)_b;
+
+    if (a->blocknum != b->blocknum)
+        return (a->blocknum < b->blocknum) ? -1 : 1;
+    return 0;
+}
+
+/* completion, possibly in interrupt context. The writeback pass owns the io. */
+static void bcache_write_callback(bio_request_t *req) {
+    struct bcache_io *io = req->arg;
+    struct bcache *cache = io->cache;
+
+    LTRACEF("io %p, result %ld\n", io, (long)req->result);
+
+    if (atomic_add(&cache->wb_pending, -1) == 1)
+        event_signal(&cache->wb_done, false);
+}
+
+/*
+ * Write out a set of dirty blocks, sorted by block number with runs of adjacent
+ * blocks going out as one transfer. All of the transfers are queued before
+ * waiting for any of them. Called with wb_lock and the mutex held, the mutex is
+ * dropped while the writes are in flight.
+ */
+static int writeback_blocks(struct bcache *cache, struct bcache_block **blocks, uint count) {
+    struct list_node ios = LIST_INITIAL_VALUE(ios);
+    int err = 0;
+
+    DEBUG_ASSERT(is_mutex_held(&cache->wb_lock));
+    DEBUG_ASSERT(is_mutex_held(&cache->lock));
+
+    qsort(blocks, count, sizeof(blocks[0]), &blocknum_compare);
+
+    /* hold a reference across the write and mark it clean now, so a write that lands meanwhile redirties it */
+    for (uint i = 0; i < count; i++) {
+        struct bcache_block *block = blocks[i];
+
+        DEBUG_ASSERT(block->is_dirty && block->is_valid && !block->is_writing);
+        ref_block(block);
+        block->is_dirty = false;
+        block->is_writing = true;
+        cache->dirty_count--;
+    }
+    cache->wb_active += count;
+
+    cache->wb_pending = 1;
+    event_unsignal(&cache->wb_done);
+
+    struct bcache_io *io = NULL;
+    for (uint i = 0; i < count; i++) {
+        struct bcache_block *block = blocks[i];
+
+        if (io && (io->count == BCACHE_IO_MAX_BLOCKS ||
+                   io->blocks[io->count - 1]->blocknum + 1 != block->blocknum)) {
+            io = NULL;
+        }
+
+        if (!io) {
+            io = malloc(sizeof(struct bcache_io));
+            if (!io) {
+                /* put it back the way it was and let a later pass have it */
+                err = ERR_NO_MEMORY;
+                block->is_dirty = true;
+                block->is_writing = false;
+                cache->dirty_count++;
+                cache->wb_active--;
+                unref_block(cache, block);
+                continue;
+            }
+
+            io->cache = cache;
+            io->count = 0;
+            list_add_tail(&ios, &io->node);
+        }
+
+        io->iov[io->count].iov_base = block->ptr;
+        io->iov[io->count].iov_len = cache->block_size;
+        io->blocks[io->count++] = block;
+    }
+
+    list_for_every_entry(&ios, io, struct bcache_io, node) {
+        LTRACEF("write block %u, count %u\n", io->blocks[0]->blocknum, io->count);
+
+        bio_request_init(&io->req, true, (off_t)io->blocks[0]->blocknum * cache->block_size,
+                         io->iov, io->count);
+        io->req.callback = &bcache_write_callback;
+        io->req.arg = io;
+
+        atomic_add(&cache->wb_pending, 1);
+        bio_submit(cache->dev, &io->req);
+        cache->stats.writes++;
+    }
+
+    mutex_release(&cache->lock);
+    if (atomic_add(&cache->wb_pending, -1) != 1)
+        event_wait(&cache->wb_done);
+    mutex_acquire(&cache->lock);
+
+    while ((io = list_remove_head_type(&ios, struct bcache_io, node)) != NULL) {
+        bool failed = (io->req.result != (ssize_t)(io->count * cache->block_size));
+
+        for (uint i = 0; i < io->count; i++) {
+            struct bcache_block *block = io->blocks[i];
+
+            block->is_writing = false;
+            if (failed && !block->is_dirty) {
+                /* keeps its old dirty time, retried once it ages out rather than right away */
+                block->is_dirty = true;
+                cache->dirty_count++;
+            } else if (!failed) {
+                cache->stats.wb_blocks++;
+            }
+            unref_block(cache, block);
+        }
+        cache->wb_active -= io->count;
+
+        if (failed) {
+            TRACEF("error %ld writing %u blocks at %u\n", (long)io->req.result,
+                   io->count, io->blocks[0]->blocknum);
+            err = ERR_IO;
+        }
+
+        free(io);
+    }
+
+    return err;
+}
+
+/* one pass of the flusher, writes whatever is due */
+static void flusher_pass(struct bcache *cache) {
+    struct bcache_block *block;
+    uint count = 0;
+
+    mutex_acquire(&cache->wb_lock);
+    mutex_acquire(&cache->lock);
+
+    reap_io(cache);
+
+    /* under pressure everything goes, otherwise only what has been dirty too long */
+    bool all = cache->wb_urgent ||
+               cache->dirty_count * 100 >= cache->count * cache->dirty_background;
+    cache->wb_urgent = false;
+
+    lk_time_t now = current_time();
+    list_for_every_entry(&cache->dirty_list, block, struct bcache_block, node) {
+        if (all || now - block->dirty_time >= cache->dirty_max_age)
+            cache->wb_blocks[count++] = block;
+    }
+
+    LTRACEF("%u of %u dirty blocks, all %u\n", count, cache->dirty_count, all);
+
+    cache->wb_status = NO_ERROR;
+    if (count > 0) {
+        cache->stats.wb_passes++;
+        cache->wb_status = writeback_blocks(cache, cache->wb_blocks, count);
+    }
+
+    /* anyone waiting for clean blocks gets another look */
+    event_signal(&cache->clean_event, false);
+
+    mutex_release(&cache->lock);
+    mutex_release(&cache->wb_lock);
+}
+
+static int bcache_flusher(void *arg) {
+    struct bcache *cache = arg;
+
+    for (;;) {
+        /* wake up often enough to catch blocks reaching the age limit */
+        lk_time_t age = cache->dirty_max_age;
+        event_wait_timeout(&cache->wb_kick, (age == INFINITE_TIME) ? INFINITE_TIME : MAX(age / 2, 1u));
+
+        if (cache->wb_exit)
+            break;
+
+        flusher_pass(cache);
+    }
+
+    return 0;
+}
+
+/*
+ * Get the flusher going and wait for a pass that wrote everything dirty to
+ * finish, returning its result. The mutex is dropped while waiting.
+ */
+static int wait_writeback(struct bcache *cache) {
+    DEBUG_ASSERT(is_mutex_held(&cache->lock));
+
+    cache->wb_urgent = true;
+    event_signal(&cache->wb_kick, false);
+
+    /* a pass already under way may have started before the request, wait for the next one */
+    do {
+        event_unsignal(&cache->clean_event);
+        mutex_release(&cache->lock);
+        event_wait(&cache->clean_event);
+        mutex_acquire(&cache->lock);
+    } while (cache->wb_urgent);
+
+    return cache->wb_status;
+}
+
+/* allocate a new block, the caller sets it up and hashes it */
+static struct bcache_block *alloc_block(struct bcache *cache) {
+    struct bcache_block *block;
+    bool stalled = false;
+
+    for (;;) {
+        /* pop one off the free list if it's present */
+        block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
+        if (block) {
+            LTRACEF("found block %p on free list\n", block);
             return block;
         }
+
+        /* the oldest clean block costs nothing to throw away */
+        block = list_remove_head_type(&cache->clean_list, struct bcache_block, node);
+        if (block)
+            break;
+
+        /* nothing we can have without a write, leave that to the flusher */
+        if (list_is_empty(&cache->dirty_list) && cache->wb_active == 0)
+            return NULL;
+
+        /* writeback is failing or getting nowhere, don't wait on it forever */
+        if (stalled) {
+            LTRACEF("writeback stalled\n");
+            return NULL;
+        }
+
+        LTRACEF("waiting for writeback\n");
+
+        cache->stats.alloc_stalls++;
+        uint32_t written = cache->stats.wb_blocks;
+        int err = wait_writeback(cache);
+        reap_io(cache);
+        stalled = (err < 0 || cache->stats.wb_blocks == written);
+    }
+
+    LTRACEF("evicting %p, num %u\n", block, block->blocknum);
+
+    if (block->is_readahead)
+        cache->stats.ra_wasted++;
+
+    DEBUG_ASSERT(block->ref_count == 0);
+    DEBUG_ASSERT(!block->is_dirty);
+    list_delete(&block->hash_node);
+
+    return block;
+}
+
+/* set up a block to be read in, the read holds a reference until it is retired */
+static void prepare_fill(struct bcache *cache, struct bcache_io *io,
+                         struct bcache_block *block, bnum_t blocknum) {
+    block->blocknum = blocknum;
+    block->ref_count++;
+    block->is_dirty = false;
+    block->is_valid = false;
+    block->is_busy = true;
+    block->is_readahead = false;
+    block->ra_marker = false;
+    event_unsignal(&block->io_event);
+    list_add_head(&cache->hash[hash_bucket(cache, blocknum)], &block->hash_node);
+
+    io->iov[io->count].iov_base = block->ptr;
+    io->iov[io->count].iov_len = cache->block_size;
+    io->blocks[io->count++] = block;
+}
+
+/*
+ * Queue a read starting at blocknum. If block is passed it is the slot for
+ * blocknum, already referenced by the caller. Up to ra_count blocks after it
+ * that aren't cached already are read ahead in the same transfer.
+ */
+static status_t start_read(struct bcache *cache, struct bcache_block *block,
+                           bnum_t blocknum, uint ra_count) {
+    struct bcache_io *io = malloc(sizeof(struct bcache_io));
+    if (!io)
+        return ERR_NO_MEMORY;
+
+    io->cache = cache;
+    io->count = 0;
+    if (block)
+        prepare_fill(cache, io, block, blocknum);
+
+    bnum_t next = blocknum + (block ? 1 : 0);
+    uint ra_blocks = 0;
+    for (; ra_blocks < ra_count && next < cache->last_block; ra_blocks++, next++) {
+        /* stop at the first hole in the run, the read has to be contiguous */
+        if (find_block(cache, next))
+            break;
+
+        struct bcache_block *ra = alloc_ra_block(cache);
+        if (!ra)
+            break;
+
+        prepare_fill(cache, io, ra, next);
+        ra->is_readahead = true;
+    }
+
+    if (io->count == 0) {
+        free(io);
+        return NO_ERROR;
+    }
+
+    if (ra_blocks > 0) {
+        /* about halfway in, leaves the next window a head start */
+        io->blocks[io->count - (ra_blocks + 1) / 2]->ra_marker = true;
+        cache->ra_next = next;
+        cache->stats.ra_reads++;
+        cache->stats.ra_blocks += ra_blocks;
     }
+    cache->stats.reads++;
 
-    return NULL;
+    LTRACEF("block %u, count %u, readahead %u\n", io->blocks[0]->blocknum, io->count, ra_blocks);
+
+    bio_request_init(&io->req, false, (off_t)io->blocks[0]->blocknum * cache->block_size,
+                     io->iov, io->count);
+    io->req.callback = &bcache_io_callback;
+    io->req.arg = io;
+    bio_submit(cache->dev, &io->req);
+
+    return NO_ERROR;
 }
 
-static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum) {
-    int err;
+/* take a reference to a block found in the cache and wait for it to be read in */
+static struct bcache_block *use_cached_block(struct bcache *cache, struct bcache_block *block,
+                                             bool sequential) {
+    ref_block(block);
+
+    if (block->is_readahead) {
+        block->is_readahead = false;
+        cache->stats.ra_hits++;
+    }
+
+    /* the stream is eating into the window, get the next one going */
+    if (block->ra_marker) {
+        block->ra_marker = false;
+        if (sequential && cache->ra_max > 0) {
+            cache->ra_window = MIN(MAX(cache->ra_window * 2, BCACHE_RA_MIN), cache->ra_max);
+            start_read(cache, NULL, MAX(cache->ra_next, block->blocknum + 1), cache->ra_window);
+        }
+    }
 
+    wait_block(cache, block);
+    if (!block->is_valid) {
+        unref_block(cache, block);
+        return NULL;
+    }
+
+    return block;
+}
+
+/*
+ * Look up a block and take a reference to it, allocating it if it isn't present.
+ * A newly allocated block is read in from the device if fill is set, otherwise
+ * its contents are left for the caller to initialize. Returns NULL on error.
+ */
+static struct bcache_block *get_block(struct bcache *cache, uint blocknum, bool fill) {
     LTRACEF("block %u\n", blocknum);
 
+    DEBUG_ASSERT(is_mutex_held(&cache->lock));
+
+    /* pick up any reads that finished since we last looked */
+    reap_io(cache);
+
+    bool sequential = (blocknum == cache->seq_next);
+    cache->seq_next = blocknum + 1;
+
     /* see if it's already in the cache */
     struct bcache_block *block = find_block(cache, blocknum);
-    if (block == NULL) {
-        LTRACEF("wasn't allocated\n");
+    if (block) {
+        cache->stats.hits++;
+        return use_cached_block(cache, block, sequential);
+    }
 
-        /* allocate a new block and fill it */
-        block = alloc_block(cache);
-        DEBUG_ASSERT(block);
+    cache->stats.misses++;
 
-        LTRACEF("wasn't allocated, new block %p\n", block);
+    /* allocate a new block and fill it */
+    block = alloc_block(cache);
+    if (!block)
+        return NULL;
 
+    /* alloc_block() may have dropped the lock, someone else may have brought it in meanwhile */
+    struct bcache_block *found = find_block(cache, blocknum);
+    if (found) {
+        list_add_head(&cache->free_list, &block->node);
+        return use_cached_block(cache, found, sequential);
+    }
+
+    LTRACEF("wasn't allocated, new block %p\n", block);
+
+    block->ref_count = 1;
+
+    if (!fill) {
         block->blocknum = blocknum;
-        err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
-        if (err < 0) {
-            /* free the block, return an error */
-            list_add_tail(&cache->free_list, &block->node);
-            return NULL;
-        }
+        block->is_dirty = false;
+        block->is_valid = true;
+        block->is_readahead = false;
+        block->ra_marker = false;
+        list_add_head(&cache->hash[hash_bucket(cache, blocknum)], &block->hash_node);
+        return block;
+    }
 
-        cache->stats.reads++;
+    /* a miss that continues a run grows the readahead window, anything else resets it */
+    if (sequential && cache->ra_max > 0) {
+        cache->ra_window = MIN(MAX(cache->ra_window * 2, BCACHE_RA_MIN), cache->ra_max);
+    } else {
+        cache->ra_window = 0;
+    }
+
+    status_t err = start_read(cache, block, blocknum, cache->ra_window);
+    if (err < 0) {
+        unref_block(cache, block);
+        return NULL;
+    }
+
+    wait_block(cache, block);
+    if (!block->is_valid) {
+        unref_block(cache, block);
+        return NULL;
     }
 
     DEBUG_ASSERT(block->blocknum == blocknum);
@@ -195,39 +846,58 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
     return block;
 }
 
+/* past the dirty limit the caller waits for a writeback pass before going on */
+static void throttle_dirty(struct bcache *cache) {
+    if (cache->dirty_count * 100 > cache->count * cache->dirty_limit) {
+        cache->stats.dirty_stalls++;
+        wait_writeback(cache);
+    }
+}
+
 int bcache_read_block(bcache_t _cache, void *buf, uint blocknum) {
     struct bcache *cache = _cache;
+    int err = 0;
 
     LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    mutex_acquire(&cache->lock);
+
+    struct bcache_block *block = get_block(cache, blocknum, true);
     if (block == NULL) {
         /* error */
-        return -1;
+        err = -1;
+    } else {
+        memcpy(buf, block->ptr, cache->block_size);
+        unref_block(cache, block);
     }
 
-    memcpy(buf, block->ptr, cache->block_size);
-    return 0;
+    mutex_release(&cache->lock);
+
+    return err;
 }
 
 int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum) {
     struct bcache *cache = _cache;
+    int err = 0;
 
     LTRACEF("ptr %p, blocknum %u\n", ptr, blocknum);
 
     DEBUG_ASSERT(ptr);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    mutex_acquire(&cache->lock);
+
+    /* the reference keeps it from being freed until the put */
+    struct bcache_block *block = get_block(cache, blocknum, true);
     if (block == NULL) {
         /* error */
-        return -1;
+        err = -1;
+    } else {
+        *ptr = block->ptr;
     }
 
-    /* increment the ref count to keep it from being freed */
-    block->ref_count++;
-    *ptr = block->ptr;
+    mutex_release(&cache->lock);
 
-    return 0;
+    return err;
 }
 
 int bcache_put_block(bcache_t _cache, uint blocknum) {
@@ -235,13 +905,17 @@ int bcache_put_block(bcache_t _cache, uint blocknum) {
 
     LTRACEF("blocknum %u\n", blocknum);
 
+    mutex_acquire(&cache->lock);
+
     struct bcache_block *block = find_block(cache, blocknum);
 
     /* be pretty hard on the caller for now */
     DEBUG_ASSERT(block);
     DEBUG_ASSERT(block->ref_count > 0);
 
-    block->ref_count--;
+    unref_block(cache, block);
+
+    mutex_release(&cache->lock);
 
     return 0;
 }
@@ -251,15 +925,19 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum) {
     struct bcache *cache = priv;
     struct bcache_block *block;
 
+    mutex_acquire(&cache->lock);
+
     block = find_block(cache, blocknum);
-    if (!block) {
+    if (!block || !block->is_valid) {
         err = -1;
         goto exit;
     }
 
-    block->is_dirty = true;
+    set_dirty(cache, block);
+    throttle_dirty(cache);
     err = 0;
 exit:
+    mutex_release(&cache->lock);
     return (err);
 }
 
@@ -268,42 +946,66 @@ int bcache_zero_block(bcache_t priv, uint blocknum) {
     struct bcache *cache = priv;
     struct bcache_block *block;
 
-    block = find_block(cache, blocknum);
-    if (!block) {
-        block = alloc_block(cache);
-        if (!block) {
-            err = -1;
-            goto exit;
-        }
+    mutex_acquire(&cache->lock);
 
-        block->blocknum = blocknum;
+    block = get_block(cache, blocknum, false);
+    if (!block) {
+        err = -1;
+        goto exit;
     }
 
     memset(block->ptr, 0, cache->block_size);
-    block->is_dirty = true;
+    set_dirty(cache, block);
+    unref_block(cache, block);
+    throttle_dirty(cache);
     err = 0;
 exit:
+    mutex_release(&cache->lock);
     return (err);
 }
 
 int bcache_flush(bcache_t priv) {
-    int err;
+    int err = 0;
     struct bcache *cache = priv;
-    struct bcache_block *block;
+    uint count = 0;
 
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        if (block->is_dirty) {
-            err = flush_block(cache, block);
-            if (err)
-                goto exit;
-        }
+    /* waits out any pass the flusher has going */
+    mutex_acquire(&cache->wb_lock);
+    mutex_acquire(&cache->lock);
+
+    /* referenced blocks aren't on the dirty list, so look at all of them */
+    for (int i = 0; i < cache->count; i++) {
+        struct bcache_block *block = &cache->blocks[i];
+
+        if (block->is_dirty)
+            cache->wb_blocks[count++] = block;
     }
 
-    err = 0;
-exit:
+    if (count > 0)
+        err = writeback_blocks(cache, cache->wb_blocks, count);
+
+    event_signal(&cache->clean_event, false);
+
+    mutex_release(&cache->lock);
+    mutex_release(&cache->wb_lock);
     return (err);
 }
 
+void bcache_set_writeback(bcache_t priv, uint dirty_background, uint dirty_limit, lk_time_t max_age) {
+    struct bcache *cache = priv;
+
+    DEBUG_ASSERT(dirty_background <= dirty_limit && dirty_limit <= 100);
+
+    mutex_acquire(&cache->lock);
+    cache->dirty_background = dirty_background;
+    cache->dirty_limit = dirty_limit;
+    cache->dirty_max_age = max_age;
+    mutex_release(&cache->lock);
+
+    /* let the flusher pick up the new period */
+    event_signal(&cache->wb_kick, true);
+}
+
 void bcache_dump(bcache_t priv, const char *name) {
     uint32_t finds;
     struct bcache *cache = priv;
@@ -314,9 +1016,26 @@ void bcache_dump(bcache_t priv, const char *name) {
            name,
            cache->stats.hits,
            finds ? (cache->stats.hits * 100) / finds : 0,
-           cache->stats.hits ? cache->stats.depth / cache->stats.hits : 0,
+           cache->stats.lookups ? cache->stats.depth / cache->stats.lookups : 0,
            cache->stats.misses,
            finds ? (cache->stats.misses * 100) / finds : 0,
            cache->stats.reads,
            cache->stats.writes);
+    printf("%s: readahead window=%u/%u reads=%u blocks=%u hits=%u(%u%%) wasted=%u\n",
+           name,
+           cache->ra_window,
+           cache->ra_max,
+           cache->stats.ra_reads,
+           cache->stats.ra_blocks,
+           cache->stats.ra_hits,
+           cache->stats.ra_blocks ? (cache->stats.ra_hits * 100) / cache->stats.ra_blocks : 0,
+           cache->stats.ra_wasted);
+    printf("%s: writeback dirty=%u/%d passes=%u blocks=%u alloc stalls=%u dirty stalls=%u\n",
+           name,
+           cache->dirty_count,
+           cache->count,
+           cache->stats.wb_passes,
+           cache->stats.wb_blocks,
+           cache->stats.alloc_stalls,
+           cache->stats.dirty_stalls);
 }
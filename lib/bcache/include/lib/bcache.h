@@ -20,3 +20,14 @@ int bcache_read_block(bcache_t, void *, uint block);
 int bcache_get_block(bcache_t, void **, uint block);
 int bcache_put_block(bcache_t, uint block);
 
+int bcache_mark_block_dirty(bcache_t, uint block);
+int bcache_zero_block(bcache_t, uint block);
+int bcache_flush(bcache_t);
+
+// writeback tuning, in percent of the cache: the flusher starts writing once
+// dirty_background is dirty and writers wait for it past dirty_limit. No block
+// stays dirty for much longer than max_age milliseconds.
+void bcache_set_writeback(bcache_t, uint dirty_background, uint dirty_limit, lk_time_t max_age);
+
+void bcache_dump(bcache_t, const char *name);
+
@@ -15,7 +15,7 @@
 #include <assert.h>
 #include <lk/list.h>
 #include <lk/pow2.h>
-#include <kernel/mutex.h>
+#include <kernel/rwlock.h>
 #include <lk/init.h>
 #include <arch/atomic.h>
 
@@ -23,10 +23,10 @@
 
 static struct {
     struct list_node list;
-    mutex_t lock;
+    rwlock_t lock;
 } bdevs = {
     .list = LIST_INITIAL_VALUE(bdevs.list),
-    .lock = MUTEX_INITIAL_VALUE(bdevs.lock),
+    .lock = RWLOCK_INITIAL_VALUE(bdevs.lock),
 };
 
 /* default implementation is to use the read_block hook to 'deblock' the device */
@@ -279,6 +279,37 @@ static ssize_t bio_default_write_block(struct bdev *dev, const void *buf, bnum_t
     return ERR_NOT_SUPPORTED;
 }
 
+/* default async implementation, carries out the request synchronously with the read/write hooks */
+static void bio_default_submit(struct bdev *dev, bio_request_t *req, off_t offset) {
+    size_t remaining = req->len;
+    ssize_t bytes = 0;
+    ssize_t err = 0;
+
+    for (uint i = 0; i < req->iov_count && remaining > 0; i++) {
+        size_t len = MIN(req->iov[i].iov_len, remaining);
+        if (len == 0)
+            continue;
+
+        if (req->write) {
+            err = dev->write(dev, req->iov[i].iov_base, offset, len);
+        } else {
+            err = dev->read(dev, req->iov[i].iov_base, offset, len);
+        }
+        if (err < 0)
+            break;
+
+        bytes += err;
+        offset += err;
+        remaining -= err;
+
+        /* short transfer, stop here */
+        if ((size_t)err < len)
+            break;
+    }
+
+    bio_request_complete(req, (err < 0) ? err : bytes);
+}
+
 static void bdev_inc_ref(bdev_t *dev) {
     LTRACEF("Add ref \"%s\" %d -> %d\n", dev->name, dev->ref, dev->ref + 1);
     atomic_add(&dev->ref, 1);
@@ -335,7 +366,7 @@ bdev_t *bio_open(const char *name) {
 
     /* see if it's in our list */
     bdev_t *entry;
-    mutex_acquire(&bdevs.lock);
+    rwlock_acquire_read(&bdevs.lock);
     list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
         DEBUG_ASSERT(entry->ref > 0);
         if (!strcmp(entry->name, name)) {
@@ -344,7 +375,7 @@ bdev_t *bio_open(const char *name) {
             break;
         }
     }
-    mutex_release(&bdevs.lock);
+    rwlock_release_read(&bdevs.lock);
 
     return bdev;
 }
@@ -361,12 +392,12 @@ ssize_t bio_read(bdev_t *dev, void *buf, off_t offset, size_t len) {
     DEBUG_ASSERT(dev && dev->ref > 0);
     DEBUG_ASSERT(buf);
 
-    /* range check */
-    len = bio_trim_range(dev, offset, len);
-    if (len == 0)
-        return 0;
+    iovec_t iov = { .iov_base = buf, .iov_len = len };
+    bio_request_t req;
+    bio_request_init(&req, false, offset, &iov, 1);
 
-    return dev->read(dev, buf, offset, len);
+    bio_submit(dev, &req);
+    return bio_request_wait(&req);
 }
 
 ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count) {
@@ -389,12 +420,12 @@ ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len) {
     DEBUG_ASSERT(dev && dev->ref > 0);
     DEBUG_ASSERT(buf);
 
-    /* range check */
-    len = bio_trim_range(dev, offset, len);
-    if (len == 0)
-        return 0;
+    iovec_t iov = { .iov_base = (void *)buf, .iov_len = len };
+    bio_request_t req;
+    bio_request_init(&req, true, offset, &iov, 1);
 
-    return dev->write(dev, buf, offset, len);
+    bio_submit(dev, &req);
+    return bio_request_wait(&req);
 }
 
 ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count) {
@@ -434,6 +465,77 @@ int bio_ioctl(bdev_t *dev, int request, void *argp) {
     }
 }
 
+void bio_request_init(bio_request_t *req, bool write, off_t offset,
+                      const iovec_t *iov, uint iov_count) {
+    DEBUG_ASSERT(req);
+
+    req->write = write;
+    req->offset = offset;
+    req->iov = iov;
+    req->iov_count = iov_count;
+    req->callback = NULL;
+    req->arg = NULL;
+    event_init(&req->event, false, 0);
+    req->dev = NULL;
+    req->len = 0;
+    req->result = 0;
+}
+
+void bio_submit(bdev_t *dev, bio_request_t *req) {
+    LTRACEF("dev '%s', req %p, write %u, offset %lld, iov %p, count %u\n", dev->name, req,
+            req->write, req->offset, req->iov, req->iov_count);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(req);
+
+    req->dev = dev;
+
+    ssize_t len = iovec_size(req->iov, req->iov_count);
+    if (len < 0) {
+        bio_request_complete(req, len);
+        return;
+    }
+
+    /* range check */
+    req->len = bio_trim_range(dev, req->offset, len);
+    if (req->len == 0) {
+        bio_request_complete(req, 0);
+        return;
+    }
+
+    /* the driver only sees whole blocks, anything else goes through the blocking hooks */
+    if (dev->submit &&
+            req->len == (size_t)len &&
+            IS_ALIGNED(req->offset, dev->block_size) &&
+            IS_ALIGNED(req->len, dev->block_size)) {
+        dev->submit(dev, req, req->offset);
+    } else {
+        bio_default_submit(dev, req, req->offset);
+    }
+}
+
+ssize_t bio_request_wait(bio_request_t *req) {
+    DEBUG_ASSERT(req && !req->callback);
+
+    event_wait(&req->event);
+    event_destroy(&req->event);
+
+    return req->result;
+}
+
+void bio_request_complete(bio_request_t *req, ssize_t result) {
+    LTRACEF("req %p, result %ld\n", req, (long)result);
+
+    req->result = result;
+
+    /* the request belongs to the caller again once this is done, don't touch it after */
+    if (req->callback) {
+        req->callback(req);
+    } else {
+        event_signal(&req->event, false);
+    }
+}
+
 void bio_initialize_bdev(bdev_t *dev,
                          const char *name,
                          size_t block_size,
@@ -507,6 +609,7 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->write_block = bio_default_write_block;
     dev->erase = bio_default_erase;
     dev->close = NULL;
+    dev->submit = NULL;
 }
 
 void bio_register_device(bdev_t *dev) {
@@ -516,9 +619,9 @@ void bio_register_device(bdev_t *dev) {
 
     bdev_inc_ref(dev);
 
-    mutex_acquire(&bdevs.lock);
+    rwlock_acquire_write(&bdevs.lock);
     list_add_tail(&bdevs.list, &dev->node);
-    mutex_release(&bdevs.lock);
+    rwlock_release_write(&bdevs.lock);
 }
 
 void bio_unregister_device(bdev_t *dev) {
@@ -527,9 +630,9 @@ void bio_unregister_device(bdev_t *dev) {
     LTRACEF(" '%s'\n", dev->name);
 
     // remove it from the list
-    mutex_acquire(&bdevs.lock);
+    rwlock_acquire_write(&bdevs.lock);
     list_delete(&dev->node);
-    mutex_release(&bdevs.lock);
+    rwlock_release_write(&bdevs.lock);
 
     bdev_dec_ref(dev); // remove the ref the list used to have
 }
@@ -537,7 +640,7 @@ void bio_unregister_device(bdev_t *dev) {
 void bio_dump_devices(void) {
     printf("block devices:\n");
     bdev_t *entry;
-    mutex_acquire(&bdevs.lock);
+    rwlock_acquire_read(&bdevs.lock);
     list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
 
         printf("\t%s, size %lld, bsize %zd, ref %d",
@@ -556,5 +659,5 @@ void bio_dump_devices(void) {
 
         printf("\n");
     }
-    mutex_release(&bdevs.lock);
+    rwlock_release_read(&bdevs.lock);
 }
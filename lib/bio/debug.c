@@ -15,6 +15,8 @@
 #include <lib/bio.h>
 #include <platform.h>
 #include <kernel/thread.h>
+#include <kernel/event.h>
+#include <arch/atomic.h>
 
 #if WITH_LIB_CKSUM
 #include <lib/cksum.h>
@@ -26,6 +28,8 @@
 #define DMA_ALIGNMENT (CACHE_LINE)
 #define THREE_BYTE_ADDR_BOUNDARY (16777216)
 #define SUB_ERASE_TEST_SAMPLES (32)
+#define ASYNC_TEST_REQUESTS (8)
+#define ASYNC_TEST_BLOCKS (2)
 
 #if LK_DEBUGLEVEL > 0
 static int cmd_bio(int argc, const console_cmd_args *argv);
@@ -392,6 +396,95 @@ static ssize_t write_test(bdev_t *device) {
     return num_errors;
 }
 
+struct async_test_batch {
+    volatile int outstanding;
+    event_t done;
+};
+
+static void async_test_callback(bio_request_t *req) {
+    struct async_test_batch *batch = req->arg;
+
+    if (atomic_add(&batch->outstanding, -1) == 1)
+        event_signal(&batch->done, false);
+}
+
+// reads back what write_test left behind with batches of overlapping scatter reads,
+// returns the number of blocks that didn't match.
+static ssize_t async_read_test(bdev_t *device) {
+    const size_t req_len = device->block_size * ASYNC_TEST_BLOCKS;
+    const size_t split = device->block_size / 2;
+    uint8_t *buf = memalign(DMA_ALIGNMENT, req_len * ASYNC_TEST_REQUESTS);
+    bio_request_t *reqs = calloc(ASYNC_TEST_REQUESTS, sizeof(bio_request_t));
+    iovec_t *iovs = calloc(ASYNC_TEST_REQUESTS * 2, sizeof(iovec_t));
+    ssize_t num_errors = 0;
+
+    if (!buf || !reqs || !iovs) {
+        num_errors = ERR_NO_MEMORY;
+        goto finish;
+    }
+
+    struct async_test_batch batch;
+    event_init(&batch.done, false, 0);
+
+    for (bnum_t bnum = 0; bnum < device->block_count; bnum += ASYNC_TEST_BLOCKS * ASYNC_TEST_REQUESTS) {
+        uint count = MIN(ASYNC_TEST_REQUESTS, (device->block_count - bnum + ASYNC_TEST_BLOCKS - 1) / ASYNC_TEST_BLOCKS);
+
+        memset(buf, 0, req_len * ASYNC_TEST_REQUESTS);
+        event_unsignal(&batch.done);
+        batch.outstanding = count;
+
+        // every request scatters into two pieces, the split lands in the middle of a block
+        for (uint i = 0; i < count; i++) {
+            uint8_t *ptr = buf + i * req_len;
+            iovs[i * 2].iov_base = ptr;
+            iovs[i * 2].iov_len = split;
+            iovs[i * 2 + 1].iov_base = ptr + split;
+            iovs[i * 2 + 1].iov_len = req_len - split;
+
+            bio_request_init(&reqs[i], false, ((off_t)bnum + i * ASYNC_TEST_BLOCKS) * device->block_size,
+                             &iovs[i * 2], 2);
+            reqs[i].callback = async_test_callback;
+            reqs[i].arg = &batch;
+        }
+        for (uint i = 0; i < count; i++) {
+            bio_submit(device, &reqs[i]);
+        }
+
+        event_wait(&batch.done);
+
+        for (uint i = 0; i < count; i++) {
+            if (reqs[i].result < 0) {
+                num_errors = reqs[i].result;
+                goto finish;
+            }
+
+            for (uint b = 0; b < ASYNC_TEST_BLOCKS; b++) {
+                bnum_t block = bnum + i * ASYNC_TEST_BLOCKS + b;
+                if (block >= device->block_count)
+                    break;
+
+                const uint8_t *data = buf + i * req_len + b * device->block_size;
+                uint8_t expected = get_signature(block);
+                for (size_t j = 0; j < device->block_size; j++) {
+                    if (data[j] != expected) {
+                        num_errors++;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    event_destroy(&batch.done);
+
+finish:
+    free(iovs);
+    free(reqs);
+    free(buf);
+
+    return num_errors;
+}
+
 static status_t memory_mapped_test(bdev_t *device) {
     status_t retcode = NO_ERROR;
 
@@ -517,6 +610,13 @@ static int bio_test_device(bdev_t *device) {
         return -1;
     }
 
+    printf("Testing async reads...\n");
+    num_errors = async_read_test(device);
+    printf("Discovered %ld error(s) while testing async reads.\n", num_errors);
+    if (num_errors) {
+        return -1;
+    }
+
     printf ("Testing sub-erase...\n");
     bool success = sub_erase_test(device, SUB_ERASE_TEST_SAMPLES);
     if (!success) {
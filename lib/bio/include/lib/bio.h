@@ -8,8 +8,10 @@
 #pragma once
 
 #include <assert.h>
+#include <iovec.h>
 #include <sys/types.h>
 #include <lk/list.h>
+#include <kernel/event.h>
 
 __BEGIN_CDECLS
 
@@ -26,6 +28,31 @@ typedef struct bio_erase_geometry_info {
     size_t erase_shift;
 } bio_erase_geometry_info_t;
 
+struct bdev;
+
+/* an asynchronous transfer, owned by the caller until it completes */
+typedef struct bio_request {
+    /* filled in by the caller, see bio_request_init() */
+    bool write;
+    off_t offset;
+    const iovec_t *iov;
+    uint iov_count;
+
+    /* called exactly once when the transfer finishes, possibly from interrupt
+     * context. If NULL, event is signaled instead for bio_request_wait(). */
+    void (*callback)(struct bio_request *req);
+    void *arg;
+    event_t event;
+
+    /* filled in by bio */
+    struct bdev *dev;
+    size_t len;     /* bytes to transfer after trimming to the device */
+    ssize_t result; /* bytes transferred or error, valid once complete */
+
+    /* scratch space for the device driver while the request is in flight */
+    uint64_t driver_state[8];
+} bio_request_t;
+
 typedef struct bdev {
     struct list_node node;
     volatile int ref;
@@ -53,6 +80,11 @@ typedef struct bdev {
     ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
     int (*ioctl)(struct bdev *, int request, void *argp);
     void (*close)(struct bdev *);
+
+    /* optional native async hook. Only handed block aligned requests that lie
+     * entirely within the device, transfers req->len bytes at offset and calls
+     * bio_request_complete() when done. */
+    void (*submit)(struct bdev *, bio_request_t *req, off_t offset);
 } bdev_t;
 
 /* user api */
@@ -65,6 +97,18 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
 
+/* async api */
+void bio_request_init(bio_request_t *req, bool write, off_t offset,
+                      const iovec_t *iov, uint iov_count);
+/* start a transfer. Completion is always reported through the request, even
+ * if it fails immediately or is short because it ran off the end of the device. */
+void bio_submit(bdev_t *dev, bio_request_t *req);
+/* block until a request submitted without a callback completes, returns its result */
+ssize_t bio_request_wait(bio_request_t *req);
+
+/* used by drivers to finish a request handed to their submit hook */
+void bio_request_complete(bio_request_t *req, ssize_t result);
+
 /* register a block device */
 void bio_register_device(bdev_t *dev);
 void bio_unregister_device(bdev_t *dev);
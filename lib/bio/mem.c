@@ -61,6 +61,30 @@ static ssize_t mem_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t b
     return count * BLOCKSIZE;
 }
 
+static void mem_bdev_submit(struct bdev *bdev, bio_request_t *req, off_t offset) {
+    mem_bdev_t *mem = (mem_bdev_t *)bdev;
+    uint8_t *ptr = (uint8_t *)mem->ptr + offset;
+    size_t remaining = req->len;
+
+    LTRACEF("bdev %s, req %p, offset %lld, len %zu\n", bdev->name, req, offset, req->len);
+
+    /* nothing to wait for, copy each piece and complete right away */
+    for (uint i = 0; i < req->iov_count && remaining > 0; i++) {
+        size_t len = MIN(req->iov[i].iov_len, remaining);
+
+        if (req->write) {
+            memcpy(ptr, req->iov[i].iov_base, len);
+        } else {
+            memcpy(req->iov[i].iov_base, ptr, len);
+        }
+
+        ptr += len;
+        remaining -= len;
+    }
+
+    bio_request_complete(req, req->len);
+}
+
 int create_membdev(const char *name, void *ptr, size_t len) {
     mem_bdev_t *mem = malloc(sizeof(mem_bdev_t));
 
@@ -74,6 +98,7 @@ int create_membdev(const char *name, void *ptr, size_t len) {
     mem->dev.read_block = mem_bdev_read_block;
     mem->dev.write = mem_bdev_write;
     mem->dev.write_block = mem_bdev_write_block;
+    mem->dev.submit = mem_bdev_submit;
 
     /* register it */
     bio_register_device(&mem->dev);
@@ -58,6 +58,13 @@ static ssize_t subdev_erase(struct bdev *_dev, off_t offset, size_t len) {
     return bio_erase(subdev->parent, offset + subdev->offset * subdev->dev.block_size, len);
 }
 
+static void subdev_submit(struct bdev *_dev, bio_request_t *req, off_t offset) {
+    subdev_t *subdev = (subdev_t *)_dev;
+
+    /* same block size and already range checked, hand it straight down */
+    subdev->parent->submit(subdev->parent, req, offset + subdev->offset * subdev->dev.block_size);
+}
+
 static void subdev_close(struct bdev *_dev) {
     subdev_t *subdev = (subdev_t *)_dev;
 
@@ -162,6 +169,8 @@ status_t bio_publish_subdevice(const char *parent_dev,
     sub->dev.write_block = &subdev_write_block;
     sub->dev.erase = &subdev_erase;
     sub->dev.close = &subdev_close;
+    if (parent->submit)
+        sub->dev.submit = &subdev_submit;
 
     bio_register_device(&sub->dev);
 
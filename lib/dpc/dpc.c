@@ -8,11 +8,12 @@
 #include <lk/debug.h>
 #include <stddef.h>
 #include <lk/list.h>
-#include <malloc.h>
 #include <lk/err.h>
 #include <lib/dpc.h>
+#include <lib/kmem_cache.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
+#include <kernel/spinlock.h>
 #include <lk/init.h>
 
 struct dpc {
@@ -22,7 +23,11 @@ struct dpc {
     void *arg;
 };
 
+static kmem_cache_t dpc_cache =
+    KMEM_CACHE_INITIAL_VALUE(dpc_cache, "dpc", sizeof(struct dpc), __alignof(struct dpc), NULL);
+
 static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
+static spin_lock_t dpc_lock = SPIN_LOCK_INITIAL_VALUE;
 static event_t dpc_event;
 
 static int dpc_thread_routine(void *arg);
@@ -30,17 +35,20 @@ static int dpc_thread_routine(void *arg);
 status_t dpc_queue(dpc_callback cb, void *arg, uint flags) {
     struct dpc *dpc;
 
-    dpc = malloc(sizeof(struct dpc));
+    dpc = kmem_cache_alloc(&dpc_cache);
 
     if (dpc == NULL)
         return ERR_NO_MEMORY;
 
     dpc->cb = cb;
     dpc->arg = arg;
-    enter_critical_section();
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&dpc_lock, state);
     list_add_tail(&dpc_list, &dpc->node);
+    spin_unlock_irqrestore(&dpc_lock, state);
+
     event_signal(&dpc_event, (flags & DPC_FLAG_NORESCHED) ? false : true);
-    exit_critical_section();
 
     return NO_ERROR;
 }
@@ -49,17 +57,18 @@ static int dpc_thread_routine(void *arg) {
     for (;;) {
         event_wait(&dpc_event);
 
-        enter_critical_section();
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&dpc_lock, state);
         struct dpc *dpc = list_remove_head_type(&dpc_list, struct dpc, node);
         if (!dpc)
             event_unsignal(&dpc_event);
-        exit_critical_section();
+        spin_unlock_irqrestore(&dpc_lock, state);
 
         if (dpc) {
 //          dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
             dpc->cb(dpc->arg);
 
-            free(dpc);
+            kmem_cache_free(&dpc_cache, dpc);
         }
     }
 
@@ -14,7 +14,8 @@
 #include <lib/fs.h>
 #include <lib/bio.h>
 #include <lk/init.h>
-#include <kernel/mutex.h>
+#include <kernel/rwlock.h>
+#include <arch/atomic.h>
 
 #define LOCAL_TRACE 0
 
@@ -38,7 +39,7 @@ struct dirhandle {
     struct fs_mount *mount;
 };
 
-static mutex_t mount_lock = MUTEX_INITIAL_VALUE(mount_lock);
+static rwlock_t mount_lock = RWLOCK_INITIAL_VALUE(mount_lock);
 static struct list_node mounts = LIST_INITIAL_VALUE(mounts);
 static struct list_node fses = LIST_INITIAL_VALUE(fses);
 
@@ -61,7 +62,7 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
     struct fs_mount *mount;
     size_t pathlen = strlen(path);
 
-    mutex_acquire(&mount_lock);
+    rwlock_acquire_read(&mount_lock);
     list_for_every_entry(&mounts, mount, struct fs_mount, node) {
         size_t mountpathlen = strlen(mount->path);
         if (pathlen < mountpathlen)
@@ -73,22 +74,35 @@ static struct fs_mount *find_mount(const char *path, const char **trimmed_path)
             if (trimmed_path)
                 *trimmed_path = &path[mountpathlen];
 
-            mount->ref++;
+            /* other readers may be bumping it too */
+            atomic_add(&mount->ref, 1);
 
-            mutex_release(&mount_lock);
+            rwlock_release_read(&mount_lock);
             return mount;
         }
     }
 
-    mutex_release(&mount_lock);
+    rwlock_release_read(&mount_lock);
     return NULL;
 }
 
 // decrement the ref to the mount structure, which may
 // cause an unmount operation
 static void put_mount(struct fs_mount *mount) {
-    mutex_acquire(&mount_lock);
-    if ((--mount->ref) == 0) {
+    /* drop any ref but the last without the lock */
+    int ref = mount->ref;
+    while (ref > 1) {
+        int old = atomic_cmpxchg(&mount->ref, ref, ref - 1);
+        if (old == ref)
+            return;
+        ref = old;
+    }
+
+    /* it may be the last one. find_mount only takes new refs with the lock
+     * held for reading, so with it held for writing the count can't go back up
+     * and whoever takes it to zero here is the only one to see it */
+    rwlock_acquire_write(&mount_lock);
+    if (atomic_add(&mount->ref, -1) == 1) {
         list_delete(&mount->node);
         mount->api->unmount(mount->cookie);
         free(mount->path);
@@ -96,7 +110,7 @@ static void put_mount(struct fs_mount *mount) {
             bio_close(mount->dev);
         free(mount);
     }
-    mutex_release(&mount_lock);
+    rwlock_release_write(&mount_lock);
 }
 
 static status_t mount(const char *path, const char *device, const struct fs_api *api) {
@@ -140,7 +154,9 @@ static status_t mount(const char *path, const char *device, const struct fs_api
     mount->ref = 1;
     mount->api = api;
 
+    rwlock_acquire_write(&mount_lock);
     list_add_head(&mounts, &mount->node);
+    rwlock_release_write(&mount_lock);
 
     return 0;
 
@@ -7,6 +7,7 @@
  */
 #include <lk/debug.h>
 #include <lk/trace.h>
+#include <arch/ops.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,6 +24,9 @@
 // Allocation strategy takes place with a global mutex.  Freelist entries are
 // kept in linked lists with 8 different sizes per binary order of magnitude
 // and the header size is two words with eager coalescing on free.
+//
+// On SMP builds small objects are served from per cpu caches in front of the
+// global heap, see CMPCT_CPU_CACHE below.
 
 #ifdef DEBUG
 #define CMPCT_DEBUG
@@ -85,6 +89,45 @@ struct heap {
 // Heap static vars.
 static struct heap theheap;
 
+// Per cpu caches of small objects.  Each cpu keeps a short stack of free
+// objects for every 16 byte size class up to 256 bytes, only touched with
+// interrupts disabled on that cpu, so the common malloc/free of a small object
+// takes no lock.  Objects move between a cache and the heap in batches under a
+// single lock acquisition.  Cached objects still look allocated to the heap.
+#ifndef CMPCT_CPU_CACHE
+#if WITH_SMP
+#define CMPCT_CPU_CACHE 1
+#else
+#define CMPCT_CPU_CACHE 0
+#endif
+#endif
+
+#if CMPCT_CPU_CACHE
+#define CPU_CACHE_CLASS_SIZE 16
+#define CPU_CACHE_CLASSES 16
+#define CPU_CACHE_MAX_SIZE (CPU_CACHE_CLASS_SIZE * CPU_CACHE_CLASSES)
+#define CPU_CACHE_DEPTH 16
+#define CPU_CACHE_BATCH (CPU_CACHE_DEPTH / 2)
+
+struct cpu_cache {
+    struct {
+        unsigned count;
+        void *objs[CPU_CACHE_DEPTH];
+    } classes[CPU_CACHE_CLASSES];
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long drains;
+} __ALIGNED(CACHE_LINE);
+
+static struct cpu_cache cpu_caches[SMP_MAX_CPUS];
+
+// The self tests depend on exact heap layout, so they turn the caches off.
+static bool cpu_cache_enabled = true;
+
+static void cpu_cache_drain_local(void);
+#endif
+
 static ssize_t heap_grow(size_t len, free_t **bucket);
 
 static void lock(void) {
@@ -119,6 +162,57 @@ void cmpct_dump(void) {
             dump_free(&free_area->header);
         }
     }
+#if CMPCT_CPU_CACHE
+    dprintf(INFO, "\tcpu caches%s:\n", cpu_cache_enabled ? "" : " (disabled)");
+    for (unsigned cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        const struct cpu_cache *cache = &cpu_caches[cpu];
+        unsigned cached = 0;
+        for (int i = 0; i < CPU_CACHE_CLASSES; i++) {
+            cached += cache->classes[i].count;
+        }
+        dprintf(INFO, "\t\tcpu %u: cached %u, hits %lu, misses %lu, drains %lu\n",
+                cpu, cached, cache->hits, cache->misses, cache->drains);
+    }
+#endif
+    unlock();
+}
+
+// Compare the largest free area with the total free space, per bucket and
+// for the heap as a whole.  A heap with plenty of free space but no large
+// areas left is fragmented.
+void cmpct_dump_frag(void) {
+    size_t total_free = 0;
+    size_t total_largest = 0;
+    unsigned total_count = 0;
+
+    lock();
+    dprintf(INFO, "Heap fragmentation (using cmpctmalloc):\n");
+    dprintf(INFO, "\t%6s %8s %12s %12s %12s\n", "bucket", "areas", "free", "smallest", "largest");
+    for (int i = 0; i < NUMBER_OF_BUCKETS; i++) {
+        size_t bytes = 0;
+        size_t smallest = SIZE_MAX;
+        size_t largest = 0;
+        unsigned count = 0;
+        for (free_t *free_area = theheap.free_lists[i]; free_area != NULL; free_area = free_area->next) {
+            size_t size = free_area->header.size - sizeof(header_t);
+            bytes += size;
+            smallest = MIN(smallest, size);
+            largest = MAX(largest, size);
+            count++;
+        }
+        if (count == 0) {
+            continue;
+        }
+        dprintf(INFO, "\t%6d %8u %12zu %12zu %12zu\n", i, count, bytes, smallest, largest);
+
+        total_free += bytes;
+        total_largest = MAX(total_largest, largest);
+        total_count += count;
+    }
+
+    unsigned frag = total_free ? (unsigned)(100 - total_largest * 100 / total_free) : 0;
+    dprintf(INFO, "\tsize %zu, free %zu in %u areas, largest %zu, fragmentation %u%%\n",
+            theheap.size, total_free, total_count, total_largest, frag);
     unlock();
 }
 
@@ -525,6 +619,10 @@ static void cmpct_test_return_to_os(void) {
 }
 
 void cmpct_test(void) {
+#if CMPCT_CPU_CACHE
+    cpu_cache_enabled = false;
+    cpu_cache_drain_local();
+#endif
     cmpct_test_buckets();
     cmpct_test_get_back_newly_freed();
     cmpct_test_return_to_os();
@@ -580,6 +678,9 @@ void cmpct_test(void) {
             cmpct_free(ptr[i]);
     }
 
+#if CMPCT_CPU_CACHE
+    cpu_cache_enabled = true;
+#endif
     cmpct_dump();
 }
 
@@ -614,6 +715,9 @@ void cmpct_trim(void) {
     // Look at free list entries that are at least as large as one page plus a
     // header. They might be at the start or the end of a block, so we can trim
     // them and free the page(s).
+#if CMPCT_CPU_CACHE
+    cpu_cache_drain_local();
+#endif
     lock();
     for (int bucket = size_to_index_freeing(PAGE_SIZE);
             bucket < NUMBER_OF_BUCKETS;
@@ -681,17 +785,13 @@ void cmpct_trim(void) {
     unlock();
 }
 
-void *cmpct_alloc(size_t size) {
-    if (size == 0u) return NULL;
-
-    if (size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) return large_alloc(size);
-
+// Called with the lock held.
+static void *alloc_locked(size_t size) {
     size_t rounded_up;
     int start_bucket = size_to_index_allocating(size, &rounded_up);
 
     rounded_up += sizeof(header_t);
 
-    lock();
     int bucket = find_nonempty_bucket(start_bucket);
     if (bucket == -1) {
         // Grow heap by at least 12% if we can.
@@ -700,7 +800,6 @@ void *cmpct_alloc(size_t size) {
                                 MAX(HEAP_GROW_SIZE, rounded_up)));
         while (heap_grow(growby, NULL) < 0) {
             if (growby <= rounded_up) {
-                unlock();
                 return NULL;
             }
             growby = MAX(growby >> 1, rounded_up);
@@ -730,6 +829,148 @@ void *cmpct_alloc(size_t size) {
     memset(result, ALLOC_FILL, size);
     memset(((char *)result) + size, PADDING_FILL, rounded_up - size - sizeof(header_t));
 #endif
+    return result;
+}
+
+#if CMPCT_CPU_CACHE
+static void free_locked(void *payload);
+
+static void *cpu_cache_alloc(size_t size) {
+    unsigned class = (size - 1) / CPU_CACHE_CLASS_SIZE;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct cpu_cache *cache = &cpu_caches[arch_curr_cpu_num()];
+    if (cache->classes[class].count > 0) {
+        void *result = cache->classes[class].objs[--cache->classes[class].count];
+        cache->hits++;
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+        return result;
+    }
+    cache->misses++;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    // Refill with a batch of objects the size of the class and keep the first.
+    void *batch[CPU_CACHE_BATCH];
+    unsigned count = 0;
+    lock();
+    while (count < CPU_CACHE_BATCH &&
+            (batch[count] = alloc_locked((class + 1) * CPU_CACHE_CLASS_SIZE)) != NULL) {
+        count++;
+    }
+    unlock();
+
+    if (count == 0) return NULL;
+
+    // We may have migrated, or a free may have filled the cache, so only take
+    // what fits.
+    unsigned i = 1;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    cache = &cpu_caches[arch_curr_cpu_num()];
+    while (i < count && cache->classes[class].count < CPU_CACHE_DEPTH) {
+        cache->classes[class].objs[cache->classes[class].count++] = batch[i++];
+    }
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (i < count) {
+        lock();
+        while (i < count) free_locked(batch[i++]);
+        unlock();
+    }
+
+    return batch[0];
+}
+
+// Returns false if the object is not a size that is cached.
+static bool cpu_cache_free(void *payload) {
+    header_t *header = (header_t *)payload - 1;
+    size_t usable = header->size - sizeof(header_t);
+
+    // Objects handed out by the caches are at most a free_t larger than the
+    // class, anything else belongs straight back on the heap.
+    if (usable < CPU_CACHE_CLASS_SIZE || usable > CPU_CACHE_MAX_SIZE + sizeof(free_t)) return false;
+    unsigned class = MIN(usable / CPU_CACHE_CLASS_SIZE, CPU_CACHE_CLASSES) - 1;
+
+#ifdef CMPCT_DEBUG
+    memset(payload, FREE_FILL, usable);
+#endif
+
+    void *drain[CPU_CACHE_BATCH];
+    unsigned count = 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct cpu_cache *cache = &cpu_caches[arch_curr_cpu_num()];
+    if (cache->classes[class].count == CPU_CACHE_DEPTH) {
+        // Full, hand the oldest batch back to the heap.
+        void **objs = cache->classes[class].objs;
+        memcpy(drain, objs, sizeof(drain));
+        memmove(objs, objs + CPU_CACHE_BATCH, (CPU_CACHE_DEPTH - CPU_CACHE_BATCH) * sizeof(objs[0]));
+        cache->classes[class].count -= CPU_CACHE_BATCH;
+        cache->drains++;
+        count = CPU_CACHE_BATCH;
+    }
+    cache->classes[class].objs[cache->classes[class].count++] = payload;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (count > 0) {
+        lock();
+        for (unsigned i = 0; i < count; i++) free_locked(drain[i]);
+        unlock();
+    }
+
+    return true;
+}
+
+// Return everything cached on the current cpu to the heap.
+static void cpu_cache_drain_local(void) {
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct cpu_cache *cache = &cpu_caches[arch_curr_cpu_num()];
+
+    for (int class = 0; class < CPU_CACHE_CLASSES; class++) {
+        while (cache->classes[class].count > 0) {
+            void *drain[CPU_CACHE_DEPTH];
+            unsigned count = cache->classes[class].count;
+            memcpy(drain, cache->classes[class].objs, count * sizeof(drain[0]));
+            cache->classes[class].count = 0;
+            arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+            lock();
+            for (unsigned i = 0; i < count; i++) free_locked(drain[i]);
+            unlock();
+
+            // Pick the cache up again, we may be on another cpu now.
+            arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+            cache = &cpu_caches[arch_curr_cpu_num()];
+        }
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+#endif
+
+void *cmpct_alloc(size_t size) {
+    if (size == 0u) return NULL;
+
+    if (size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) return large_alloc(size);
+
+#if CMPCT_CPU_CACHE
+    if (size <= CPU_CACHE_MAX_SIZE && cpu_cache_enabled) {
+        void *result = cpu_cache_alloc(size);
+#ifdef CMPCT_DEBUG
+        if (result) memset(result, ALLOC_FILL, size);
+#endif
+        return result;
+    }
+#endif
+
+    lock();
+    void *result = alloc_locked(size);
     unlock();
     return result;
 }
@@ -762,12 +1003,11 @@ void *cmpct_memalign(size_t size, size_t alignment) {
     return payload;
 }
 
-void cmpct_free(void *payload) {
-    if (payload == NULL) return;
+// Called with the lock held.
+static void free_locked(void *payload) {
     header_t *header = (header_t *)payload - 1;
     DEBUG_ASSERT(!is_tagged_as_free(header));  // Double free!
     size_t size = header->size;
-    lock();
     header_t *left = header->left;
     if (left != NULL && is_tagged_as_free(left)) {
         // Coalesce with left free object.
@@ -796,6 +1036,16 @@ void cmpct_free(void *payload) {
             free_memory(header, left, size);
         }
     }
+}
+
+void cmpct_free(void *payload) {
+    if (payload == NULL) return;
+    DEBUG_ASSERT(!is_tagged_as_free((header_t *)payload - 1));  // Double free!
+#if CMPCT_CPU_CACHE
+    if (cpu_cache_enabled && cpu_cache_free(payload)) return;
+#endif
+    lock();
+    free_locked(payload);
     unlock();
 }
 
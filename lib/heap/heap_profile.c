@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2026 The LK Contributors
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include "heap_profile.h"
+
+#include <kernel/spinlock.h>
+#include <lib/heap.h>
+#include <lk/compiler.h>
+#include <lk/debug.h>
+#include <lk/trace.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * Per call site allocation profiler.
+ *
+ * Every allocation that goes through the heap wrapper is charged to the
+ * address it was called from. Live allocations are remembered in a fixed
+ * size hash table so a free can be charged back to the site that made it.
+ * Both tables are statically sized; once either fills up further allocations
+ * are counted as untracked rather than recorded.
+ */
+
+#ifndef HEAP_PROFILE_SITES
+#define HEAP_PROFILE_SITES 256
+#endif
+#ifndef HEAP_PROFILE_LIVE
+#define HEAP_PROFILE_LIVE 4096
+#endif
+
+STATIC_ASSERT((HEAP_PROFILE_SITES & (HEAP_PROFILE_SITES - 1)) == 0);
+STATIC_ASSERT((HEAP_PROFILE_LIVE & (HEAP_PROFILE_LIVE - 1)) == 0);
+
+struct heap_site {
+    void *caller;
+    unsigned long allocs;
+    unsigned long frees;
+    size_t bytes;
+    size_t live_objs;
+    size_t live_bytes;
+};
+
+struct heap_live {
+    void *ptr;
+    uint32_t size;
+    uint32_t site;
+};
+
+static struct heap_site sites[HEAP_PROFILE_SITES];
+static uint site_count;
+static struct heap_live live[HEAP_PROFILE_LIVE];
+static uint live_count;
+static unsigned long untracked;
+
+static bool profile_enabled = true;
+static spin_lock_t profile_lock = SPIN_LOCK_INITIAL_VALUE;
+
+static inline uint hash_ptr(const void *ptr, uint size) {
+    uintptr_t v = (uintptr_t)ptr >> 3;
+    return (uint)(v * 2654435761u) & (size - 1);
+}
+
+static struct heap_site *site_lookup(void *caller) {
+    uint i = hash_ptr(caller, HEAP_PROFILE_SITES);
+
+    for (;;) {
+        if (sites[i].caller == caller)
+            return &sites[i];
+        if (!sites[i].caller)
+            break;
+        i = (i + 1) & (HEAP_PROFILE_SITES - 1);
+    }
+
+    /* leave some slack so probes stay short */
+    if (site_count >= HEAP_PROFILE_SITES * 7 / 8)
+        return NULL;
+
+    site_count++;
+    sites[i].caller = caller;
+    return &sites[i];
+}
+
+static int live_lookup(const void *ptr) {
+    uint i = hash_ptr(ptr, HEAP_PROFILE_LIVE);
+
+    for (; live[i].ptr; i = (i + 1) & (HEAP_PROFILE_LIVE - 1)) {
+        if (live[i].ptr == ptr)
+            return (int)i;
+    }
+
+    return -1;
+}
+
+/* linear probing delete, shifting back any entries that probed past this slot */
+static void live_remove(uint i) {
+    uint j = i;
+
+    for (;;) {
+        j = (j + 1) & (HEAP_PROFILE_LIVE - 1);
+        if (!live[j].ptr)
+            break;
+
+        uint home = hash_ptr(live[j].ptr, HEAP_PROFILE_LIVE);
+        bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            live[i] = live[j];
+            i = j;
+        }
+    }
+
+    live[i].ptr = NULL;
+    live_count--;
+}
+
+void heap_profile_alloc(void *caller, void *ptr, size_t size) {
+    if (!ptr || !profile_enabled)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+
+    struct heap_site *site = site_lookup(caller);
+    if (!site || live_count >= HEAP_PROFILE_LIVE * 7 / 8) {
+        untracked++;
+    } else {
+        site->allocs++;
+        site->bytes += size;
+        site->live_objs++;
+        site->live_bytes += size;
+
+        uint i = hash_ptr(ptr, HEAP_PROFILE_LIVE);
+        while (live[i].ptr)
+            i = (i + 1) & (HEAP_PROFILE_LIVE - 1);
+
+        live[i].ptr = ptr;
+        live[i].size = (uint32_t)MIN(size, UINT32_MAX);
+        live[i].site = (uint32_t)(site - sites);
+        live_count++;
+    }
+
+    spin_unlock_irqrestore(&profile_lock, state);
+}
+
+size_t heap_profile_free(void *ptr) {
+    size_t size = 0;
+
+    if (!ptr)
+        return 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+
+    /* allocations made before a reset or while disabled simply aren't found */
+    int i = live_lookup(ptr);
+    if (i >= 0) {
+        struct heap_site *site = &sites[live[i].site];
+        site->frees++;
+        site->live_objs--;
+        site->live_bytes -= live[i].size;
+        size = live[i].size;
+        live_remove((uint)i);
+    }
+
+    spin_unlock_irqrestore(&profile_lock, state);
+
+    return size;
+}
+
+void heap_profile_reset(void) {
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+
+    memset(sites, 0, sizeof(sites));
+    memset(live, 0, sizeof(live));
+    site_count = 0;
+    live_count = 0;
+    untracked = 0;
+
+    spin_unlock_irqrestore(&profile_lock, state);
+}
+
+void heap_profile_enable(bool enable) {
+    profile_enabled = enable;
+}
+
+bool heap_profile_enabled(void) {
+    return profile_enabled;
+}
+
+static int site_compare(const void *_a, const void *_b) {
+    const struct heap_site *a = _a;
+    const struct heap_site *b = _b;
+
+    /* biggest live footprint first, then the busiest */
+    if (a->live_bytes != b->live_bytes)
+        return (a->live_bytes > b->live_bytes) ? -1 : 1;
+    if (a->allocs != b->allocs)
+        return (a->allocs > b->allocs) ? -1 : 1;
+    return 0;
+}
+
+void heap_profile_dump(void) {
+    /* take the snapshot buffer before the lock, it gets profiled like anything else */
+    struct heap_site *snap = malloc(sizeof(sites));
+    if (!snap) {
+        printf("heap profile: no memory for snapshot\n");
+        return;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&profile_lock, state);
+
+    uint count = 0;
+    for (uint i = 0; i < HEAP_PROFILE_SITES; i++) {
+        if (sites[i].caller)
+            snap[count++] = sites[i];
+    }
+    uint live_objs = live_count;
+    unsigned long untracked_allocs = untracked;
+
+    spin_unlock_irqrestore(&profile_lock, state);
+
+    qsort(snap, count, sizeof(snap[0]), &site_compare);
+
+    size_t live_bytes = 0;
+    for (uint i = 0; i < count; i++)
+        live_bytes += snap[i].live_bytes;
+
+    printf("heap profile (%s): %u call sites, %u live objects, %zu live bytes, %lu untracked allocs\n",
+           profile_enabled ? "on" : "off", count, live_objs, live_bytes, untracked_allocs);
+    printf("%18s %10s %10s %12s %10s %12s\n",
+           "caller", "allocs", "frees", "bytes", "live", "live bytes");
+    for (uint i = 0; i < count; i++) {
+        printf("%18p %10lu %10lu %12zu %10zu %12zu\n", snap[i].caller, snap[i].allocs,
+               snap[i].frees, snap[i].bytes, snap[i].live_objs, snap[i].live_bytes);
+    }
+
+    free(snap);
+}
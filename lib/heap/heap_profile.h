@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2026 The LK Contributors
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <lk/compiler.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+__BEGIN_CDECLS
+
+/* per call site allocation profiler, built in with LK_HEAP_PROFILE=1 */
+void heap_profile_alloc(void *caller, void *ptr, size_t size);
+/* returns the size recorded for ptr, or 0 if it wasn't being tracked */
+size_t heap_profile_free(void *ptr);
+
+void heap_profile_dump(void);
+void heap_profile_reset(void);
+void heap_profile_enable(bool enable);
+bool heap_profile_enabled(void);
+
+__END_CDECLS
@@ -18,6 +18,10 @@
 #include <lk/console_cmd.h>
 #include <lib/page_alloc.h>
 
+#if LK_HEAP_PROFILE
+#include "heap_profile.h"
+#endif
+
 #define LOCAL_TRACE 0
 
 /* heap tracing */
@@ -27,6 +31,12 @@ static bool heap_trace = false;
 #define heap_trace (false)
 #endif
 
+/* per call site profiling */
+#if !LK_HEAP_PROFILE
+static inline void heap_profile_alloc(void *caller, void *ptr, size_t size) {}
+static inline size_t heap_profile_free(void *ptr) { return 0; }
+#endif
+
 /* delayed free list */
 struct list_node delayed_free_list = LIST_INITIAL_VALUE(delayed_free_list);
 spin_lock_t delayed_free_lock = SPIN_LOCK_INITIAL_VALUE;
@@ -55,6 +65,15 @@ static inline void HEAP_INIT(void) {
 }
 #define HEAP_DUMP miniheap_dump
 #define HEAP_TRIM miniheap_trim
+static inline void HEAP_DUMP_FRAG(void) {
+    struct miniheap_stats stats;
+    miniheap_get_stats(&stats);
+
+    unsigned frag = stats.heap_free ? (unsigned)(100 - stats.heap_max_chunk * 100 / stats.heap_free) : 0;
+    printf("Heap fragmentation (using miniheap):\n");
+    printf("\tsize %zu, free %zu, largest %zu, fragmentation %u%%\n",
+           stats.heap_len, stats.heap_free, stats.heap_max_chunk, frag);
+}
 
 /* end miniheap implementation */
 #elif WITH_LIB_HEAP_CMPCTMALLOC
@@ -67,6 +86,7 @@ static inline void HEAP_INIT(void) {
 #define HEAP_FREE cmpct_free
 #define HEAP_INIT cmpct_init
 #define HEAP_DUMP cmpct_dump
+#define HEAP_DUMP_FRAG cmpct_dump_frag
 #define HEAP_TRIM cmpct_trim
 static inline void *HEAP_CALLOC(size_t n, size_t s) {
     size_t realsize = n * s;
@@ -109,6 +129,31 @@ static inline void HEAP_DUMP(void) {
     dlmalloc_inspect_all(&dump_callback, NULL);
 }
 
+struct heap_frag_stats {
+    size_t total_free;
+    size_t largest;
+};
+
+static void heap_frag_callback(void *start, void *end, size_t used_bytes, void *arg) {
+    struct heap_frag_stats *stats = arg;
+
+    if (used_bytes == 0) {
+        size_t len = (uintptr_t)end - (uintptr_t)start;
+        stats->total_free += len;
+        stats->largest = MAX(stats->largest, len);
+    }
+}
+
+static inline void HEAP_DUMP_FRAG(void) {
+    struct heap_frag_stats stats = { 0, 0 };
+
+    dlmalloc_inspect_all(&heap_frag_callback, &stats);
+
+    unsigned frag = stats.total_free ? (unsigned)(100 - stats.largest * 100 / stats.total_free) : 0;
+    printf("Heap fragmentation (using dlmalloc):\n");
+    printf("\tfree %zu, largest %zu, fragmentation %u%%\n", stats.total_free, stats.largest, frag);
+}
+
 static inline void HEAP_TRIM(void) { dlmalloc_trim(0); }
 
 /* end dlmalloc implementation */
@@ -158,6 +203,7 @@ void *malloc(size_t size) {
     }
 
     void *ptr = HEAP_MALLOC(size);
+    heap_profile_alloc(__GET_CALLER(), ptr, size);
     if (heap_trace)
         printf("caller %p malloc %zu -> %p\n", __GET_CALLER(), size, ptr);
     return ptr;
@@ -172,6 +218,7 @@ void *memalign(size_t boundary, size_t size) {
     }
 
     void *ptr = HEAP_MEMALIGN(boundary, size);
+    heap_profile_alloc(__GET_CALLER(), ptr, size);
     if (heap_trace)
         printf("caller %p memalign %zu, %zu -> %p\n", __GET_CALLER(), boundary, size, ptr);
     return ptr;
@@ -186,6 +233,7 @@ void *calloc(size_t count, size_t size) {
     }
 
     void *ptr = HEAP_CALLOC(count, size);
+    heap_profile_alloc(__GET_CALLER(), ptr, count * size);
     if (heap_trace)
         printf("caller %p calloc %zu, %zu -> %p\n", __GET_CALLER(), count, size, ptr);
     return ptr;
@@ -199,7 +247,15 @@ void *realloc(void *ptr, size_t size) {
         heap_free_delayed_list();
     }
 
+    /* stop tracking the old block before the heap can hand it out again */
+    size_t old_size = heap_profile_free(ptr);
     void *ptr2 = HEAP_REALLOC(ptr, size);
+    if (ptr2 || size == 0) {
+        heap_profile_alloc(__GET_CALLER(), ptr2, size);
+    } else {
+        /* failed, the old block is still live */
+        heap_profile_alloc(__GET_CALLER(), ptr, old_size);
+    }
     if (heap_trace)
         printf("caller %p realloc %p, %zu -> %p\n", __GET_CALLER(), ptr, size, ptr2);
     return ptr2;
@@ -210,6 +266,7 @@ void free(void *ptr) {
     if (heap_trace)
         printf("caller %p free %p\n", __GET_CALLER(), ptr);
 
+    heap_profile_free(ptr);
     HEAP_FREE(ptr);
 }
 
@@ -221,6 +278,8 @@ void heap_delayed_free(void *ptr) {
     /* XXX assumes the free block is large enough to hold a list node */
     struct list_node *node = (struct list_node *)ptr;
 
+    heap_profile_free(ptr);
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&delayed_free_lock, state);
     list_add_head(&delayed_free_list, node);
@@ -311,6 +370,10 @@ notenoughargs:
 usage:
         printf("usage:\n");
         printf("\t%s info\n", argv[0].str);
+        printf("\t%s frag\n", argv[0].str);
+#if LK_HEAP_PROFILE
+        printf("\t%s profile [on|off|reset]\n", argv[0].str);
+#endif
         printf("\t%s trace\n", argv[0].str);
         printf("\t%s trim\n", argv[0].str);
         printf("\t%s alloc <size> [alignment]\n", argv[0].str);
@@ -321,6 +384,22 @@ usage:
 
     if (strcmp(argv[1].str, "info") == 0) {
         heap_dump();
+    } else if (strcmp(argv[1].str, "frag") == 0) {
+        HEAP_DUMP_FRAG();
+#if LK_HEAP_PROFILE
+    } else if (strcmp(argv[1].str, "profile") == 0) {
+        if (argc < 3) {
+            heap_profile_dump();
+        } else if (strcmp(argv[2].str, "on") == 0) {
+            heap_profile_enable(true);
+        } else if (strcmp(argv[2].str, "off") == 0) {
+            heap_profile_enable(false);
+        } else if (strcmp(argv[2].str, "reset") == 0) {
+            heap_profile_reset();
+        } else {
+            goto usage;
+        }
+#endif
     } else if (strcmp(argv[1].str, "test") == 0) {
         heap_test();
     } else if (strcmp(argv[1].str, "trace") == 0) {
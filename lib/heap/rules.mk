@@ -27,4 +27,14 @@ endif
 
 GLOBAL_DEFINES += LK_HEAP_IMPLEMENTATION=$(LK_HEAP_IMPLEMENTATION)
 
+# optional per call site allocation profiler, see 'heap profile'
+ifndef LK_HEAP_PROFILE
+LK_HEAP_PROFILE=0
+endif
+ifeq ($(LK_HEAP_PROFILE),1)
+MODULE_SRCS += $(LOCAL_DIR)/heap_profile.c
+endif
+
+GLOBAL_DEFINES += LK_HEAP_PROFILE=$(LK_HEAP_PROFILE)
+
 include make/module.mk
@@ -17,7 +17,9 @@
 #include <sys/types.h>
 #include <lk/console_cmd.h>
 #include <lib/cbuf.h>
+#include <lib/kmem_cache.h>
 #include <kernel/mutex.h>
+#include <kernel/rwlock.h>
 #include <kernel/semaphore.h>
 #include <arch/ops.h>
 #include <platform.h>
@@ -131,9 +133,12 @@ typedef struct tcp_socket {
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
-static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
+static rwlock_t tcp_socket_list_lock = RWLOCK_INITIAL_VALUE(tcp_socket_list_lock);
 static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
 
+static kmem_cache_t tcp_socket_cache =
+    KMEM_CACHE_INITIAL_VALUE(tcp_socket_cache, "tcp_socket_t", sizeof(tcp_socket_t), __alignof(tcp_socket_t), NULL);
+
 static bool tcp_debug = false;
 
 /* local routines */
@@ -218,7 +223,7 @@ static void dump_socket(tcp_socket_t *s) {
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port) {
     LTRACEF("remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    rwlock_acquire_read(&tcp_socket_list_lock);
 
     /* XXX replace with something faster, like a hash table */
     tcp_socket_t *s = NULL;
@@ -254,7 +259,7 @@ out:
     if (s)
         inc_socket_ref(s);
 
-    mutex_release(&tcp_socket_list_lock);
+    rwlock_release_read(&tcp_socket_list_lock);
 
     return s;
 }
@@ -263,23 +268,23 @@ static void add_socket_to_list(tcp_socket_t *s) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0); // we should have implicitly bumped the ref when creating the socket
 
-    mutex_acquire(&tcp_socket_list_lock);
+    rwlock_acquire_write(&tcp_socket_list_lock);
 
     list_add_head(&tcp_socket_list, &s->node);
 
-    mutex_release(&tcp_socket_list_lock);
+    rwlock_release_write(&tcp_socket_list_lock);
 }
 
 static void remove_socket_from_list(tcp_socket_t *s) {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    rwlock_acquire_write(&tcp_socket_list_lock);
 
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
 
-    mutex_release(&tcp_socket_list_lock);
+    rwlock_release_write(&tcp_socket_list_lock);
 }
 
 static void inc_socket_ref(tcp_socket_t *s) {
@@ -304,7 +309,7 @@ static bool dec_socket_ref(tcp_socket_t *s) {
         free(s->rx_buffer_raw);
         free(s->tx_buffer);
 
-        free(s);
+        kmem_cache_free(&tcp_socket_cache, s);
     }
     return (oldval == 1);
 }
@@ -910,7 +915,7 @@ static void tcp_remote_close(tcp_socket_t *s) {
 static tcp_socket_t *create_tcp_socket(bool alloc_buffers) {
     tcp_socket_t *s;
 
-    s = calloc(1, sizeof(tcp_socket_t));
+    s = kmem_cache_zalloc(&tcp_socket_cache);
     if (!s)
         return NULL;
 
@@ -1191,12 +1196,12 @@ usage:
 
     if (!strcmp(argv[1].str, "sockets")) {
 
-        mutex_acquire(&tcp_socket_list_lock);
+        rwlock_acquire_read(&tcp_socket_list_lock);
         tcp_socket_t *s = NULL;
         list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
             dump_socket(s);
         }
-        mutex_release(&tcp_socket_list_lock);
+        rwlock_release_read(&tcp_socket_list_lock);
     } else if (!strcmp(argv[1].str, "listenclose")) {
         /* listen for a connection, accept it, then immediately close it */
         if (argc < 3) goto notenoughargs;
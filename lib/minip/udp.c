@@ -11,8 +11,11 @@
 #include "minip-internal.h"
 
 #include <lk/err.h>
+#include <arch/atomic.h>
 #include <errno.h>
 #include <iovec.h>
+#include <kernel/rwlock.h>
+#include <kernel/thread.h>
 #include <lk/list.h>
 #include <malloc.h>
 #include <stdint.h>
@@ -20,13 +23,16 @@
 
 #define LOCAL_TRACE 0
 
+/* looked up on every received packet, changed only when a port is (un)bound */
 static struct list_node udp_list = LIST_INITIAL_VALUE(udp_list);
+static spin_rwlock_t udp_list_lock = SPIN_RWLOCK_INITIAL_VALUE;
 
 struct udp_listener {
     struct list_node list;
     uint16_t port;
     udp_callback_t callback;
     void *arg;
+    volatile int ref_count;     // callbacks in progress
 };
 
 typedef struct udp_socket {
@@ -46,26 +52,42 @@ typedef struct udp_hdr {
 
 int udp_listen(uint16_t port, udp_callback_t cb, void *arg) {
     struct udp_listener *entry, *temp;
+    struct udp_listener *new_entry = NULL;
+    spin_lock_saved_state_t state;
 
+    if (cb != NULL && (new_entry = malloc(sizeof(struct udp_listener))) == NULL) {
+        return -1;
+    }
+
+    spin_rwlock_write_lock_irqsave(&udp_list_lock, state);
     list_for_every_entry_safe(&udp_list, entry, temp, struct udp_listener, list) {
         if (entry->port == port) {
             if (cb == NULL) {
                 list_delete(&entry->list);
+                spin_rwlock_write_unlock_irqrestore(&udp_list_lock, state);
+
+                /* the caller may free arg once we return, let callbacks under way finish.
+                 * a callback must not unbind its own port. */
+                while (entry->ref_count != 0)
+                    thread_yield();
+                free(entry);
                 return 0;
             }
+            spin_rwlock_write_unlock_irqrestore(&udp_list_lock, state);
+            free(new_entry);
             return -1;
         }
     }
 
-    if ((entry = malloc(sizeof(struct udp_listener))) == NULL) {
-        return -1;
-    }
-
-    entry->port = port;
-    entry->callback = cb;
-    entry->arg = arg;
+    if (new_entry) {
+        new_entry->port = port;
+        new_entry->callback = cb;
+        new_entry->arg = arg;
+        new_entry->ref_count = 0;
 
-    list_add_tail(&udp_list, &entry->list);
+        list_add_tail(&udp_list, &new_entry->list);
+    }
+    spin_rwlock_write_unlock_irqrestore(&udp_list_lock, state);
 
     return 0;
 }
@@ -179,10 +201,22 @@ void udp_input(pktbuf_t *p, uint32_t src_ip) {
 
     port = ntohs(udp->dst_port);
 
+    /* call the listener outside the lock, it may block or call back into us.
+     * the reference keeps an unbind from returning until it's done. */
+    struct udp_listener *listener = NULL;
+    spin_lock_saved_state_t state;
+    spin_rwlock_read_lock_irqsave(&udp_list_lock, state);
     list_for_every_entry(&udp_list, e, struct udp_listener, list) {
         if (e->port == port) {
-            e->callback(p->data, p->dlen, src_ip, ntohs(udp->src_port), e->arg);
-            return;
+            listener = e;
+            atomic_add(&listener->ref_count, 1);
+            break;
         }
     }
+    spin_rwlock_read_unlock_irqrestore(&udp_list_lock, state);
+
+    if (listener) {
+        listener->callback(p->data, p->dlen, src_ip, ntohs(udp->src_port), listener->arg);
+        atomic_add(&listener->ref_count, -1);
+    }
 }
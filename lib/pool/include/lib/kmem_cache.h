@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2026 The LK Contributors
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#pragma once
+
+#include <kernel/mutex.h>
+#include <lk/compiler.h>
+#include <lk/list.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/**
+ * Growable caches of fixed size objects.
+ *
+ * Objects are carved out of single page slabs taken from the page allocator
+ * (pmm_alloc_kpages or novm_alloc_pages), each slab keeping its free objects
+ * in a lib/pool free list. Every cpu keeps a short stack of free objects in
+ * front of the slabs, so allocating and freeing an object usually takes no
+ * lock at all. Slabs that become empty are handed back to the page allocator,
+ * keeping one around to absorb churn.
+ *
+ * Caches may be defined statically, which makes them usable before the heap
+ * is up:
+ *
+ * static kmem_cache_t foo_cache =
+ *     KMEM_CACHE_INITIAL_VALUE(foo_cache, "foo_t", sizeof(foo_t), __alignof(foo_t), NULL);
+ *
+ * foo_t *foo = kmem_cache_alloc(&foo_cache);
+ * ...
+ * kmem_cache_free(&foo_cache, foo);
+ *
+ * Must be called from thread context.
+ */
+
+/* called on every object before kmem_cache_alloc returns it */
+typedef void (*kmem_cache_ctor_t)(void *obj);
+
+#ifndef KMEM_CPU_CACHE_DEPTH
+#define KMEM_CPU_CACHE_DEPTH 8
+#endif
+
+typedef struct kmem_cache {
+    struct list_node node;
+    const char *name;
+
+    size_t obj_size;
+    size_t obj_align;
+    kmem_cache_ctor_t ctor;
+
+    /* protects the slab lists and the layout below */
+    mutex_t lock;
+    struct list_node partial_slabs;
+    struct list_node full_slabs;
+    struct list_node empty_slabs;
+
+    /* computed on first use */
+    size_t obj_stride;
+    size_t obj_offset;
+    uint objs_per_slab;
+
+    /* stats */
+    uint slab_count;
+    size_t objs_out; /* handed out of the slabs, including ones parked in cpu caches */
+
+    struct {
+        uint count;
+        void *objs[KMEM_CPU_CACHE_DEPTH];
+    } cpu[SMP_MAX_CPUS];
+} kmem_cache_t;
+
+#define KMEM_CACHE_INITIAL_VALUE(cache, _name, _size, _align, _ctor) \
+{ \
+    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .name = (_name), \
+    .obj_size = (_size), \
+    .obj_align = (_align), \
+    .ctor = (_ctor), \
+    .lock = MUTEX_INITIAL_VALUE((cache).lock), \
+    .partial_slabs = LIST_INITIAL_VALUE((cache).partial_slabs), \
+    .full_slabs = LIST_INITIAL_VALUE((cache).full_slabs), \
+    .empty_slabs = LIST_INITIAL_VALUE((cache).empty_slabs), \
+}
+
+/* Initialize a cache at run time. Objects must fit at least once in a page. */
+void kmem_cache_init(kmem_cache_t *cache, const char *name, size_t size, size_t align,
+                     kmem_cache_ctor_t ctor);
+
+/* Release all of the memory held by a cache. Every object must have been freed. */
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+/* Returns NULL if no memory could be found. */
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+/* As kmem_cache_alloc, but the object is zeroed instead of constructed. */
+void *kmem_cache_zalloc(kmem_cache_t *cache);
+
+/* Free an object back to the cache it came from. NULL is ignored. */
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/* Return the current cpu's cached objects and any spare empty slabs to the page allocator. */
+void kmem_cache_reap(kmem_cache_t *cache);
+
+__END_CDECLS
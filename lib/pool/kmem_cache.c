@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2026 The LK Contributors
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lib/kmem_cache.h>
+
+#include <arch/ops.h>
+#include <assert.h>
+#include <kernel/spinlock.h>
+#include <lib/page_alloc.h>
+#include <lib/pool.h>
+#include <lk/console_cmd.h>
+#include <lk/debug.h>
+#include <lk/err.h>
+#include <lk/trace.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOCAL_TRACE 0
+
+/* every slab is a single page with this header at the front */
+struct kmem_slab {
+    struct list_node node;
+    kmem_cache_t *cache;
+    pool_t free_objs;
+    uint in_use;
+};
+
+/* number of objects moved between the slabs and a cpu cache at once */
+#define KMEM_CPU_CACHE_BATCH (KMEM_CPU_CACHE_DEPTH / 2)
+
+static struct list_node cache_list = LIST_INITIAL_VALUE(cache_list);
+static mutex_t cache_list_lock = MUTEX_INITIAL_VALUE(cache_list_lock);
+
+static inline struct kmem_slab *obj_to_slab(const void *obj) {
+    return (struct kmem_slab *)ROUNDDOWN((uintptr_t)obj, PAGE_SIZE);
+}
+
+/* work out the slab layout and make the cache visible to the console, on first use */
+static void cache_setup(kmem_cache_t *cache) {
+    DEBUG_ASSERT(is_mutex_held(&cache->lock));
+
+    if (cache->obj_stride != 0)
+        return;
+
+    cache->obj_stride = POOL_PADDED_OBJECT_SIZE(cache->obj_size, cache->obj_align);
+    cache->obj_offset = ROUNDUP(sizeof(struct kmem_slab),
+                                POOL_STORAGE_ALIGN(cache->obj_size, cache->obj_align));
+    cache->objs_per_slab = (PAGE_SIZE - cache->obj_offset) / cache->obj_stride;
+    ASSERT(cache->objs_per_slab > 0);
+
+    LTRACEF("cache '%s' stride %zu offset %zu objs per slab %u\n", cache->name,
+            cache->obj_stride, cache->obj_offset, cache->objs_per_slab);
+
+    mutex_acquire(&cache_list_lock);
+    list_add_tail(&cache_list, &cache->node);
+    mutex_release(&cache_list_lock);
+}
+
+/* take an object out of the slabs, growing the cache if needed. lock held */
+static void *slab_alloc_obj(kmem_cache_t *cache) {
+    struct kmem_slab *slab = list_peek_head_type(&cache->partial_slabs, struct kmem_slab, node);
+    if (!slab) {
+        slab = list_remove_head_type(&cache->empty_slabs, struct kmem_slab, node);
+        if (!slab) {
+            slab = page_alloc(1, PAGE_ALLOC_ANY_ARENA);
+            if (!slab)
+                return NULL;
+
+            slab->cache = cache;
+            slab->in_use = 0;
+            slab->free_objs.next_free = NULL;
+            pool_init(&slab->free_objs, cache->obj_size, cache->obj_align, cache->objs_per_slab,
+                      (uint8_t *)slab + cache->obj_offset);
+            cache->slab_count++;
+        }
+        list_add_head(&cache->partial_slabs, &slab->node);
+    }
+
+    void *obj = pool_alloc(&slab->free_objs);
+    DEBUG_ASSERT(obj);
+    slab->in_use++;
+    cache->objs_out++;
+
+    if (slab->in_use == cache->objs_per_slab) {
+        list_delete(&slab->node);
+        list_add_head(&cache->full_slabs, &slab->node);
+    }
+
+    return obj;
+}
+
+/* put an object back in its slab. returns a page to free if the slab emptied. lock held */
+static struct kmem_slab *slab_free_obj(kmem_cache_t *cache, void *obj) {
+    struct kmem_slab *slab = obj_to_slab(obj);
+
+    DEBUG_ASSERT(slab->cache == cache);
+    DEBUG_ASSERT(slab->in_use > 0);
+
+    bool was_full = (slab->in_use == cache->objs_per_slab);
+
+    pool_free(&slab->free_objs, obj);
+    slab->in_use--;
+    cache->objs_out--;
+
+    if (slab->in_use == 0) {
+        list_delete(&slab->node);
+
+        /* keep one empty slab around, the rest go back to the page allocator */
+        if (list_is_empty(&cache->empty_slabs)) {
+            list_add_head(&cache->empty_slabs, &slab->node);
+            return NULL;
+        }
+        cache->slab_count--;
+        return slab;
+    } else if (was_full) {
+        list_delete(&slab->node);
+        list_add_head(&cache->partial_slabs, &slab->node);
+    }
+
+    return NULL;
+}
+
+static void slab_free_objs(kmem_cache_t *cache, void **objs, uint count) {
+    struct list_node free_slabs = LIST_INITIAL_VALUE(free_slabs);
+
+    mutex_acquire(&cache->lock);
+    for (uint i = 0; i < count; i++) {
+        struct kmem_slab *slab = slab_free_obj(cache, objs[i]);
+        if (slab)
+            list_add_tail(&free_slabs, &slab->node);
+    }
+    mutex_release(&cache->lock);
+
+    struct kmem_slab *slab;
+    while ((slab = list_remove_head_type(&free_slabs, struct kmem_slab, node))) {
+        page_free(slab, 1);
+    }
+}
+
+void kmem_cache_init(kmem_cache_t *cache, const char *name, size_t size, size_t align,
+                     kmem_cache_ctor_t ctor) {
+    *cache = (kmem_cache_t)KMEM_CACHE_INITIAL_VALUE(*cache, name, size, align, ctor);
+}
+
+void kmem_cache_destroy(kmem_cache_t *cache) {
+    kmem_cache_reap(cache);
+
+    mutex_acquire(&cache_list_lock);
+    if (list_in_list(&cache->node))
+        list_delete(&cache->node);
+    mutex_release(&cache_list_lock);
+
+    /* objects parked on other cpus are still out as far as the slabs know */
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        if (cache->cpu[cpu].count > 0)
+            slab_free_objs(cache, cache->cpu[cpu].objs, cache->cpu[cpu].count);
+        cache->cpu[cpu].count = 0;
+    }
+
+    mutex_acquire(&cache->lock);
+    ASSERT(cache->objs_out == 0);
+    DEBUG_ASSERT(list_is_empty(&cache->partial_slabs));
+    DEBUG_ASSERT(list_is_empty(&cache->full_slabs));
+
+    struct kmem_slab *slab;
+    while ((slab = list_remove_head_type(&cache->empty_slabs, struct kmem_slab, node))) {
+        page_free(slab, 1);
+        cache->slab_count--;
+    }
+    mutex_release(&cache->lock);
+
+    mutex_destroy(&cache->lock);
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+    void *obj = NULL;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    typeof(cache->cpu[0]) *c = &cache->cpu[arch_curr_cpu_num()];
+    if (likely(c->count > 0))
+        obj = c->objs[--c->count];
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (!obj) {
+        /* refill this cpu's cache with a batch and keep one for ourselves */
+        void *batch[KMEM_CPU_CACHE_BATCH];
+        uint count = 0;
+
+        mutex_acquire(&cache->lock);
+        cache_setup(cache);
+        while (count < KMEM_CPU_CACHE_BATCH && (batch[count] = slab_alloc_obj(cache)) != NULL)
+            count++;
+        mutex_release(&cache->lock);
+
+        if (count == 0)
+            return NULL;
+
+        obj = batch[0];
+
+        /* we may have migrated since, fill whichever cpu we are on now */
+        uint i = 1;
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+        c = &cache->cpu[arch_curr_cpu_num()];
+        while (i < count && c->count < KMEM_CPU_CACHE_DEPTH)
+            c->objs[c->count++] = batch[i++];
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        if (i < count)
+            slab_free_objs(cache, &batch[i], count - i);
+    }
+
+    if (cache->ctor)
+        cache->ctor(obj);
+
+    return obj;
+}
+
+void *kmem_cache_zalloc(kmem_cache_t *cache) {
+    DEBUG_ASSERT(!cache->ctor);
+
+    void *obj = kmem_cache_alloc(cache);
+    if (obj)
+        memset(obj, 0, cache->obj_size);
+
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+    if (!obj)
+        return;
+
+    DEBUG_ASSERT(obj_to_slab(obj)->cache == cache);
+
+    void *drain[KMEM_CPU_CACHE_BATCH];
+    uint count = 0;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    typeof(cache->cpu[0]) *c = &cache->cpu[arch_curr_cpu_num()];
+    if (c->count == KMEM_CPU_CACHE_DEPTH) {
+        /* full, hand the oldest batch back to the slabs */
+        memcpy(drain, c->objs, sizeof(drain));
+        memmove(c->objs, c->objs + KMEM_CPU_CACHE_BATCH,
+                (KMEM_CPU_CACHE_DEPTH - KMEM_CPU_CACHE_BATCH) * sizeof(c->objs[0]));
+        c->count -= KMEM_CPU_CACHE_BATCH;
+        count = KMEM_CPU_CACHE_BATCH;
+    }
+    c->objs[c->count++] = obj;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (count > 0)
+        slab_free_objs(cache, drain, count);
+}
+
+void kmem_cache_reap(kmem_cache_t *cache) {
+    void *drain[KMEM_CPU_CACHE_DEPTH];
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    typeof(cache->cpu[0]) *c = &cache->cpu[arch_curr_cpu_num()];
+    uint count = c->count;
+    memcpy(drain, c->objs, count * sizeof(drain[0]));
+    c->count = 0;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (count > 0)
+        slab_free_objs(cache, drain, count);
+
+    mutex_acquire(&cache->lock);
+    struct kmem_slab *slab = list_remove_head_type(&cache->empty_slabs, struct kmem_slab, node);
+    if (slab)
+        cache->slab_count--;
+    mutex_release(&cache->lock);
+
+    if (slab)
+        page_free(slab, 1);
+}
+
+#if LK_DEBUGLEVEL > 1
+
+static int cmd_kmem(int argc, const console_cmd_args *argv) {
+    if (argc > 1 && !strcmp(argv[1].str, "reap")) {
+        mutex_acquire(&cache_list_lock);
+        kmem_cache_t *cache;
+        list_for_every_entry(&cache_list, cache, kmem_cache_t, node) {
+            kmem_cache_reap(cache);
+        }
+        mutex_release(&cache_list_lock);
+    } else if (argc > 1) {
+        printf("usage:\n");
+        printf("%s [reap]\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
+
+    printf("%-16s %8s %8s %8s %8s %8s\n", "name", "size", "per slab", "slabs", "out", "cached");
+
+    mutex_acquire(&cache_list_lock);
+    kmem_cache_t *cache;
+    list_for_every_entry(&cache_list, cache, kmem_cache_t, node) {
+        uint cached = 0;
+        for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++)
+            cached += cache->cpu[cpu].count;
+
+        printf("%-16s %8zu %8u %8u %8zu %8u\n", cache->name, cache->obj_size,
+               cache->objs_per_slab, cache->slab_count, cache->objs_out, cached);
+    }
+    mutex_release(&cache_list_lock);
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("kmem", "kmem_cache object caches", &cmd_kmem)
+STATIC_COMMAND_END(kmem);
+
+#endif
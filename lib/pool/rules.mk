@@ -2,7 +2,10 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 
 MODULE := $(LOCAL_DIR)
 
+MODULE_DEPS += lib/heap
+
 MODULE_SRCS += \
+	$(LOCAL_DIR)/kmem_cache.c \
 	$(LOCAL_DIR)/pool.c
 
 include make/module.mk
@@ -22,5 +22,9 @@ lk_time_t current_time(void);
 /* Time in units of microseconds */
 lk_bigtime_t current_time_hires(void);
 
+/* Time in units of nanoseconds. Platforms without a finer source fall back
+ * to current_time_hires() scaled up. */
+lk_time_ns_t current_time_ns(void);
+
 __END_CDECLS
 
@@ -31,5 +31,13 @@ status_t platform_set_oneshot_timer (platform_timer_callback callback, void *arg
 void     platform_stop_timer(void);
 #endif
 
+/* If the platform implements a second, nanosecond resolution one-shot timer alongside
+ * the millisecond one. The deadline is absolute, in current_time_ns() units.
+ */
+#if PLATFORM_HAS_HRTIMER
+status_t platform_set_oneshot_timer_ns(platform_timer_callback callback, void *arg, lk_time_ns_t deadline);
+void     platform_stop_timer_ns(void);
+#endif
+
 __END_CDECLS
 
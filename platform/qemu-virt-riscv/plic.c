@@ -67,27 +67,28 @@ void register_int_handler(unsigned int vector, int_handler handler, void *arg) {
 }
 
 enum handler_return riscv_platform_irq(void) {
-    // see what irq triggered it
-    uint32_t vector = *REG32(PLIC_CLAIM(riscv_current_hart()));
-    LTRACEF("vector %u\n", vector);
+    volatile uint32_t *claim = REG32(PLIC_CLAIM(riscv_current_hart()));
+    enum handler_return ret = INT_NO_RESCHEDULE;
 
-    if (unlikely(vector == 0)) {
-        // nothing pending
-        return INT_NO_RESCHEDULE;
-    }
+    // keep claiming until nothing is pending, so irqs that arrive while
+    // we're here are handled without taking another trap
+    uint32_t vector;
+    while ((vector = *claim) != 0) {
+        LTRACEF("vector %u\n", vector);
 
-    THREAD_STATS_INC(interrupts);
-    KEVLOG_IRQ_ENTER(vector);
+        THREAD_STATS_INC(interrupts);
+        KEVLOG_IRQ_ENTER(vector);
 
-    enum handler_return ret = INT_NO_RESCHEDULE;
-    if (handlers[vector].handler) {
-        ret = handlers[vector].handler(handlers[vector].arg);
-    }
+        const struct int_handlers *h = &handlers[vector];
+        if (likely(h->handler) && h->handler(h->arg) == INT_RESCHEDULE) {
+            ret = INT_RESCHEDULE;
+        }
 
-    // ack the interrupt
-    *REG32(PLIC_COMPLETE(riscv_current_hart())) = vector;
+        // ack the interrupt
+        *claim = vector;
 
-    KEVLOG_IRQ_EXIT(vector);
+        KEVLOG_IRQ_EXIT(vector);
+    }
 
     return ret;
 }
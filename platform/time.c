@@ -0,0 +1,17 @@
+/*
+ * Copyright (c) 2026 The LK Contributors
+ *
+ * Use of this source code is governed by a MIT-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/MIT
+ */
+#include <lk/compiler.h>
+#include <platform/time.h>
+
+/*
+ * default time routines, for platforms without a better source
+ */
+
+__WEAK lk_time_ns_t current_time_ns(void) {
+    return current_time_hires() * 1000;
+}